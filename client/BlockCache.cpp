@@ -0,0 +1,68 @@
+#include "BlockCache.h"
+
+BlockCache::BlockCache(size_t capacity, size_t blockSize)
+	: maxBytes(capacity), blockBytes(blockSize)
+{
+}
+
+const std::string *BlockCache::get(const std::string &path, uint64_t index)
+{
+	auto it = blocks.find({path, index});
+	if (it == blocks.end())
+	{
+		misses++;
+		return nullptr;
+	}
+	if (it->second->expiry <= std::chrono::steady_clock::now())
+	{
+		erase(it);
+		misses++;
+		return nullptr;
+	}
+	hits++;
+	lru.splice(lru.begin(), lru, it->second);
+	return &it->second->data;
+}
+
+void BlockCache::put(const std::string &path, uint64_t index, std::string data, std::chrono::steady_clock::time_point expiry)
+{
+	if (maxBytes == 0 || data.size() > maxBytes)
+		return;
+	auto it = blocks.find({path, index});
+	if (it != blocks.end())
+		erase(it);
+	usedBytes += data.size();
+	lru.push_front(Block{path, index, std::move(data), expiry});
+	blocks[{path, index}] = lru.begin();
+	while (usedBytes > maxBytes)
+		erase(blocks.find({lru.back().path, lru.back().index}));
+}
+
+void BlockCache::forget(const std::string &path)
+{
+	auto it = blocks.lower_bound({path, 0});
+	while (it != blocks.end() && it->first.first.compare(0, path.size(), path) == 0)
+	{
+		const std::string &p = it->first.first;
+		if (p.size() == path.size() || p[path.size()] == '/' || path == "/")
+			erase(it++);
+		else
+			++it;
+	}
+}
+
+CacheStats BlockCache::stats() const
+{
+	CacheStats s;
+	s.hits = hits;
+	s.misses = misses;
+	s.bytes = usedBytes;
+	return s;
+}
+
+void BlockCache::erase(std::map<std::pair<std::string, uint64_t>, std::list<Block>::iterator>::iterator it)
+{
+	usedBytes -= it->second->data.size();
+	lru.erase(it->second);
+	blocks.erase(it);
+}
@@ -0,0 +1,61 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <string>
+
+// Hits and misses of a BlockCache, counted in blocks.
+struct CacheStats
+{
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	size_t bytes = 0; // Data currently cached.
+};
+
+// LRU cache of file data in fixed-size blocks, keyed by path and block index.
+// Each block is valid until the read lease it was fetched under runs out; while
+// the lease lasts the file server holds back other clients' writes to the file.
+// A block shorter than the block size ends the file. Not thread-safe, like Client.
+class BlockCache
+{
+public:
+	static const size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+	// capacity is the most data kept, in bytes; 0 disables caching.
+	explicit BlockCache(size_t capacity = 0, size_t blockSize = DEFAULT_BLOCK_SIZE);
+
+	// Returns the block if it is cached under a live lease, or null. The pointer is
+	// valid until the next put.
+	const std::string *get(const std::string &path, uint64_t index);
+	void put(const std::string &path, uint64_t index, std::string data, std::chrono::steady_clock::time_point expiry);
+	// Drops the blocks of path and of every file below it.
+	void forget(const std::string &path);
+
+	bool enabled() const { return maxBytes > 0; }
+	size_t blockSize() const { return blockBytes; }
+	CacheStats stats() const;
+
+private:
+	struct Block
+	{
+		std::string path;
+		uint64_t index;
+		std::string data;
+		std::chrono::steady_clock::time_point expiry;
+	};
+
+	size_t maxBytes;
+	size_t blockBytes;
+	size_t usedBytes = 0;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	std::list<Block> lru; // Most recently used at the front.
+	std::map<std::pair<std::string, uint64_t>, std::list<Block>::iterator> blocks;
+
+	void erase(std::map<std::pair<std::string, uint64_t>, std::list<Block>::iterator>::iterator it);
+};
+
+#endif // BLOCK_CACHE_H
@@ -2,90 +2,782 @@
 #include "../common/util.h"
 #include "../common/protocol.h"
 
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <cstring>
 #include <iostream>
 #include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <string_view>
+#include <chrono>
+#include <random>
+#include <thread>
+
+// Returns the persistent session for host:port, creating it on first use.
+Session &Client::sessionFor(const std::string &host, int port)
+{
+	std::unique_ptr<Session> &session = sessions[host + ":" + std::to_string(port)];
+	if (!session)
+		session.reset(new Session(host, port, maxMessageSize));
+	return *session;
+}
+
+void Client::setMaxMessageSize(size_t bytes)
+{
+	maxMessageSize = bytes;
+	for (auto &entry : sessions)
+		entry.second->setMaxMessageSize(bytes);
+}
+
+// Helper function to send a request to the specified host and port over its session.
+std::string Client::sendRequest(const std::string &host, int port, const Operation &op)
+{
+	return sessionFor(host, port).call(op);
+}
+
+// Keeps a bounded window of requests in flight so that neither side's socket
+// buffers fill up while the other is still writing.
+std::vector<std::string> Client::pipeline(const std::vector<Target> &targets)
+{
+	std::vector<Session *> owners(targets.size());
+	std::vector<uint32_t> ids(targets.size());
+	std::vector<std::string> results(targets.size());
+	size_t next = 0;
+	for (size_t done = 0; done < targets.size(); done++)
+	{
+		while (next < targets.size() && next - done < MAX_IN_FLIGHT)
+		{
+			owners[next] = &sessionFor(targets[next].host, targets[next].port);
+			ids[next] = owners[next]->submit(targets[next].op);
+			next++;
+		}
+		results[done] = owners[done]->wait(ids[done]);
+	}
+	return results;
+}
+
+// Responses from a file server that mean our cached location is no longer usable.
+static bool isStaleLocation(const std::string &response)
+{
+	return response == "ERR CapabilityExpired" || response == "ERR InvalidCapability" ||
+		   response == "ERR ConnectionFailed" || response == "ERR FileNotFound";
+}
+
+bool Client::lookup(const std::string &path, FileLocation &location, std::string &error)
+{
+	auto it = locations.find(path);
+	// Leave some slack so a capability does not expire while a request is in flight.
+	if (it != locations.end() && it->second.expiry - 5 > std::time(nullptr))
+	{
+		location = it->second;
+		return true;
+	}
+	std::string resp = sendRequest(nsHost, nsPort, Operation{OP_LOOKUP, path});
+	std::istringstream iss(resp);
+	std::string status;
+	iss >> status >> location.ip >> location.port >> location.objectName >> location.capability;
+	if (status != "OK" || iss.fail())
+	{
+		error = resp;
+		return false;
+	}
+	location.expiry = std::strtol(location.capability.c_str(), nullptr, 10);
+	location.stripeUnit = 0;
+	location.servers.clear();
+	std::string server;
+	if (iss >> location.stripeUnit)
+	{
+		while (iss >> server)
+		{
+			size_t colon = server.rfind(':');
+			location.servers.push_back({server.substr(0, colon), std::atoi(server.c_str() + colon + 1)});
+		}
+		if (location.servers.empty())
+			location.stripeUnit = 0;
+	}
+	locations[path] = location;
+	return true;
+}
+
+void Client::forgetLocations(const std::string &path)
+{
+	auto it = locations.lower_bound(path);
+	while (it != locations.end() && it->first.compare(0, path.size(), path) == 0)
+	{
+		const std::string &p = it->first;
+		if (p.size() == path.size() || p[path.size()] == '/' || path == "/")
+			it = locations.erase(it);
+		else
+			++it;
+	}
+}
+
+// Milliseconds to wait before retrying a write that other clients' leases held
+// back, or -1 for any other response.
+static long leaseWait(const std::string &response)
+{
+	if (response.compare(0, 14, "ERR LeaseHeld ") != 0)
+		return -1;
+	return std::atol(response.c_str() + 14);
+}
+
+std::string Client::capabilityFor(const FileLocation &location)
+{
+	if (!cache.enabled())
+		return location.capability;
+	return location.capability + LEASE_HOLDER_SEPARATOR + std::to_string(leaseHolder);
+}
+
+Operation Client::readRequest(const FileLocation &location, size_t offset, size_t length, bool lease)
+{
+	return Operation{OP_READ, location.objectName, lease ? capabilityFor(location) : location.capability, offset, length};
+}
+
+// Servers before the head have already failed the write; the head reports them.
+Operation Client::writeRequest(const FileLocation &location, size_t offset, const std::string &data, size_t head)
+{
+	std::string target = location.objectName;
+	if (location.replicated())
+	{
+		for (size_t i = 0; i < location.servers.size(); i++)
+		{
+			if (i == head)
+				continue;
+			target += CHAIN_SEPARATOR;
+			if (i < head)
+				target += CHAIN_SKIPPED;
+			target += location.servers[i].first + ":" + std::to_string(location.servers[i].second);
+		}
+	}
+	return Operation{OP_WRITE, target, capabilityFor(location), offset, data.size(), data};
+}
+
+std::string Client::readReplicated(const FileLocation &location, size_t offset, size_t length, bool lease)
+{
+	std::string resp = sendRequest(location.ip, location.port, readRequest(location, offset, length, lease));
+	for (size_t i = 0; i < location.servers.size() && resp == "ERR ConnectionFailed"; i++)
+	{
+		const auto &server = location.servers[i];
+		if (server.first != location.ip || server.second != location.port)
+			resp = sendRequest(server.first, server.second, readRequest(location, offset, length, lease));
+	}
+	return resp;
+}
+
+std::string Client::writeReplicated(const FileLocation &location, size_t offset, const std::string &data)
+{
+	std::string resp;
+	for (size_t head = 0; head < location.servers.size(); head++)
+	{
+		const auto &server = location.servers[head];
+		resp = sendRequest(server.first, server.second, writeRequest(location, offset, data, head));
+		if (resp != "ERR ConnectionFailed")
+			break;
+	}
+	return resp;
+}
+
+// Serves what it can from cached blocks. The blocks from the first missing one to
+// the last missing one are fetched in a single block-aligned read and cached if a
+// lease came with them. A short block ends the file, so nothing after it is needed.
+std::string Client::readCached(const std::string &path, const FileLocation &location, size_t offset, size_t length)
+{
+	size_t blockSize = cache.blockSize();
+	uint64_t first = offset / blockSize;
+	uint64_t last = (offset + length - 1) / blockSize;
+	std::vector<std::string> blocks(last - first + 1);
+	uint64_t missFirst = 0, missLast = 0;
+	bool missing = false;
+	for (uint64_t b = first; b <= last; b++)
+	{
+		const std::string *block = cache.get(path, b);
+		if (!block)
+		{
+			if (!missing)
+				missFirst = b;
+			missing = true;
+			missLast = b;
+			continue;
+		}
+		blocks[b - first] = *block;
+		if (block->size() < blockSize)
+			break;
+	}
+
+	if (missing)
+	{
+		// The server's lease starts after this, so it cannot run out before ours.
+		auto sent = std::chrono::steady_clock::now();
+		size_t spanOffset = missFirst * blockSize;
+		size_t spanLength = (missLast - missFirst + 1) * blockSize;
+		std::string resp = location.replicated()
+							   ? readReplicated(location, spanOffset, spanLength, true)
+							   : sendRequest(location.ip, location.port, readRequest(location, spanOffset, spanLength, true));
+		// "[LEASE <ms> ]DATA <n> <bytes>"
+		long lease = 0;
+		size_t start = 0;
+		if (resp.compare(0, 6, "LEASE ") == 0)
+		{
+			lease = std::atol(resp.c_str() + 6);
+			start = resp.find(' ', 6) + 1;
+		}
+		if (resp.compare(start, 5, "DATA ") != 0)
+			return resp.substr(start);
+		size_t space = resp.find(' ', start + 5);
+		if (space == std::string::npos)
+			return "ERR MalformedResponse";
+		std::string_view data = std::string_view(resp).substr(space + 1);
+		auto expiry = sent + std::chrono::milliseconds(lease);
+		for (uint64_t b = missFirst; b <= missLast; b++)
+		{
+			size_t blockStart = (b - missFirst) * blockSize;
+			std::string block(blockStart < data.size() ? data.substr(blockStart, blockSize) : std::string_view());
+			if (lease > 0)
+				cache.put(path, b, block, expiry);
+			blocks[b - first] = std::move(block);
+			if (blocks[b - first].size() < blockSize)
+				break;
+		}
+	}
+
+	std::string result;
+	for (uint64_t b = first; b <= last; b++)
+	{
+		const std::string &block = blocks[b - first];
+		size_t start = (b == first) ? offset - first * blockSize : 0;
+		size_t end = std::min(block.size(), offset + length - b * blockSize);
+		if (start < end)
+			result.append(block, start, end - start);
+		if (block.size() < blockSize)
+			break;
+	}
+	return "DATA " + std::to_string(result.size()) + " " + result;
+}
+
+// Calls fn(server, pieceOffset, pieceLength) for each stripe unit that
+// [offset, offset + length) touches, in file order.
+template <typename Fn>
+static void forEachPiece(const FileLocation &location, size_t offset, size_t length, Fn fn)
+{
+	size_t end = offset + length;
+	while (offset < end)
+	{
+		size_t unit = offset / location.stripeUnit;
+		size_t pieceEnd = std::min(end, (unit + 1) * (size_t)location.stripeUnit);
+		fn(location.servers[unit % location.servers.size()], offset, pieceEnd - offset);
+		offset = pieceEnd;
+	}
+}
+
+// Whether any stripe server holds data at or after position.
+bool Client::extendsPast(const FileLocation &location, size_t position)
+{
+	std::vector<Target> targets;
+	for (const auto &server : location.servers)
+		targets.push_back({server.first, server.second, readRequest(location, position, 1)});
+	for (const auto &response : pipeline(targets))
+	{
+		if (response.compare(0, 7, "DATA 1 ") == 0)
+			return true;
+	}
+	return false;
+}
 
-// Helper function to send a request to the specified host and port.
-std::string Client::sendRequest(const std::string &host, int port, const std::string &request)
+// Every stripe server stores its units at their offsets in the file, so a unit
+// that was never written reads as a hole. Units before the last one that returned
+// data are padded with zeros. When the data ends early, the file may still go on
+// past the range on some server, and then the rest of the range is a hole too.
+std::string Client::readStriped(const FileLocation &location, size_t offset, size_t length)
 {
-	int sockfd;
-	struct sockaddr_in serv_addr;
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0)
+	std::vector<Target> targets;
+	std::vector<size_t> lengths;
+	forEachPiece(location, offset, length, [&](const std::pair<std::string, int> &server, size_t pieceOffset, size_t pieceLength)
+				 {
+		targets.push_back({server.first, server.second, readRequest(location, pieceOffset, pieceLength)});
+		lengths.push_back(pieceLength); });
+	std::vector<std::string> responses = pipeline(targets);
+	std::vector<std::string_view> pieces(responses.size());
+	size_t last = 0;
+	for (size_t i = 0; i < responses.size(); i++)
 	{
-		return "ERR SocketError";
+		// "DATA <n> <bytes>"
+		if (responses[i].compare(0, 5, "DATA ") != 0)
+			return responses[i];
+		size_t space = responses[i].find(' ', 5);
+		if (space == std::string::npos)
+			return "ERR MalformedResponse";
+		pieces[i] = std::string_view(responses[i]).substr(space + 1);
+		if (!pieces[i].empty())
+			last = i + 1;
 	}
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(port);
-	if (inet_pton(AF_INET, host.c_str(), &serv_addr.sin_addr) <= 0)
+	bool partial = last < pieces.size() || (last > 0 && pieces[last - 1].size() < lengths[last - 1]);
+	bool padAll = partial && extendsPast(location, offset + length);
+	if (padAll)
+		last = pieces.size();
+	std::string data;
+	for (size_t i = 0; i < last; i++)
 	{
-		close(sockfd);
-		return "ERR InvalidAddress";
+		data.append(pieces[i].data(), pieces[i].size());
+		if (i + 1 < last || padAll)
+			data.resize(data.size() + lengths[i] - pieces[i].size(), '\0');
 	}
-	if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+	return "DATA " + std::to_string(data.size()) + " " + data;
+}
+
+std::string Client::writeStriped(const FileLocation &location, size_t offset, const std::string &data)
+{
+	std::vector<Target> targets;
+	forEachPiece(location, offset, data.size(), [&](const std::pair<std::string, int> &server, size_t pieceOffset, size_t pieceLength)
+				 { targets.push_back({server.first, server.second,
+									  writeRequest(location, pieceOffset, data.substr(pieceOffset - offset, pieceLength))}); });
+	size_t written = 0;
+	for (const auto &response : pipeline(targets))
 	{
-		close(sockfd);
-		return "ERR ConnectionFailed";
+		if (response.compare(0, 3, "OK ") != 0)
+			return response;
+		written += std::strtoul(response.c_str() + 3, nullptr, 10);
 	}
-	sendMessage(sockfd, request);
-	std::string response;
-	readMessage(sockfd, response);
-	close(sockfd);
-	return response;
+	return "OK " + std::to_string(written);
 }
 
 Client::Client(const std::string &nsHost, int nsPort)
 	: nsHost(nsHost), nsPort(nsPort)
 {
+	std::random_device random;
+	leaseHolder = ((uint64_t)random() << 32 | random()) | 1;
+}
+
+Client::~Client()
+{
+	flush();
+}
+
+void Client::setCacheCapacity(size_t capacity, size_t blockSize)
+{
+	cache = BlockCache(capacity, blockSize);
+}
+
+std::string Client::setWriteBack(size_t bufferBytes, int delayMs)
+{
+	writeBackBytes = bufferBytes;
+	writeBackDelay = std::chrono::milliseconds(delayMs);
+	return bufferBytes == 0 ? flush() : "OK";
+}
+
+// Overlapping and adjacent extents are merged into one, the new data on top. The
+// extent the write starts in grows in place, so appends do not copy what is
+// already buffered.
+void Client::bufferWrite(const std::string &path, size_t offset, const std::string &data)
+{
+	if (data.empty())
+		return;
+	std::map<size_t, std::string> &extents = dirty[path];
+	if (dirtyBytes == 0)
+		oldestDirty = std::chrono::steady_clock::now();
+	auto it = extents.upper_bound(offset);
+	if (it != extents.begin() && std::prev(it)->first + std::prev(it)->second.size() >= offset)
+		--it;
+	else
+		it = extents.emplace_hint(it, offset, std::string());
+	std::string &merged = it->second;
+	size_t start = it->first;
+	dirtyBytes -= merged.size();
+	if (merged.size() < offset + data.size() - start)
+		merged.resize(offset + data.size() - start);
+	merged.replace(offset - start, data.size(), data);
+	// Take in the extents the merged one now reaches.
+	for (auto next = std::next(it); next != extents.end() && next->first <= start + merged.size();)
+	{
+		size_t covered = start + merged.size() - next->first;
+		if (next->second.size() > covered)
+			merged.append(next->second, covered, std::string::npos);
+		dirtyBytes -= next->second.size();
+		next = extents.erase(next);
+	}
+	dirtyBytes += merged.size();
+}
+
+std::string Client::flushFiles(const std::vector<std::string> &paths)
+{
+	std::vector<WriteRequest> writes;
+	for (const auto &path : paths)
+	{
+		auto it = dirty.find(path);
+		if (it == dirty.end())
+			continue;
+		for (auto &[offset, data] : it->second)
+		{
+			dirtyBytes -= data.size();
+			writes.push_back({path, offset, std::move(data)});
+		}
+		dirty.erase(it);
+	}
+	for (const auto &response : writeBatchDirect(writes))
+	{
+		if (response.compare(0, 3, "OK ") != 0)
+			return response;
+	}
+	return "OK";
+}
+
+std::string Client::flushIfDue()
+{
+	if (dirtyBytes == 0 || std::chrono::steady_clock::now() - oldestDirty < writeBackDelay)
+		return "OK";
+	return flush();
+}
+
+std::string Client::flush()
+{
+	std::vector<std::string> paths;
+	for (const auto &entry : dirty)
+		paths.push_back(entry.first);
+	return flushFiles(paths);
+}
+
+std::string Client::close(const std::string &path)
+{
+	return flushFiles({path});
 }
 
 bool Client::login(const std::string &username, const std::string &password)
 {
-	std::string req = "LOGIN " + username + " " + password;
-	std::string resp = sendRequest(nsHost, nsPort, req);
+	std::string resp = sendRequest(nsHost, nsPort, Operation{OP_LOGIN, username, "", 0, 0, password});
 	return resp == "OK";
 }
 
 std::string Client::list(const std::string &path)
 {
-	std::string req = "LIST " + path;
-	return sendRequest(nsHost, nsPort, req);
+	return sendRequest(nsHost, nsPort, Operation{OP_LIST, path});
 }
 
-std::string Client::createFile(const std::string &path)
+std::string Client::createFile(const std::string &path, uint32_t stripeUnit, size_t stripeCount)
 {
-	std::string req = "CREATE_FILE " + path;
-	return sendRequest(nsHost, nsPort, req);
+	return sendRequest(nsHost, nsPort, Operation{OP_CREATE_FILE, path, "", stripeCount, stripeUnit});
 }
 
 std::string Client::mkdir(const std::string &path)
 {
-	std::string req = "MKDIR " + path;
-	return sendRequest(nsHost, nsPort, req);
+	return sendRequest(nsHost, nsPort, Operation{OP_MKDIR, path});
 }
 
 std::string Client::deletePath(const std::string &path)
 {
-	std::string req = "DELETE " + path;
-	return sendRequest(nsHost, nsPort, req);
+	forgetLocations(path);
+	cache.forget(path);
+	// Buffered writes to the deleted files are dropped.
+	for (auto it = dirty.lower_bound(path); it != dirty.end() && it->first.compare(0, path.size(), path) == 0;)
+	{
+		const std::string &p = it->first;
+		if (p.size() == path.size() || p[path.size()] == '/' || path == "/")
+		{
+			for (const auto &extent : it->second)
+				dirtyBytes -= extent.second.size();
+			it = dirty.erase(it);
+		}
+		else
+			++it;
+	}
+	return sendRequest(nsHost, nsPort, Operation{OP_DELETE, path});
 }
 
+// Data goes straight to the file server; the namespace server is only asked for
+// the location. A stale location is looked up again once.
 std::string Client::readFile(const std::string &path, size_t offset, size_t length)
 {
-	// The request is sent to the Namespace Server, which forwards it to the appropriate file server.
-	std::string req = "READ " + path + " " + std::to_string(offset) + " " + std::to_string(length);
-	return sendRequest(nsHost, nsPort, req);
+	if (length > TRANSFER_CHUNK)
+	{
+		// The data goes straight into the response, whose header is fixed up once
+		// the length read is known.
+		std::string data = "DATA " + std::to_string(length) + " ";
+		size_t head = data.size();
+		std::string resp = readStream(path, offset, length, [&data](const char *bytes, size_t n)
+									  {
+			data.append(bytes, n);
+			return true; });
+		if (resp.compare(0, 3, "OK ") != 0)
+			return resp;
+		data.replace(0, head, "DATA " + std::to_string(data.size() - head) + " ");
+		return data;
+	}
+	// Buffered writes anywhere in the file may change what the read returns, even
+	// past its end, since they make the file longer.
+	std::string resp = flushIfDue();
+	if (resp == "OK")
+		resp = close(path);
+	if (resp != "OK")
+		return resp;
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		FileLocation location;
+		if (!lookup(path, location, resp))
+			return resp;
+		if (location.stripeUnit != 0)
+			resp = readStriped(location, offset, length);
+		else if (cache.enabled() && length > 0)
+			resp = readCached(path, location, offset, length);
+		else if (location.replicated())
+			resp = readReplicated(location, offset, length);
+		else
+			resp = sendRequest(location.ip, location.port, readRequest(location, offset, length));
+		if (!isStaleLocation(resp))
+			break;
+		locations.erase(path);
+	}
+	return resp;
+}
+
+// Short ranges go through readFile, and so through the block cache.
+std::string Client::readFile(const std::string &path, size_t offset, char *buffer, size_t length)
+{
+	if (length > TRANSFER_CHUNK)
+	{
+		size_t filled = 0;
+		return readStream(path, offset, length, [buffer, &filled](const char *bytes, size_t n)
+						  {
+			memcpy(buffer + filled, bytes, n);
+			filled += n;
+			return true; });
+	}
+	// "DATA <n> <bytes>"
+	std::string resp = readFile(path, offset, length);
+	if (resp.compare(0, 5, "DATA ") != 0)
+		return resp;
+	size_t space = resp.find(' ', 5);
+	if (space == std::string::npos)
+		return "ERR MalformedResponse";
+	size_t n = resp.size() - space - 1;
+	memcpy(buffer, resp.data() + space + 1, n);
+	return "OK " + std::to_string(n);
+}
+
+// Writes held back by other clients' leases are retried once the leases run out.
+std::string Client::writeDirect(const std::string &path, size_t offset, const std::string &data)
+{
+	std::string resp;
+	int leaseWaits = 0;
+	cache.forget(path);
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		FileLocation location;
+		if (!lookup(path, location, resp))
+			return resp;
+		if (location.stripeUnit != 0)
+			resp = writeStriped(location, offset, data);
+		else if (location.replicated())
+			resp = writeReplicated(location, offset, data);
+		else
+			resp = sendRequest(location.ip, location.port, writeRequest(location, offset, data));
+		long wait = leaseWait(resp);
+		if (wait >= 0 && leaseWaits++ < MAX_LEASE_WAITS)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+			attempt--;
+			continue;
+		}
+		if (!isStaleLocation(resp))
+			break;
+		locations.erase(path);
+	}
+	return resp;
+}
+
+std::vector<std::string> Client::readBatch(const std::vector<ReadRequest> &reads)
+{
+	std::vector<Target> targets;
+	std::vector<std::string> results(reads.size());
+	std::vector<size_t> slots;
+	flushIfDue();
+	for (size_t i = 0; i < reads.size(); i++)
+	{
+		results[i] = close(reads[i].path);
+		if (results[i] != "OK")
+			continue;
+		FileLocation location;
+		if (!lookup(reads[i].path, location, results[i]))
+			continue;
+		if (location.stripeUnit != 0 || reads[i].length > TRANSFER_CHUNK)
+		{
+			results[i] = readFile(reads[i].path, reads[i].offset, reads[i].length);
+			continue;
+		}
+		targets.push_back({location.ip, location.port, readRequest(location, reads[i].offset, reads[i].length)});
+		slots.push_back(i);
+	}
+	std::vector<std::string> responses = pipeline(targets);
+	for (size_t j = 0; j < slots.size(); j++)
+	{
+		const ReadRequest &r = reads[slots[j]];
+		// Entries that raced with a location change are retried individually.
+		if (isStaleLocation(responses[j]))
+		{
+			locations.erase(r.path);
+			responses[j] = readFile(r.path, r.offset, r.length);
+		}
+		results[slots[j]] = responses[j];
+	}
+	return results;
+}
+
+// Writes longer than a chunk are sent as one write per chunk, and each gets the
+// first error of its chunks or their total.
+std::vector<std::string> Client::writeBatchDirect(const std::vector<WriteRequest> &writes)
+{
+	std::vector<std::string> results(writes.size());
+	if (std::any_of(writes.begin(), writes.end(), [](const WriteRequest &w)
+					{ return w.data.size() > TRANSFER_CHUNK; }))
+	{
+		std::vector<WriteRequest> chunks;
+		std::vector<size_t> owners;
+		for (size_t i = 0; i < writes.size(); i++)
+		{
+			for (size_t pos = 0; pos == 0 || pos < writes[i].data.size(); pos += TRANSFER_CHUNK)
+			{
+				chunks.push_back({writes[i].path, writes[i].offset + pos, writes[i].data.substr(pos, TRANSFER_CHUNK)});
+				owners.push_back(i);
+			}
+		}
+		std::vector<size_t> written(writes.size());
+		std::vector<std::string> responses = writeBatchDirect(chunks);
+		for (size_t j = 0; j < chunks.size(); j++)
+		{
+			std::string &result = results[owners[j]];
+			if (!result.empty())
+				continue;
+			if (responses[j].compare(0, 3, "OK ") != 0)
+				result = responses[j];
+			else
+				written[owners[j]] += std::strtoul(responses[j].c_str() + 3, nullptr, 10);
+		}
+		for (size_t i = 0; i < writes.size(); i++)
+		{
+			if (results[i].empty())
+				results[i] = "OK " + std::to_string(written[i]);
+		}
+		return results;
+	}
+
+	std::vector<Target> targets;
+	std::vector<size_t> slots;
+	for (size_t i = 0; i < writes.size(); i++)
+	{
+		cache.forget(writes[i].path);
+		FileLocation location;
+		if (!lookup(writes[i].path, location, results[i]))
+			continue;
+		if (location.stripeUnit != 0)
+		{
+			results[i] = writeDirect(writes[i].path, writes[i].offset, writes[i].data);
+			continue;
+		}
+		// Replicated writes go to the head of the chain.
+		const auto &server = location.replicated() ? location.servers[0] : std::make_pair(location.ip, location.port);
+		targets.push_back({server.first, server.second, writeRequest(location, writes[i].offset, writes[i].data)});
+		slots.push_back(i);
+	}
+	std::vector<std::string> responses = pipeline(targets);
+	for (size_t j = 0; j < slots.size(); j++)
+	{
+		const WriteRequest &w = writes[slots[j]];
+		if (isStaleLocation(responses[j]) || leaseWait(responses[j]) >= 0)
+		{
+			locations.erase(w.path);
+			responses[j] = writeDirect(w.path, w.offset, w.data);
+		}
+		results[slots[j]] = responses[j];
+	}
+	return results;
 }
 
 std::string Client::writeFile(const std::string &path, size_t offset, const std::string &data)
 {
-	// The request is sent to the Namespace Server, which forwards it to the appropriate file server.
-	std::string req = "WRITE " + path + " " + std::to_string(offset) + " " + data;
-	return sendRequest(nsHost, nsPort, req);
+	if (writeBackBytes == 0)
+		return data.size() > TRANSFER_CHUNK ? writeFile(path, offset, data.data(), data.size()) : writeDirect(path, offset, data);
+	bufferWrite(path, offset, data);
+	std::string resp = dirtyBytes > writeBackBytes ? flush() : flushIfDue();
+	return resp == "OK" ? "OK " + std::to_string(data.size()) : resp;
+}
+
+// Only the chunks in flight are copied out of the caller's buffer.
+std::string Client::writeFile(const std::string &path, size_t offset, const char *data, size_t size)
+{
+	if (size <= TRANSFER_CHUNK)
+		return writeFile(path, offset, std::string(data, size));
+	size_t taken = 0;
+	return writeStream(path, offset, [data, size, &taken](char *buffer, size_t space)
+					   {
+		size_t n = std::min(space, size - taken);
+		memcpy(buffer, data + taken, n);
+		taken += n;
+		return n; });
+}
+
+std::vector<std::string> Client::writeBatch(const std::vector<WriteRequest> &writes)
+{
+	if (writeBackBytes == 0)
+		return writeBatchDirect(writes);
+	std::vector<std::string> results;
+	for (const auto &w : writes)
+		results.push_back(writeFile(w.path, w.offset, w.data));
+	return results;
+}
+
+std::string Client::readStream(const std::string &path, size_t offset, size_t length,
+							   const std::function<bool(const char *, size_t)> &sink)
+{
+	size_t done = 0;
+	while (done < length)
+	{
+		std::vector<ReadRequest> reads;
+		for (size_t pos = done; pos < length && reads.size() < STREAM_WINDOW; pos += TRANSFER_CHUNK)
+			reads.push_back({path, offset + pos, std::min(TRANSFER_CHUNK, length - pos)});
+		std::vector<std::string> responses = readBatch(reads);
+		for (size_t i = 0; i < reads.size(); i++)
+		{
+			// "DATA <n> <bytes>"
+			const std::string &resp = responses[i];
+			if (resp.compare(0, 5, "DATA ") != 0)
+				return resp;
+			size_t space = resp.find(' ', 5);
+			if (space == std::string::npos)
+				return "ERR MalformedResponse";
+			size_t n = resp.size() - space - 1;
+			if (n > 0 && !sink(resp.data() + space + 1, n))
+				return "OK " + std::to_string(done + n);
+			done += n;
+			// A short chunk ends the file.
+			if (n < reads[i].length)
+				return "OK " + std::to_string(done);
+		}
+	}
+	return "OK " + std::to_string(done);
+}
+
+std::string Client::writeStream(const std::string &path, size_t offset, const std::function<size_t(char *, size_t)> &source)
+{
+	size_t position = offset;
+	bool more = true;
+	while (more)
+	{
+		std::vector<WriteRequest> writes;
+		while (writes.size() < STREAM_WINDOW)
+		{
+			std::string data(TRANSFER_CHUNK, '\0');
+			size_t n = source(&data[0], data.size());
+			if (n == 0)
+			{
+				more = false;
+				break;
+			}
+			data.resize(n);
+			writes.push_back({path, position, std::move(data)});
+			position += n;
+		}
+		for (const auto &response : writeBatch(writes))
+		{
+			if (response.compare(0, 3, "OK ") != 0)
+				return response;
+		}
+	}
+	return "OK " + std::to_string(position - offset);
 }
@@ -1,25 +1,177 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <chrono>
+#include <functional>
 #include <string>
+#include <map>
+#include <memory>
+#include <vector>
+#include "BlockCache.h"
+#include "Session.h"
+
+// One entry of a pipelined read batch.
+struct ReadRequest
+{
+	std::string path;
+	size_t offset;
+	size_t length;
+};
+
+// One entry of a pipelined write batch.
+struct WriteRequest
+{
+	std::string path;
+	size_t offset;
+	std::string data;
+};
+
+// Where a file's data lives, as returned by the namespace server's LOOKUP.
+struct FileLocation
+{
+	std::string ip;
+	int port;
+	std::string objectName;
+	std::string capability;
+	long expiry; // Unix time after which the capability is no longer accepted.
+	// Striped files: stripe unit i of the file is on servers[i % servers.size()].
+	// Replicated files have stripe unit 0: ip and port name the replica to read
+	// from, and servers is the chain writes go down.
+	uint32_t stripeUnit = 0;
+	std::vector<std::pair<std::string, int>> servers;
+	bool replicated() const { return stripeUnit == 0 && !servers.empty(); }
+};
+
+// A request addressed to a particular server, used to build pipelines.
+struct Target
+{
+	std::string host;
+	int port;
+	Operation op;
+};
 
 class Client
 {
 public:
 	Client(const std::string &nsHost, int nsPort);
+	// Writes out anything still buffered.
+	~Client();
 	bool login(const std::string &username, const std::string &password);
 	std::string list(const std::string &path);
-	std::string createFile(const std::string &path);
+	// A non-zero stripeUnit stripes the file over stripeCount file servers (0 for all).
+	std::string createFile(const std::string &path, uint32_t stripeUnit = 0, size_t stripeCount = 0);
 	std::string mkdir(const std::string &path);
 	std::string deletePath(const std::string &path);
 	std::string readFile(const std::string &path, size_t offset, size_t length);
 	std::string writeFile(const std::string &path, size_t offset, const std::string &data);
+	// The same, reading into and writing from the caller's buffer. Ranges longer
+	// than a chunk are streamed chunk by chunk, so no copy of the whole range is
+	// made. Both return "OK <bytes>" or the first error.
+	std::string readFile(const std::string &path, size_t offset, char *buffer, size_t length);
+	std::string writeFile(const std::string &path, size_t offset, const char *data, size_t size);
+
+	// Pipelined batches: all requests are put on the wire before the responses are
+	// collected, so a batch costs roughly one round trip instead of one per entry.
+	// Results are returned in the order of the requests.
+	std::vector<std::string> readBatch(const std::vector<ReadRequest> &reads);
+	std::vector<std::string> writeBatch(const std::vector<WriteRequest> &writes);
+
+	// Streaming transfers. A range is moved in READs or WRITEs of at most
+	// TRANSFER_CHUNK bytes, STREAM_WINDOW of them in flight at a time, so the client
+	// holds a few chunks however long the range is. readStream hands the data to sink
+	// in file order and stops at the end of the file or when sink returns false.
+	// writeStream writes what source puts in the buffer it is given, up to the
+	// buffer's size, until source returns 0. Both return "OK <bytes>" or the first
+	// error. readFile, writeFile and the batches split ranges longer than a chunk
+	// the same way; the string forms hold all of the data once.
+	std::string readStream(const std::string &path, size_t offset, size_t length,
+						   const std::function<bool(const char *, size_t)> &sink);
+	std::string writeStream(const std::string &path, size_t offset, const std::function<size_t(char *, size_t)> &source);
+
+	// Longest response accepted from a server. It should match the File Servers'
+	// --max-message; the default matches theirs.
+	void setMaxMessageSize(size_t bytes);
+
+	// Keeps up to capacity bytes of file data in memory, fetched in blocks of
+	// blockSize bytes under read leases. readFile serves cached blocks without asking
+	// the file server; striped files and readBatch always go to the servers.
+	// Capacity 0 turns the cache off, which is the default.
+	void setCacheCapacity(size_t capacity, size_t blockSize = BlockCache::DEFAULT_BLOCK_SIZE);
+	CacheStats cacheStats() const { return cache.stats(); }
+
+	// Write-back mode: writeFile and writeBatch only buffer the data, merging
+	// adjacent and overlapping writes to the same file, and answer "OK <n>" at once.
+	// Buffers are written out when they hold more than bufferBytes in total, when
+	// the oldest is older than delayMs (checked whenever the client reads or
+	// writes), by flush() and close(), and before this client reads a file it has
+	// buffered writes for. A write that triggers a write-out returns its error, if
+	// any. bufferBytes 0 writes out what is buffered and turns write-back off, which
+	// is the default.
+	std::string setWriteBack(size_t bufferBytes, int delayMs = 100);
+	// Writes out every buffered write. Returns "OK" or the first error.
+	std::string flush();
+	// Writes out the buffered writes to path.
+	std::string close(const std::string &path);
 
 private:
 	std::string nsHost;
 	int nsPort;
+	// Locations resolved through LOOKUP, reused until shortly before the capability expires.
+	std::map<std::string, FileLocation> locations;
+	// Persistent sessions, keyed by "host:port".
+	std::map<std::string, std::unique_ptr<Session>> sessions;
+	size_t maxMessageSize = MAX_MESSAGE_SIZE;
+	// Upper bound on requests in flight per session during a batch.
+	static const size_t MAX_IN_FLIGHT = 64;
+	// Chunks a stream keeps in flight.
+	static const size_t STREAM_WINDOW = 4;
+	BlockCache cache;
+	// Names this client to file servers when the cache is on (see LEASE_HOLDER_SEPARATOR).
+	uint64_t leaseHolder;
+	// Times a write is retried after waiting for other clients' leases.
+	static const int MAX_LEASE_WAITS = 4;
+	// Write-back buffers: per path, non-overlapping extents keyed by file offset.
+	std::map<std::string, std::map<size_t, std::string>> dirty;
+	size_t dirtyBytes = 0;
+	size_t writeBackBytes = 0;
+	std::chrono::milliseconds writeBackDelay{100};
+	std::chrono::steady_clock::time_point oldestDirty;
+
+	Session &sessionFor(const std::string &host, int port);
 	// Helper to send a request to a given host and port.
-	std::string sendRequest(const std::string &host, int port, const std::string &request);
+	std::string sendRequest(const std::string &host, int port, const Operation &op);
+	// Sends requests with up to MAX_IN_FLIGHT outstanding at a time.
+	std::vector<std::string> pipeline(const std::vector<Target> &targets);
+
+	// Resolves the file server and capability for path, from cache or via LOOKUP.
+	bool lookup(const std::string &path, FileLocation &location, std::string &error);
+	// Drops cached locations for path and everything below it.
+	void forgetLocations(const std::string &path);
+	// The capability to send, naming this client as lease holder while the cache is on.
+	std::string capabilityFor(const FileLocation &location);
+	// lease names the holder on the read, which asks for a lease.
+	Operation readRequest(const FileLocation &location, size_t offset, size_t length, bool lease = false);
+	// A replicated file's write goes to servers[head] and names the rest of the chain.
+	Operation writeRequest(const FileLocation &location, size_t offset, const std::string &data, size_t head = 0);
+	// Striped I/O: the range is split at stripe unit boundaries and the pieces go
+	// to their servers in parallel.
+	std::string readStriped(const FileLocation &location, size_t offset, size_t length);
+	std::string writeStriped(const FileLocation &location, size_t offset, const std::string &data);
+	bool extendsPast(const FileLocation &location, size_t position);
+	// Replicated I/O: a replica that cannot be reached is passed over for the next.
+	std::string readReplicated(const FileLocation &location, size_t offset, size_t length, bool lease = false);
+	std::string writeReplicated(const FileLocation &location, size_t offset, const std::string &data);
+	// Write-back: merges a write into the buffers of its file.
+	void bufferWrite(const std::string &path, size_t offset, const std::string &data);
+	// Writes out the buffers of the given files in one pipelined batch.
+	std::string flushFiles(const std::vector<std::string> &paths);
+	// Writes out everything once the oldest buffer is older than the delay.
+	std::string flushIfDue();
+	// Unbuffered writes.
+	std::string writeDirect(const std::string &path, size_t offset, const std::string &data);
+	std::vector<std::string> writeBatchDirect(const std::vector<WriteRequest> &writes);
+	// Reads through the block cache.
+	std::string readCached(const std::string &path, const FileLocation &location, size_t offset, size_t length);
 };
 
 #endif // CLIENT_H
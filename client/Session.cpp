@@ -0,0 +1,181 @@
+#include "Session.h"
+#include "../common/util.h"
+#include "../common/protocol.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+
+// Renders an operation in the text protocol.
+static std::string encodeText(const Operation &op)
+{
+	switch (op.opcode)
+	{
+	case OP_LOGIN:
+		return "LOGIN " + op.path + " " + op.data;
+	case OP_LIST:
+		return "LIST " + op.path;
+	case OP_CREATE_FILE:
+		if (op.length != 0)
+			return "CREATE_FILE " + op.path + " " + std::to_string(op.length) + " " + std::to_string(op.offset);
+		return "CREATE_FILE " + op.path;
+	case OP_MKDIR:
+		return "MKDIR " + op.path;
+	case OP_DELETE:
+		return "DELETE " + op.path;
+	case OP_LOOKUP:
+		return "LOOKUP " + op.path;
+	case OP_READ:
+		return "READ " + op.path + " " + std::to_string(op.offset) + " " + std::to_string(op.length) + " " + op.token;
+	case OP_WRITE:
+		return "WRITE " + op.path + " " + std::to_string(op.offset) + " " + op.token + " " + op.data;
+	case OP_CREATE:
+		return "CREATE " + op.path;
+	}
+	return "";
+}
+
+// Converts a binary response back to the text the text protocol would have returned.
+static std::string decodeResponse(const BinaryMessage &msg)
+{
+	if (msg.header.status != STATUS_OK)
+		return std::string(msg.payload);
+	switch (msg.header.opcode)
+	{
+	case OP_READ:
+	{
+		std::string lease = (msg.header.flags & FLAG_LEASE) ? "LEASE " + std::to_string(msg.header.offset) + " " : "";
+		return lease + "DATA " + std::to_string(msg.payload.size()) + " " + std::string(msg.payload);
+	}
+	case OP_WRITE:
+		return "OK " + std::to_string(msg.header.length);
+	default:
+		return std::string(msg.payload);
+	}
+}
+
+Session::Session(const std::string &host, int port, size_t maxMessageSize)
+	: host(host), port(port), maxMessageSize(maxMessageSize)
+{
+}
+
+Session::~Session()
+{
+	if (sockfd >= 0)
+		close(sockfd);
+}
+
+// Makes sure there is a usable connection. An idle connection that the server has
+// closed (e.g. after a restart) is replaced before anything is sent on it.
+bool Session::ensureConnected()
+{
+	if (sockfd >= 0 && pending.empty())
+	{
+		char byte;
+		ssize_t n = recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (!(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+		{
+			close(sockfd);
+			sockfd = -1;
+		}
+	}
+	if (sockfd < 0)
+	{
+		sockfd = connectToServer(host, port);
+		if (sockfd < 0)
+			return false;
+		// Ask for the binary protocol; servers that do not know it keep us on text.
+		std::string reply;
+		if (sendMessage(sockfd, BINARY_HELLO) < 0 || readMessage(sockfd, reply, maxMessageSize) <= 0)
+		{
+			close(sockfd);
+			sockfd = -1;
+			return false;
+		}
+		binary = (reply == BINARY_ACCEPT);
+	}
+	return true;
+}
+
+// Drops the connection. Every request still waiting for a response fails.
+void Session::fail()
+{
+	if (sockfd >= 0)
+		close(sockfd);
+	sockfd = -1;
+	for (uint32_t id : pending)
+		ready[id] = "ERR ConnectionFailed";
+	pending.clear();
+}
+
+uint32_t Session::submit(const Operation &op)
+{
+	uint32_t id = nextId++;
+	if (nextId == 0)
+		nextId = 1;
+	if (!ensureConnected())
+	{
+		ready[id] = "ERR ConnectionFailed";
+		return id;
+	}
+	pending.insert(id);
+	std::string frame;
+	if (binary)
+	{
+		MessageHeader h;
+		h.opcode = op.opcode;
+		h.requestId = id;
+		h.offset = op.offset;
+		h.length = (op.opcode == OP_WRITE) ? op.data.size() : op.length;
+		frame = encodeMessage(h, op.path, op.token, op.data);
+	}
+	else
+		frame = tagMessage(id, encodeText(op));
+	if (sendMessage(sockfd, frame) < 0)
+		fail();
+	return id;
+}
+
+std::string Session::wait(uint32_t id)
+{
+	while (ready.find(id) == ready.end())
+	{
+		if (pending.find(id) == pending.end())
+			return "ERR UnknownRequest";
+		std::string message;
+		if (readMessage(sockfd, message, maxMessageSize) <= 0)
+		{
+			fail();
+			break;
+		}
+		uint32_t respId;
+		std::string body;
+		bool valid;
+		if (binary)
+		{
+			BinaryMessage msg;
+			valid = decodeMessage(message, msg);
+			respId = msg.header.requestId;
+			if (valid)
+				body = decodeResponse(msg);
+		}
+		else
+			valid = untagMessage(message, respId, body);
+		if (!valid || pending.erase(respId) == 0)
+		{
+			// The stream is out of sync; nothing on it can be trusted any more.
+			fail();
+			break;
+		}
+		ready[respId] = std::move(body);
+	}
+	auto it = ready.find(id);
+	std::string response = it->second;
+	ready.erase(it);
+	return response;
+}
+
+std::string Session::call(const Operation &op)
+{
+	return wait(submit(op));
+}
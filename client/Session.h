@@ -0,0 +1,64 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include "../common/util.h"
+
+// A request in protocol-neutral form. The session encodes it as text or binary,
+// depending on what the server agreed to when the connection was opened.
+struct Operation
+{
+	uint8_t opcode; // One of the Opcode values in protocol.h.
+	std::string path;
+	std::string token; // Capability, for READ and WRITE.
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	std::string data; // WRITE payload, or the LOGIN password.
+};
+
+// A long-lived connection to one server that can carry many requests at once.
+// Each request carries an id (a "#<id>" tag in text mode, the header's requestId
+// in binary mode), so responses are matched by id and may arrive in any order.
+// Responses are returned in text-protocol form either way.
+class Session
+{
+public:
+	// Responses longer than maxMessageSize fail the connection. It should match the
+	// server's limit (the File Server's --max-message).
+	Session(const std::string &host, int port, size_t maxMessageSize = MAX_MESSAGE_SIZE);
+	~Session();
+	Session(const Session &) = delete;
+	Session &operator=(const Session &) = delete;
+
+	// Sends a request without waiting for the response. Returns its id.
+	uint32_t submit(const Operation &op);
+	// Blocks until the response to the given id arrives.
+	std::string wait(uint32_t id);
+	// Sends a request and waits for its response.
+	std::string call(const Operation &op);
+
+	// Number of submitted requests whose responses have not been collected.
+	size_t inFlight() const { return pending.size() + ready.size(); }
+
+	void setMaxMessageSize(size_t bytes) { maxMessageSize = bytes; }
+
+private:
+	std::string host;
+	int port;
+	size_t maxMessageSize;
+	int sockfd = -1;
+	bool binary = false; // Whether the server accepted BINARY_HELLO.
+	uint32_t nextId = 1;
+	// Ids that have been sent but not answered yet.
+	std::set<uint32_t> pending;
+	// Responses that arrived before anyone waited for them.
+	std::unordered_map<uint32_t, std::string> ready;
+
+	bool ensureConnected();
+	void fail();
+};
+
+#endif // SESSION_H
@@ -1,12 +1,27 @@
 #include "Client.h"
 #include "../common/protocol.h" // For trim() function.
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
 
-int main()
+int main(int argc, char *argv[])
 {
 	Client client("127.0.0.1", 4000); // Connect to Namespace Server on port 4000
+	// --max-message=KIB matches the File Servers' limit.
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg.compare(0, 14, "--max-message=") == 0)
+			client.setMaxMessageSize(std::strtoul(arg.c_str() + 14, nullptr, 10) * 1024);
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--max-message=KIB]\n";
+			return 1;
+		}
+	}
 	std::string username, password;
 	std::cout << "Enter username: ";
 	std::cin >> username;
@@ -48,8 +63,10 @@ int main()
 		else if (command == "create")
 		{
 			std::string path;
-			iss >> path;
-			std::string resp = client.createFile(path);
+			uint32_t stripeUnit = 0;
+			size_t stripeCount = 0;
+			iss >> path >> stripeUnit >> stripeCount;
+			std::string resp = client.createFile(path, stripeUnit, stripeCount);
 			std::cout << resp << "\n";
 		}
 		else if (command == "rm")
@@ -80,6 +97,42 @@ int main()
 			std::string resp = client.writeFile(path, offset, data);
 			std::cout << resp << "\n";
 		}
+		else if (command == "get" || command == "put")
+		{
+			// "get <path> <localFile>" and "put <localFile> <path>" stream a whole file
+			// in chunks, so it never has to fit in memory.
+			std::string from, to;
+			iss >> from >> to;
+			std::string resp;
+			if (command == "get")
+			{
+				std::ofstream out(to, std::ios::binary);
+				if (!out)
+					resp = "ERR CannotOpen " + to;
+				else
+					resp = client.readStream(from, 0, SIZE_MAX, [&out](const char *data, size_t n)
+											 { return (bool)out.write(data, n); });
+			}
+			else
+			{
+				std::ifstream in(from, std::ios::binary);
+				if (!in)
+					resp = "ERR CannotOpen " + from;
+				else
+					resp = client.writeStream(to, 0, [&in](char *buffer, size_t size)
+											  { return (size_t)in.read(buffer, size).gcount(); });
+			}
+			std::cout << resp << "\n";
+		}
+		else if (command == "cache")
+		{
+			// "cache <bytes>" sizes the block cache (0 turns it off); "cache" shows its counters.
+			size_t capacity;
+			if (iss >> capacity)
+				client.setCacheCapacity(capacity);
+			CacheStats stats = client.cacheStats();
+			std::cout << "hits=" << stats.hits << " misses=" << stats.misses << " bytes=" << stats.bytes << "\n";
+		}
 		else
 		{
 			std::cout << "Unknown command\n";
@@ -0,0 +1,89 @@
+#include "capability.h"
+#include "util.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+
+// The signing key comes from NFS_CAPABILITY_SECRET; every server in a deployment
+// must be started with the same value.
+static const std::string &capabilitySecret()
+{
+	static const std::string secret = []
+	{
+		const char *env = std::getenv("NFS_CAPABILITY_SECRET");
+		if (env && *env)
+			return std::string(env);
+		std::cerr << "Warning: NFS_CAPABILITY_SECRET not set, using the built-in development key\n";
+		return std::string("stateless-nfs-development-key");
+	}();
+	return secret;
+}
+
+static std::string computeMac(const std::string &objectName, const std::string &mode, long expiry)
+{
+	std::string payload = objectName + "|" + mode + "|" + std::to_string(expiry);
+	const std::string &key = capabilitySecret();
+	unsigned char mac[EVP_MAX_MD_SIZE];
+	unsigned int macLen = 0;
+	HMAC(EVP_sha256(), key.data(), key.size(), (const unsigned char *)payload.data(), payload.size(), mac, &macLen);
+	return toHex(mac, macLen);
+}
+
+std::string issueCapability(const std::string &objectName, const std::string &mode, int ttlSeconds)
+{
+	long expiry = std::time(nullptr) + ttlSeconds;
+	return std::to_string(expiry) + "." + mode + "." + computeMac(objectName, mode, expiry);
+}
+
+std::string issueServerCapability(int ttlSeconds)
+{
+	return issueCapability(SERVER_CAPABILITY_NAME, "s", ttlSeconds);
+}
+
+bool verifyServerCapability(const std::string &token, std::string &error)
+{
+	return verifyCapability(token, SERVER_CAPABILITY_NAME, 's', error);
+}
+
+long capabilityExpiry(const std::string &token)
+{
+	size_t dot = token.find('.');
+	if (dot == std::string::npos || dot == 0)
+		return 0;
+	return std::strtol(token.substr(0, dot).c_str(), nullptr, 10);
+}
+
+bool verifyCapability(const std::string &token, const std::string &objectName, char op, std::string &error)
+{
+	size_t first = token.find('.');
+	size_t second = (first == std::string::npos) ? std::string::npos : token.find('.', first + 1);
+	if (second == std::string::npos)
+	{
+		error = "ERR InvalidCapability";
+		return false;
+	}
+	long expiry = capabilityExpiry(token);
+	std::string mode = token.substr(first + 1, second - first - 1);
+	std::string mac = token.substr(second + 1);
+	std::string expected = computeMac(objectName, mode, expiry);
+	if (mac.size() != expected.size() || CRYPTO_memcmp(mac.data(), expected.data(), mac.size()) != 0)
+	{
+		error = "ERR InvalidCapability";
+		return false;
+	}
+	if (expiry < std::time(nullptr))
+	{
+		error = "ERR CapabilityExpired";
+		return false;
+	}
+	if (mode.find(op) == std::string::npos)
+	{
+		error = "ERR AccessDenied";
+		return false;
+	}
+	return true;
+}
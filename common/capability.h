@@ -0,0 +1,33 @@
+#ifndef CAPABILITY_H
+#define CAPABILITY_H
+
+#include <string>
+
+// Capabilities are short-lived grants, signed by the namespace server with a key
+// shared with the file servers, that let a client read or write one stored object
+// directly on its file server. A token has the form "<expiry>.<mode>.<mac>", where
+// expiry is a Unix time, mode is "r", "w" or "rw", and mac is the hex HMAC-SHA256
+// of the object name, mode and expiry.
+
+// Default lifetime of an issued capability, in seconds.
+const int CAPABILITY_TTL = 60;
+
+// Issues a capability for objectName with the given mode.
+std::string issueCapability(const std::string &objectName, const std::string &mode, int ttlSeconds = CAPABILITY_TTL);
+
+// Checks that token grants op ('r' or 'w') on objectName and has not expired.
+// On failure sets error to the response the caller should send back.
+bool verifyCapability(const std::string &token, const std::string &objectName, char op, std::string &error);
+
+// Returns the expiry time encoded in a token, or 0 if it is malformed.
+long capabilityExpiry(const std::string &token);
+
+// Requests only servers may send to a file server (CREATE, DELETE, DELETE_MANY,
+// LAGGING) carry a capability with mode "s" for this name. Object names are hex,
+// so it never names an object, and clients are never issued one.
+const char *const SERVER_CAPABILITY_NAME = "*";
+
+std::string issueServerCapability(int ttlSeconds = CAPABILITY_TTL);
+bool verifyServerCapability(const std::string &token, std::string &error);
+
+#endif // CAPABILITY_H
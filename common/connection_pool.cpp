@@ -0,0 +1,120 @@
+#include "connection_pool.h"
+#include "util.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cerrno>
+
+static std::string endpointKey(const std::string &ip, int port)
+{
+	return ip + ":" + std::to_string(port);
+}
+
+ConnectionPool::ConnectionPool(size_t maxIdlePerServer, int idleTimeoutSec, int ioTimeoutMs, size_t maxMessageSize)
+	: maxIdlePerServer(maxIdlePerServer), idleTimeout(idleTimeoutSec), ioTimeoutMs(ioTimeoutMs),
+	  maxMessageSize(maxMessageSize)
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+	for (auto &pair : idle)
+		for (const auto &conn : pair.second)
+			close(conn.fd);
+}
+
+// An idle connection is reusable if it has not outlived the idle timeout and the
+// peer has neither closed it nor sent anything unsolicited.
+bool ConnectionPool::isHealthy(const IdleConnection &conn) const
+{
+	if (std::chrono::steady_clock::now() - conn.idleSince > idleTimeout)
+		return false;
+	char byte;
+	ssize_t n = recv(conn.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int ConnectionPool::acquire(const std::string &ip, int port, bool *reused)
+{
+	{
+		std::lock_guard<std::mutex> lock(poolMutex);
+		auto it = idle.find(endpointKey(ip, port));
+		if (it != idle.end())
+		{
+			// Most recently used first: it is the least likely to have timed out.
+			while (!it->second.empty())
+			{
+				IdleConnection conn = it->second.back();
+				it->second.pop_back();
+				if (isHealthy(conn))
+				{
+					if (reused)
+						*reused = true;
+					return conn.fd;
+				}
+				close(conn.fd);
+			}
+		}
+	}
+	if (reused)
+		*reused = false;
+	int fd = connectToServer(ip, port);
+	if (fd >= 0)
+	{
+		// Let the kernel notice peers that disappear while the connection sits idle.
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+		if (ioTimeoutMs > 0)
+		{
+			struct timeval tv;
+			tv.tv_sec = ioTimeoutMs / 1000;
+			tv.tv_usec = (ioTimeoutMs % 1000) * 1000;
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		}
+	}
+	return fd;
+}
+
+void ConnectionPool::release(const std::string &ip, int port, int fd)
+{
+	std::lock_guard<std::mutex> lock(poolMutex);
+	auto &conns = idle[endpointKey(ip, port)];
+	if (conns.size() >= maxIdlePerServer)
+	{
+		close(fd);
+		return;
+	}
+	conns.push_back({fd, std::chrono::steady_clock::now()});
+}
+
+void ConnectionPool::discard(int fd)
+{
+	close(fd);
+}
+
+std::string ConnectionPool::request(const std::string &ip, int port, const std::string &message)
+{
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		bool reused = false;
+		int fd = acquire(ip, port, &reused);
+		if (fd < 0)
+			return "ERR ConnectionFailed";
+		std::string response;
+		size_t sent = 0;
+		if (sendMessage(fd, message, &sent) >= 0 && readMessage(fd, response, maxMessageSize) > 0)
+		{
+			release(ip, port, fd);
+			return response;
+		}
+		discard(fd);
+		// Once any byte went out the server may have acted on the request, and it
+		// need not be idempotent. A fresh connection failing means the server
+		// really is unreachable.
+		if (!reused || sent > 0)
+			break;
+	}
+	return "ERR ConnectionFailed";
+}
@@ -0,0 +1,55 @@
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include "util.h"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Keeps idle connections to servers open so that a request does not pay for a
+// TCP handshake (and leave a TIME_WAIT socket behind) every time.
+// Safe to share between threads; a connection is owned by one caller at a time.
+class ConnectionPool
+{
+public:
+	// A non-zero ioTimeoutMs bounds every send and receive on the pool's
+	// connections, so a server that stops answering fails the request instead of
+	// blocking the caller. A response longer than maxMessageSize fails the request.
+	ConnectionPool(size_t maxIdlePerServer = 16, int idleTimeoutSec = 60, int ioTimeoutMs = 0,
+				   size_t maxMessageSize = MAX_MESSAGE_SIZE);
+	~ConnectionPool();
+
+	// Sends a request over a pooled connection and returns the response.
+	// A reused connection that fails before any of the request is sent is
+	// retried once over a fresh one; any other failure is returned.
+	std::string request(const std::string &ip, int port, const std::string &message);
+
+	// Takes a healthy idle connection to ip:port, or opens a new one. Returns -1 on failure.
+	// If reused is non-null it is set to whether the connection came from the pool.
+	int acquire(const std::string &ip, int port, bool *reused = nullptr);
+	// Returns a connection that is still in a clean request/response state.
+	void release(const std::string &ip, int port, int fd);
+	// Closes a connection that failed or is in an unknown state.
+	void discard(int fd);
+
+private:
+	struct IdleConnection
+	{
+		int fd;
+		std::chrono::steady_clock::time_point idleSince;
+	};
+
+	size_t maxIdlePerServer;
+	std::chrono::seconds idleTimeout;
+	int ioTimeoutMs;
+	size_t maxMessageSize;
+	std::mutex poolMutex;
+	std::map<std::string, std::vector<IdleConnection>> idle;
+
+	bool isHealthy(const IdleConnection &conn) const;
+};
+
+#endif // CONNECTION_POOL_H
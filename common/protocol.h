@@ -5,6 +5,9 @@
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <string_view>
 
 // Trim whitespace from both ends of a string.
 // not needed yet
@@ -30,4 +33,213 @@ inline std::vector<std::string> split(const std::string &s, char delimiter = ' '
 	return tokens;
 }
 
+// Requests may carry a client-chosen id so that several can be in flight on one
+// connection: "#<id> <request>" is answered with "#<id> <response>", and the
+// client matches responses by id rather than by arrival order.
+// Untagged requests get untagged responses, as before.
+const char REQUEST_TAG = '#';
+
+inline std::string tagMessage(uint32_t id, const std::string &message)
+{
+	return REQUEST_TAG + std::to_string(id) + " " + message;
+}
+
+// Splits a tagged message into its id and body. Returns false for untagged messages.
+inline bool untagMessage(const std::string &message, uint32_t &id, std::string &body)
+{
+	if (message.empty() || message[0] != REQUEST_TAG)
+		return false;
+	size_t space = message.find(' ');
+	if (space == std::string::npos || space == 1)
+		return false;
+	uint64_t value = 0;
+	for (size_t i = 1; i < space; i++)
+	{
+		if (message[i] < '0' || message[i] > '9')
+			return false;
+		value = value * 10 + (message[i] - '0');
+		if (value > UINT32_MAX)
+			return false;
+	}
+	id = value;
+	body = message.substr(space + 1);
+	return true;
+}
+
+// A WRITE of a replicated object names the rest of its replica chain after the
+// object: "<object>,<ip>:<port>,<ip>:<port>". The file server writes its own copy
+// and passes the write on to the first server in the chain it can reach, with the
+// rest of the chain. A server marked "!<ip>:<port>" has already missed the write;
+// it is only reported as lagging, not contacted.
+const char CHAIN_SEPARATOR = ',';
+const char CHAIN_SKIPPED = '!';
+
+// Read leases. A client that caches file data names itself by appending
+// "@<holder>" to the capability of its READs and WRITEs, where holder is a random
+// non-zero number. A READ that carries a holder may be granted a lease: the file
+// server then refuses writes from other holders until it runs out, answering
+// "ERR LeaseHeld <ms>" with the time left. A granted lease is announced before the
+// data in text ("LEASE <ms> DATA <n> <bytes>"), and by FLAG_LEASE with the term in
+// ms in the offset field of a binary response.
+const char LEASE_HOLDER_SEPARATOR = '@';
+const uint8_t FLAG_LEASE = 1;
+
+// Removes a "@<holder>" suffix from token. Returns the holder, or 0 if there is none.
+inline uint64_t splitLeaseHolder(std::string &token)
+{
+	size_t at = token.rfind(LEASE_HOLDER_SEPARATOR);
+	if (at == std::string::npos)
+		return 0;
+	uint64_t holder = std::strtoull(token.c_str() + at + 1, nullptr, 10);
+	token.resize(at);
+	return holder;
+}
+
+// Large transfers. Every connection has a maximum message size (MAX_MESSAGE_SIZE
+// in util.h unless a server was started with another), and a frame longer than
+// that closes the connection before anything is allocated for it. A READ whose
+// data would not fit, with MESSAGE_OVERHEAD left for the rest of the frame, is
+// refused with "ERR MessageTooLarge <max>". Clients move longer ranges as a stream
+// of READs or WRITEs of at most TRANSFER_CHUNK bytes, a few in flight at a time,
+// so no side of a transfer holds more than a few chunks of it.
+const size_t TRANSFER_CHUNK = 1024 * 1024;
+const size_t MESSAGE_OVERHEAD = 64 * 1024;
+
+// Binary protocol, version 1.
+// A connection switches to it by sending BINARY_HELLO as its first frame. A server
+// that supports it answers BINARY_ACCEPT; older servers answer "ERR UnknownCommand"
+// and the connection stays on the text protocol.
+// Binary frames keep the 4-byte length prefix. Inside, a fixed-size header is
+// followed by three raw sections: the path, the capability token and the payload.
+// Nothing is escaped, so payloads may contain any bytes.
+const char *const BINARY_HELLO = "HELLO BIN1";
+const char *const BINARY_ACCEPT = "OK BIN1";
+const uint8_t PROTOCOL_VERSION = 1;
+
+enum Opcode : uint8_t
+{
+	OP_LOGIN = 1, // path: username, payload: password
+	OP_LIST = 2,
+	OP_CREATE_FILE = 3, // length: stripe unit (0: not striped), offset: stripe servers (0: all)
+	OP_MKDIR = 4,
+	OP_DELETE = 5, // namespace path, or object name on a file server
+	OP_LOOKUP = 6,
+	OP_READ = 7,  // offset/length: byte range; response payload: the data
+	OP_WRITE = 8, // offset: position, payload: the data; response length: bytes written
+	OP_CREATE = 9 // file server object creation
+};
+
+enum Status : uint8_t
+{
+	STATUS_OK = 0,
+	STATUS_ERROR = 1 // payload holds the "ERR ..." text
+};
+
+// Responses echo the opcode and requestId of their request.
+struct MessageHeader
+{
+	uint8_t version = PROTOCOL_VERSION;
+	uint8_t opcode = 0;
+	uint8_t status = STATUS_OK;
+	uint8_t flags = 0;
+	uint32_t requestId = 0;
+	uint32_t pathLen = 0;
+	uint32_t tokenLen = 0;
+	uint64_t offset = 0;
+	uint64_t length = 0;
+};
+
+// Encoded size of MessageHeader; all fields are big-endian.
+const size_t HEADER_SIZE = 32;
+
+// A decoded binary frame. The sections point into the frame they were decoded from.
+struct BinaryMessage
+{
+	MessageHeader header;
+	std::string_view path;
+	std::string_view token;
+	std::string_view payload;
+};
+
+inline void putBigEndian(char *out, uint64_t value, int bytes)
+{
+	for (int i = bytes - 1; i >= 0; i--, value >>= 8)
+		out[i] = (char)(value & 0xff);
+}
+
+inline uint64_t getBigEndian(const char *in, int bytes)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; i++)
+		value = (value << 8) | (unsigned char)in[i];
+	return value;
+}
+
+inline void encodeHeader(const MessageHeader &h, char *out)
+{
+	out[0] = h.version;
+	out[1] = h.opcode;
+	out[2] = h.status;
+	out[3] = h.flags;
+	putBigEndian(out + 4, h.requestId, 4);
+	putBigEndian(out + 8, h.pathLen, 4);
+	putBigEndian(out + 12, h.tokenLen, 4);
+	putBigEndian(out + 16, h.offset, 8);
+	putBigEndian(out + 24, h.length, 8);
+}
+
+// Builds a binary frame body. pathLen and tokenLen are filled in from the sections.
+inline std::string encodeMessage(MessageHeader h, std::string_view path, std::string_view token, std::string_view payload)
+{
+	h.pathLen = path.size();
+	h.tokenLen = token.size();
+	std::string out(HEADER_SIZE, '\0');
+	out.reserve(HEADER_SIZE + path.size() + token.size() + payload.size());
+	encodeHeader(h, &out[0]);
+	out.append(path);
+	out.append(token);
+	out.append(payload);
+	return out;
+}
+
+// Decodes a binary frame body in place. Fails on a short frame, an unknown version,
+// or section lengths that run past the end of the frame.
+inline bool decodeMessage(const std::string &frame, BinaryMessage &msg)
+{
+	if (frame.size() < HEADER_SIZE)
+		return false;
+	const char *p = frame.data();
+	MessageHeader &h = msg.header;
+	h.version = p[0];
+	h.opcode = p[1];
+	h.status = p[2];
+	h.flags = p[3];
+	h.requestId = getBigEndian(p + 4, 4);
+	h.pathLen = getBigEndian(p + 8, 4);
+	h.tokenLen = getBigEndian(p + 12, 4);
+	h.offset = getBigEndian(p + 16, 8);
+	h.length = getBigEndian(p + 24, 8);
+	if (h.version != PROTOCOL_VERSION)
+		return false;
+	uint64_t sections = (uint64_t)h.pathLen + h.tokenLen;
+	if (sections > frame.size() - HEADER_SIZE)
+		return false;
+	std::string_view body(frame);
+	msg.path = body.substr(HEADER_SIZE, h.pathLen);
+	msg.token = body.substr(HEADER_SIZE + h.pathLen, h.tokenLen);
+	msg.payload = body.substr(HEADER_SIZE + sections);
+	return true;
+}
+
+// Builds the response to a request: same opcode and id, the given status and payload.
+inline std::string encodeResponse(const MessageHeader &request, uint8_t status, std::string_view payload, uint64_t length = 0)
+{
+	MessageHeader h;
+	h.opcode = request.opcode;
+	h.requestId = request.requestId;
+	h.status = status;
+	h.length = length;
+	return encodeMessage(h, std::string_view(), std::string_view(), payload);
+}
+
 #endif // PROTOCOL_H
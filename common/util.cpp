@@ -1,9 +1,15 @@
 #include "util.h"
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <cstring>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <cctype>
+#include <fcntl.h>
+#include <cerrno>
 
 // Helper: Trims whitespace from both ends of a string.
 std::string trim(const std::string &str)
@@ -18,16 +24,26 @@ std::string trim(const std::string &str)
 }
 
 // Reads a message that is prefixed with a 4-byte length field.
-int readMessage(int sockfd, std::string &message)
+// The length is checked before anything is allocated, so a corrupt or hostile
+// prefix cannot make us reserve up to 4 GiB.
+int readMessage(int sockfd, std::string &message, size_t maxLength)
 {
 	message.clear();
 	uint32_t netLen;
-	ssize_t n = recv(sockfd, &netLen, sizeof(netLen), 0);
-	if (n <= 0)
+	size_t prefixRead = 0;
+	while (prefixRead < sizeof(netLen))
 	{
-		return n;
+		ssize_t n = recv(sockfd, reinterpret_cast<char *>(&netLen) + prefixRead, sizeof(netLen) - prefixRead, 0);
+		if (n <= 0)
+			return n;
+		prefixRead += n;
 	}
 	uint32_t msgLen = ntohl(netLen);
+	if (msgLen > maxLength)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
 	message.resize(msgLen);
 	size_t totalRead = 0;
 	while (totalRead < msgLen)
@@ -43,22 +59,178 @@ int readMessage(int sockfd, std::string &message)
 }
 
 // Sends a message with a 4-byte length prefix.
-int sendMessage(int sockfd, const std::string &message)
+// Prefix and body go out in a single sendmsg() so a small message is never split
+// into two segments that Nagle's algorithm would hold back waiting for an ACK.
+int sendMessage(int sockfd, const std::string &message, size_t *sent)
 {
 	uint32_t msgLen = message.size();
 	uint32_t netLen = htonl(msgLen);
-	// Send the length prefix.
-	ssize_t sent = send(sockfd, &netLen, sizeof(netLen), 0);
-	if (sent != sizeof(netLen))
-		return -1;
-	// Send the message body.
+	struct iovec iov[2];
+	iov[0].iov_base = &netLen;
+	iov[0].iov_len = sizeof(netLen);
+	iov[1].iov_base = const_cast<char *>(message.data());
+	iov[1].iov_len = msgLen;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	size_t total = sizeof(netLen) + msgLen;
 	size_t totalSent = 0;
-	while (totalSent < msgLen)
+	if (sent)
+		*sent = 0;
+	while (totalSent < total)
 	{
-		ssize_t sentBytes = send(sockfd, message.c_str() + totalSent, msgLen - totalSent, 0);
+		ssize_t sentBytes = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
 		if (sentBytes <= 0)
 			return sentBytes;
 		totalSent += sentBytes;
+		if (sent)
+			*sent = totalSent;
+		// Advance the iovecs past whatever the kernel accepted.
+		size_t skip = sentBytes;
+		while (skip > 0 && msg.msg_iovlen > 0)
+		{
+			if (skip >= msg.msg_iov[0].iov_len)
+			{
+				skip -= msg.msg_iov[0].iov_len;
+				msg.msg_iov++;
+				msg.msg_iovlen--;
+			}
+			else
+			{
+				msg.msg_iov[0].iov_base = (char *)msg.msg_iov[0].iov_base + skip;
+				msg.msg_iov[0].iov_len -= skip;
+				skip = 0;
+			}
+		}
+	}
+	return msgLen;
+}
+
+// Sends a length-prefixed message whose body is head plus a range of a file.
+int sendMessageWithFile(int sockfd, const std::string &head, int fileFd, off_t offset, size_t length)
+{
+	uint32_t netLen = htonl(head.size() + length);
+	std::string prefix(reinterpret_cast<const char *>(&netLen), sizeof(netLen));
+	prefix += head;
+	size_t totalSent = 0;
+	while (totalSent < prefix.size())
+	{
+		// MSG_MORE lets the kernel coalesce the header with the first file bytes.
+		ssize_t sentBytes = send(sockfd, prefix.data() + totalSent, prefix.size() - totalSent, MSG_NOSIGNAL | MSG_MORE);
+		if (sentBytes <= 0)
+			return -1;
+		totalSent += sentBytes;
+	}
+	size_t fileSent = 0;
+	while (fileSent < length)
+	{
+		ssize_t sentBytes = sendfile(sockfd, fileFd, &offset, length - fileSent);
+		// A short file would leave the frame incomplete, which the caller must treat as fatal.
+		if (sentBytes <= 0)
+			return -1;
+		fileSent += sentBytes;
+	}
+	return head.size() + length;
+}
+
+// Opens a TCP connection to ip:port with Nagle disabled.
+int connectToServer(const std::string &ip, int port)
+{
+	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0)
+		return -1;
+	struct sockaddr_in serv_addr;
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, ip.c_str(), &serv_addr.sin_addr) <= 0 ||
+		connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+	{
+		close(sockfd);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return sockfd;
+}
+
+// Puts the given descriptor into non-blocking mode.
+int setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Extracts one length-prefixed message from an input buffer, advancing pos past it.
+int extractMessage(const std::string &buffer, size_t &pos, std::string &message, size_t maxLength)
+{
+	uint32_t netLen;
+	if (buffer.size() - pos < sizeof(netLen))
+		return 0;
+	memcpy(&netLen, buffer.data() + pos, sizeof(netLen));
+	uint32_t msgLen = ntohl(netLen);
+	if (msgLen > maxLength)
+		return -1;
+	if (buffer.size() - pos - sizeof(netLen) < msgLen)
+		return 0;
+	message.assign(buffer, pos + sizeof(netLen), msgLen);
+	pos += sizeof(netLen) + msgLen;
+	return 1;
+}
+
+// Appends a message with its 4-byte length prefix to an output buffer.
+void appendMessage(std::string &buffer, const std::string &message)
+{
+	uint32_t netLen = htonl(message.size());
+	buffer.append(reinterpret_cast<const char *>(&netLen), sizeof(netLen));
+	buffer.append(message);
+}
+
+// Both hex digits of every byte value, so encoding is one table load per byte.
+static const char HEX_PAIRS[513] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+std::string toHex(const unsigned char *data, size_t length)
+{
+	std::string hex(length * 2, '\0');
+	char *out = &hex[0];
+	for (size_t i = 0; i < length; i++)
+		memcpy(out + 2 * i, HEX_PAIRS + 2 * data[i], 2);
+	return hex;
+}
+
+static int hexDigit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+bool fromHex(const std::string &hex, unsigned char *out, size_t length)
+{
+	if (hex.size() != length * 2)
+		return false;
+	for (size_t i = 0; i < length; i++)
+	{
+		int hi = hexDigit(hex[2 * i]);
+		int lo = hexDigit(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return false;
+		out[i] = (unsigned char)(hi << 4 | lo);
 	}
-	return totalSent;
+	return true;
 }
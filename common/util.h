@@ -2,15 +2,48 @@
 #define UTIL_H
 
 #include <string>
+#include <sys/types.h>
+
+// Longest message accepted on a connection unless the server was configured with
+// another limit. A length prefix above the limit is not allocated for.
+const size_t MAX_MESSAGE_SIZE = 4 * 1024 * 1024;
 
 // Reads a message from the given socket.
-// The message is expected to be prefixed by a 4-byte length field.
-int readMessage(int sockfd, std::string &message);
+// The message is expected to be prefixed by a 4-byte length field. A message longer
+// than maxLength fails with errno EMSGSIZE, and the connection cannot be used any
+// more.
+int readMessage(int sockfd, std::string &message, size_t maxLength = MAX_MESSAGE_SIZE);
 
 // Sends a message to the given socket using a 4-byte length prefix.
-int sendMessage(int sockfd, const std::string &message);
+// If sent is non-null it is set to the bytes the socket accepted, also on failure.
+int sendMessage(int sockfd, const std::string &message, size_t *sent = nullptr);
+
+// Sends head followed by length bytes of fileFd starting at offset, framed as one
+// length-prefixed message. The file bytes go from the page cache to the socket
+// with sendfile(), without passing through user space.
+int sendMessageWithFile(int sockfd, const std::string &head, int fileFd, off_t offset, size_t length);
 
 // Helper to trim whitespace from both ends of a string.
 std::string trim(const std::string &str);
 
+// Opens a TCP connection to ip:port. Returns the socket or -1 on failure.
+int connectToServer(const std::string &ip, int port);
+
+// Puts the given descriptor into non-blocking mode.
+int setNonBlocking(int fd);
+
+// Extracts one length-prefixed message from buffer starting at pos.
+// Returns 1, or 0 (leaving pos untouched) if the buffer does not hold a complete
+// message yet, or -1 if the next message is longer than maxLength.
+int extractMessage(const std::string &buffer, size_t &pos, std::string &message, size_t maxLength = MAX_MESSAGE_SIZE);
+
+// Appends a message with its 4-byte length prefix to buffer.
+void appendMessage(std::string &buffer, const std::string &message);
+
+// Encodes bytes as lowercase hex, two digits per byte, from a 256-entry table.
+std::string toHex(const unsigned char *data, size_t length);
+
+// Decodes exactly 2 * length hex digits into out. Returns false on malformed input.
+bool fromHex(const std::string &hex, unsigned char *out, size_t length);
+
 #endif // UTIL_H
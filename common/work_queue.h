@@ -0,0 +1,62 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Fixed-capacity FIFO shared between a producer and a pool of worker threads.
+// push() blocks while the queue is full, so a fast producer is throttled to the
+// rate at which workers drain it.
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	void push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this]
+					 { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+	}
+
+	// Returns false instead of waiting when the queue is full.
+	bool tryPush(T item)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (items.size() >= capacity)
+			return false;
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	T pop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this]
+					  { return !items.empty(); });
+		T item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return item;
+	}
+
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return items.size();
+	}
+
+private:
+	size_t capacity;
+	std::deque<T> items;
+	std::mutex mutex;
+	std::condition_variable notEmpty;
+	std::condition_variable notFull;
+};
+
+#endif // WORK_QUEUE_H
@@ -0,0 +1,87 @@
+// Checks against a live File Server that the requests only servers may send are
+// refused without a server capability: CREATE, DELETE, DELETE_MANY and LAGGING in
+// text, and CREATE and DELETE in binary. A forged token and a client capability
+// must be refused too, and a real server capability accepted. Run it with the
+// same NFS_CAPABILITY_SECRET as the servers.
+//
+// Usage: AuthCheck [host] [port]
+#include "../common/capability.h"
+#include "../common/protocol.h"
+#include "../common/util.h"
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+static int failures = 0;
+
+static std::string call(int sockfd, const std::string &request)
+{
+	std::string response;
+	if (sendMessage(sockfd, request) < 0 || readMessage(sockfd, response) <= 0)
+		return "ERR ConnectionLost";
+	return response;
+}
+
+static void expect(const std::string &what, const std::string &response, bool accepted)
+{
+	bool ok = accepted ? response.compare(0, 2, "OK") == 0
+					   : response == "ERR InvalidCapability" || response == "ERR AccessDenied";
+	std::cout << (ok ? "ok   " : "FAIL ") << what << " -> " << response.substr(0, 60) << "\n";
+	if (!ok)
+		failures++;
+}
+
+// Sends a binary CREATE or DELETE and returns the response in text form.
+static std::string callBinary(int sockfd, uint8_t opcode, const std::string &object, const std::string &token)
+{
+	MessageHeader h;
+	h.opcode = opcode;
+	h.requestId = 1;
+	std::string response = call(sockfd, encodeMessage(h, object, token, std::string_view()));
+	BinaryMessage msg;
+	if (!decodeMessage(response, msg))
+		return "ERR MalformedResponse";
+	return msg.header.status == STATUS_OK ? "OK" : std::string(msg.payload);
+}
+
+int main(int argc, char *argv[])
+{
+	std::string host = argc > 1 ? argv[1] : "127.0.0.1";
+	int port = argc > 2 ? std::stoi(argv[2]) : 4001;
+	std::string object = "authcheck" + std::to_string(getpid());
+	std::string forged = std::to_string(capabilityExpiry(issueServerCapability())) + ".s." + std::string(64, '0');
+	std::string clientToken = issueCapability(object, "rw");
+
+	int sockfd = connectToServer(host, port);
+	if (sockfd < 0)
+	{
+		std::cerr << "cannot connect to " << host << ":" << port << "\n";
+		return 1;
+	}
+	for (const std::string &token : {std::string(), forged, clientToken})
+	{
+		std::string label = token.empty() ? " (no capability)" : token == forged ? " (forged)" : " (client capability)";
+		expect("CREATE" + label, call(sockfd, "CREATE " + object + " " + token), false);
+		expect("DELETE" + label, call(sockfd, "DELETE " + object + " " + token), false);
+		expect("DELETE_MANY" + label, call(sockfd, "DELETE_MANY " + token + " " + object), false);
+		expect("LAGGING" + label, call(sockfd, "LAGGING " + token), false);
+	}
+	expect("CREATE (server capability)", call(sockfd, "CREATE " + object + " " + issueServerCapability()), true);
+	expect("DELETE (server capability)", call(sockfd, "DELETE " + object + " " + issueServerCapability()), true);
+	close(sockfd);
+
+	sockfd = connectToServer(host, port);
+	if (sockfd < 0 || call(sockfd, BINARY_HELLO) != BINARY_ACCEPT)
+	{
+		std::cerr << "binary handshake failed\n";
+		return 1;
+	}
+	expect("binary CREATE (no capability)", callBinary(sockfd, OP_CREATE, object, ""), false);
+	expect("binary DELETE (client capability)", callBinary(sockfd, OP_DELETE, object, clientToken), false);
+	expect("binary CREATE (server capability)", callBinary(sockfd, OP_CREATE, object, issueServerCapability()), true);
+	expect("binary DELETE (server capability)", callBinary(sockfd, OP_DELETE, object, issueServerCapability()), true);
+	close(sockfd);
+
+	std::cout << failures << " failures\n";
+	return failures == 0 ? 0 : 1;
+}
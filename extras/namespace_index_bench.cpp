@@ -0,0 +1,143 @@
+// Benchmarks NamespaceIndex against the linear scans it replaced: a vector of
+// directories and a map of files, where finding a parent walks the vector and
+// listing a directory walks every entry. The index also stores each file's
+// 32-byte object id, which the old layout recomputed on every request. Heap use
+// of both is measured with mallinfo2(), so it needs glibc.
+//
+// Usage: NamespaceIndexBench [directories] [filesPerDirectory]
+#include "../namespace_server/NamespaceIndex.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <malloc.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsedMs(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static size_t heapInUse()
+{
+	// Large blocks are mmap()ed by malloc and counted separately.
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+}
+
+// The previous NamespaceServer data structures and algorithms.
+struct LinearNamespace
+{
+	std::vector<std::string> directories;
+	std::map<std::string, std::string> fileMapping;
+
+	bool hasDirectory(const std::string &path) const
+	{
+		return std::find(directories.begin(), directories.end(), path) != directories.end();
+	}
+
+	size_t list(const std::string &path) const
+	{
+		size_t children = 0;
+		for (const auto &dir : directories)
+		{
+			if (dir != path && getParentDirectory(dir) == path)
+				children++;
+		}
+		for (const auto &pair : fileMapping)
+		{
+			if (getParentDirectory(pair.first) == path)
+				children++;
+		}
+		return children;
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	size_t dirCount = argc > 1 ? std::stoul(argv[1]) : 1000;
+	size_t filesPerDir = argc > 2 ? std::stoul(argv[2]) : 1000;
+	size_t total = dirCount * filesPerDir;
+	std::cout << "Namespace: " << dirCount << " directories x " << filesPerDir << " files = " << total << " files\n";
+
+	std::vector<std::string> dirs, files;
+	dirs.reserve(dirCount);
+	files.reserve(total);
+	for (size_t d = 0; d < dirCount; d++)
+	{
+		dirs.push_back("/home/user" + std::to_string(d));
+		for (size_t f = 0; f < filesPerDir; f++)
+			files.push_back(dirs.back() + "/file" + std::to_string(f) + ".txt");
+	}
+
+	// Build.
+	size_t heapBefore = heapInUse();
+	NamespaceIndex index;
+	auto start = Clock::now();
+	index.addDirectory("/");
+	index.addDirectory("/home");
+	for (const auto &d : dirs)
+		index.addDirectory(d);
+	for (const auto &f : files)
+		index.addFile(f, "Server1", ObjectId());
+	std::cout << "index  build:              " << elapsedMs(start) << " ms\n";
+	size_t indexHeap = heapInUse() - heapBefore;
+
+	heapBefore = heapInUse();
+	LinearNamespace linear;
+	start = Clock::now();
+	linear.directories = {"/", "/home"};
+	linear.directories.insert(linear.directories.end(), dirs.begin(), dirs.end());
+	for (const auto &f : files)
+		linear.fileMapping[f] = "Server1";
+	std::cout << "linear build:              " << elapsedMs(start) << " ms\n";
+	size_t linearHeap = heapInUse() - heapBefore;
+
+	size_t entries = dirs.size() + files.size() + 2;
+	IndexMemoryUsage usage = index.memoryUsage();
+	std::cout << "index  heap:               " << indexHeap / (1024 * 1024) << " MiB, "
+			  << indexHeap / entries << " bytes/entry (nodes " << usage.nodeBytes / (1024 * 1024)
+			  << " MiB, names " << usage.nameBytes / (1024 * 1024) << " MiB, table "
+			  << usage.tableBytes / (1024 * 1024) << " MiB, object ids " << usage.objectBytes / (1024 * 1024) << " MiB)\n";
+	std::cout << "linear heap:               " << linearHeap / (1024 * 1024) << " MiB, "
+			  << linearHeap / entries << " bytes/entry\n";
+
+	// Parent lookup, as done by every CREATE_FILE and MKDIR.
+	const size_t lookups = 100000;
+	size_t hits = 0;
+	start = Clock::now();
+	for (size_t i = 0; i < lookups; i++)
+		hits += index.hasDirectory(getParentDirectory(files[(i * 7919) % total]));
+	double indexLookup = elapsedMs(start);
+	const size_t linearLookups = 1000;
+	start = Clock::now();
+	for (size_t i = 0; i < linearLookups; i++)
+		hits += linear.hasDirectory(getParentDirectory(files[(i * 7919) % total]));
+	double linearLookup = elapsedMs(start);
+	std::cout << "index  parent lookup:      " << indexLookup * 1000 / lookups << " us/op\n";
+	std::cout << "linear parent lookup:      " << linearLookup * 1000 / linearLookups << " us/op\n";
+
+	// Listing the root (few children) and a populated directory.
+	std::vector<std::string> subdirs, names;
+	for (const std::string &path : {std::string("/"), dirs[dirCount / 2]})
+	{
+		const size_t lists = 100;
+		start = Clock::now();
+		for (size_t i = 0; i < lists; i++)
+			index.listChildren(path, subdirs, names);
+		double indexList = elapsedMs(start) / lists;
+		start = Clock::now();
+		size_t children = linear.list(path);
+		double linearList = elapsedMs(start);
+		std::cout << "LIST " << path << " (" << children << " children): index " << indexList
+				  << " ms, linear " << linearList << " ms\n";
+	}
+
+	// Keep the optimizer from discarding the lookups.
+	if (hits == 0)
+		std::cout << "no hits\n";
+	return 0;
+}
@@ -0,0 +1,305 @@
+// Multi-threaded stress run against a live Namespace Server. Any wrong answer is
+// reported and makes the run fail. There are three workloads:
+//
+// own:    each client thread owns a directory. It creates files there, looks them
+//         up and lists the directory, checking every answer against what it has
+//         created so far. Meanwhile the same threads list the shared root, so
+//         lookups and listings on one shard run alongside mutations on others.
+// shared: all threads create, look up and delete their files in the same few
+//         directories, so they contend for the same shards.
+// tree:   threads build and tear down one small tree together. Each creates
+//         directories and files at random places in it and deletes parents and
+//         children that other threads are working under. Only answers that some
+//         interleaving allows are accepted, and a file under a directory the
+//         thread has itself deleted must be gone.
+//
+// Usage: NamespaceStress [threads] [filesPerThread] [host] [port] [own|shared|tree|all]
+#include "../common/util.h"
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static std::atomic<size_t> operations{0};
+static std::atomic<size_t> failures{0};
+static std::mutex outputMutex;
+
+static void fail(int thread, const std::string &request, const std::string &response)
+{
+	failures++;
+	std::lock_guard<std::mutex> lock(outputMutex);
+	std::cerr << "thread " << thread << ": " << request << " -> " << response << "\n";
+}
+
+static std::string call(int sockfd, const std::string &request)
+{
+	std::string response;
+	if (sendMessage(sockfd, request) < 0 || readMessage(sockfd, response) <= 0)
+		return "ERR ConnectionLost";
+	operations++;
+	return response;
+}
+
+// Number of names listed under "Files:" in a LIST response.
+static size_t countFiles(const std::string &listing)
+{
+	size_t pos = listing.find("Files:\n");
+	if (pos == std::string::npos)
+		return 0;
+	size_t count = 0;
+	for (size_t i = pos + 7; i < listing.size(); i++)
+	{
+		if (listing[i] == '\n')
+			count++;
+	}
+	return count;
+}
+
+static void client(int thread, int files, const std::string &host, int port)
+{
+	int sockfd = connectToServer(host, port);
+	if (sockfd < 0)
+	{
+		fail(thread, "connect", "failed");
+		return;
+	}
+	std::string dir = "/stress" + std::to_string(getpid()) + "_" + std::to_string(thread);
+	if (call(sockfd, "MKDIR " + dir) != "OK")
+		fail(thread, "MKDIR " + dir, "not OK");
+	for (int i = 0; i < files; i++)
+	{
+		std::string path = dir + "/f" + std::to_string(i);
+		std::string response = call(sockfd, "CREATE_FILE " + path);
+		if (response.compare(0, 3, "OK ") != 0)
+			fail(thread, "CREATE_FILE " + path, response);
+		response = call(sockfd, "LOOKUP " + path);
+		if (response.compare(0, 3, "OK ") != 0)
+			fail(thread, "LOOKUP " + path, response);
+		if (i % 16 == 0)
+		{
+			response = call(sockfd, "LIST " + dir);
+			if (countFiles(response) != (size_t)i + 1)
+				fail(thread, "LIST " + dir, response.substr(0, 80));
+			response = call(sockfd, "LIST /");
+			if (response.find(dir.substr(1) + "\n") == std::string::npos)
+				fail(thread, "LIST /", "own directory missing");
+		}
+	}
+	std::string response = call(sockfd, "DELETE " + dir);
+	if (response != "OK")
+		fail(thread, "DELETE " + dir, response);
+	response = call(sockfd, "LIST " + dir);
+	if (response != "ERR DirectoryNotFound")
+		fail(thread, "LIST " + dir + " after DELETE", response.substr(0, 80));
+	close(sockfd);
+}
+
+// Number of directories the shared workload spreads its files over.
+static const int SHARED_DIRECTORIES = 4;
+
+static std::string sharedRoot()
+{
+	return "/shared" + std::to_string(getpid());
+}
+
+static void sharedClient(int thread, int files, const std::string &host, int port)
+{
+	int sockfd = connectToServer(host, port);
+	if (sockfd < 0)
+	{
+		fail(thread, "connect", "failed");
+		return;
+	}
+	std::string root = sharedRoot();
+	for (int i = 0; i < files; i++)
+	{
+		std::string dir = root + "/d" + std::to_string(i % SHARED_DIRECTORIES);
+		std::string path = dir + "/t" + std::to_string(thread) + "_" + std::to_string(i);
+		std::string response = call(sockfd, "CREATE_FILE " + path);
+		if (response.compare(0, 3, "OK ") != 0)
+			fail(thread, "CREATE_FILE " + path, response);
+		response = call(sockfd, "LOOKUP " + path);
+		if (response.compare(0, 3, "OK ") != 0)
+			fail(thread, "LOOKUP " + path, response);
+		if (i % 16 == 0)
+		{
+			response = call(sockfd, "LIST " + dir);
+			if (response.find(path.substr(dir.size() + 1) + "\n") == std::string::npos)
+				fail(thread, "LIST " + dir, "own file missing");
+		}
+		// Every other file is deleted again, so creates and deletes interleave in
+		// the same directories.
+		if (i % 2 == 1)
+		{
+			response = call(sockfd, "DELETE " + path);
+			if (response != "OK")
+				fail(thread, "DELETE " + path, response);
+			response = call(sockfd, "LOOKUP " + path);
+			if (response.compare(0, 3, "OK ") == 0)
+				fail(thread, "LOOKUP " + path + " after DELETE", response);
+		}
+	}
+	close(sockfd);
+}
+
+static std::string treeRoot()
+{
+	return "/tree" + std::to_string(getpid());
+}
+
+// Answers that some interleaving with the other threads allows.
+static bool treeAnswerAllowed(const std::string &command, const std::string &response)
+{
+	if (command == "MKDIR")
+		return response == "OK" || response == "ERR DirectoryAlreadyExists" || response == "ERR ParentDirectoryNotFound";
+	if (command == "CREATE_FILE")
+		return response.compare(0, 3, "OK ") == 0 || response == "ERR ParentDirectoryNotFound";
+	if (command == "DELETE")
+		return response == "OK" || response == "ERR NotFound" || response == "ERR FileBusy";
+	return response.compare(0, 3, "OK ") == 0 || response == "ERR FileNotFound";
+}
+
+static void treeClient(int thread, int files, const std::string &host, int port)
+{
+	int sockfd = connectToServer(host, port);
+	if (sockfd < 0)
+	{
+		fail(thread, "connect", "failed");
+		return;
+	}
+	std::mt19937 rng(thread);
+	auto request = [&](const std::string &command, const std::string &path)
+	{
+		std::string response = call(sockfd, command + " " + path);
+		if (!treeAnswerAllowed(command, response))
+			fail(thread, command + " " + path, response);
+		return response;
+	};
+	// Files this thread created, by the directory they were created in.
+	std::vector<std::pair<std::string, std::string>> created;
+	std::string root = treeRoot();
+	for (int i = 0; i < files; i++)
+	{
+		std::string parent = root + "/p" + std::to_string(rng() % 3);
+		std::string child = parent + "/c" + std::to_string(rng() % 3);
+		request("MKDIR", parent);
+		request("MKDIR", child);
+		std::string dir = rng() % 2 ? child : parent;
+		std::string path = dir + "/t" + std::to_string(thread) + "_" + std::to_string(i);
+		if (request("CREATE_FILE", path).compare(0, 3, "OK ") == 0)
+			created.push_back({dir, path});
+		request("LOOKUP", path);
+		// Deletes hit parents and children alike, including ones other threads are
+		// creating under.
+		if (rng() % 4 == 0)
+		{
+			std::string victim = rng() % 2 ? child : parent;
+			if (request("DELETE", victim) == "OK")
+			{
+				// Only this thread creates these names, so none of them can be back.
+				std::string prefix = victim + "/";
+				for (auto it = created.begin(); it != created.end();)
+				{
+					if (it->first == victim || it->first.compare(0, prefix.size(), prefix) == 0)
+					{
+						std::string response = call(sockfd, "LOOKUP " + it->second);
+						if (response != "ERR FileNotFound")
+							fail(thread, "LOOKUP " + it->second + " after DELETE " + victim, response);
+						it = created.erase(it);
+					}
+					else
+						++it;
+				}
+			}
+		}
+	}
+	close(sockfd);
+}
+
+// Runs one workload and reports it. Returns false if any answer was wrong.
+static bool runWorkload(const std::string &name, void (*body)(int, int, const std::string &, int), int threads,
+						int files, const std::string &host, int port)
+{
+	operations = 0;
+	failures = 0;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> clients;
+	for (int t = 0; t < threads; t++)
+		clients.emplace_back(body, t, files, host, port);
+	for (auto &c : clients)
+		c.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << name << ": " << threads << " threads, " << operations << " requests in " << seconds << " s ("
+			  << (size_t)(operations / seconds) << " req/s), " << failures << " failures\n";
+	return failures == 0;
+}
+
+// Creates a workload's top directory, or deletes it and checks that it is gone.
+static bool setUp(const std::string &dir, const std::vector<std::string> &subdirs, const std::string &host, int port)
+{
+	int sockfd = connectToServer(host, port);
+	bool ok = sockfd >= 0 && call(sockfd, "MKDIR " + dir) == "OK";
+	for (const auto &sub : subdirs)
+		ok = ok && call(sockfd, "MKDIR " + dir + "/" + sub) == "OK";
+	if (!ok)
+		fail(-1, "MKDIR " + dir, "not OK");
+	if (sockfd >= 0)
+		close(sockfd);
+	return ok;
+}
+
+static bool tearDown(const std::string &dir, const std::string &host, int port)
+{
+	int sockfd = connectToServer(host, port);
+	if (sockfd < 0)
+		return false;
+	std::string response = call(sockfd, "DELETE " + dir);
+	if (response != "OK")
+		fail(-1, "DELETE " + dir, response);
+	response = call(sockfd, "LIST " + dir);
+	if (response != "ERR DirectoryNotFound")
+		fail(-1, "LIST " + dir + " after DELETE", response.substr(0, 80));
+	close(sockfd);
+	return failures == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int threads = argc > 1 ? std::stoi(argv[1]) : 16;
+	int files = argc > 2 ? std::stoi(argv[2]) : 2000;
+	std::string host = argc > 3 ? argv[3] : "127.0.0.1";
+	int port = argc > 4 ? std::stoi(argv[4]) : 4000;
+	std::string workload = argc > 5 ? argv[5] : "all";
+	if (workload != "own" && workload != "shared" && workload != "tree" && workload != "all")
+	{
+		std::cerr << "Usage: " << argv[0] << " [threads] [filesPerThread] [host] [port] [own|shared|tree|all]\n";
+		return 2;
+	}
+
+	bool ok = true;
+	if (workload == "own" || workload == "all")
+		ok = runWorkload("own", client, threads, files, host, port) && ok;
+	if (workload == "shared" || workload == "all")
+	{
+		std::vector<std::string> subdirs;
+		for (int d = 0; d < SHARED_DIRECTORIES; d++)
+			subdirs.push_back("d" + std::to_string(d));
+		bool passed = setUp(sharedRoot(), subdirs, host, port) &&
+					  runWorkload("shared", sharedClient, threads, files, host, port);
+		ok = tearDown(sharedRoot(), host, port) && passed && ok;
+	}
+	if (workload == "tree" || workload == "all")
+	{
+		bool passed = setUp(treeRoot(), {}, host, port) &&
+					  runWorkload("tree", treeClient, threads, files, host, port);
+		ok = tearDown(treeRoot(), host, port) && passed && ok;
+	}
+	return ok ? 0 : 1;
+}
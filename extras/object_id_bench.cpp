@@ -0,0 +1,72 @@
+// Compares the old per-request object name computation (SHA-256 of the path,
+// hex-encoded through an ostringstream) with the current one (the object id
+// stored at create time, hex-encoded from a lookup table).
+//
+// Usage: ObjectIdBench [iterations]
+#include "../common/util.h"
+#include <openssl/sha.h>
+#include <array>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// The encoder the Namespace Server used before.
+static std::string streamHex(const unsigned char *data, size_t length)
+{
+	std::ostringstream oss;
+	for (size_t i = 0; i < length; i++)
+		oss << std::hex << std::setw(2) << std::setfill('0') << (int)data[i];
+	return oss.str();
+}
+
+static std::array<unsigned char, SHA256_DIGEST_LENGTH> sha256(const std::string &data)
+{
+	std::array<unsigned char, SHA256_DIGEST_LENGTH> hash;
+	SHA256((const unsigned char *)data.data(), data.size(), hash.data());
+	return hash;
+}
+
+template <typename Fn>
+static void measure(const char *label, size_t iterations, Fn fn)
+{
+	size_t checksum = 0;
+	auto start = Clock::now();
+	for (size_t i = 0; i < iterations; i++)
+		checksum += fn(i).size();
+	double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / iterations;
+	std::cout << label << ns << " ns/op (" << checksum / iterations << " chars)\n";
+}
+
+int main(int argc, char *argv[])
+{
+	size_t iterations = argc > 1 ? std::stoul(argv[1]) : 1000000;
+	const size_t pathCount = 4096;
+	std::vector<std::string> paths;
+	std::vector<std::array<unsigned char, SHA256_DIGEST_LENGTH>> stored;
+	for (size_t i = 0; i < pathCount; i++)
+	{
+		paths.push_back("/home/user" + std::to_string(i % 64) + "/file" + std::to_string(i) + ".txt");
+		stored.push_back(sha256(paths.back()));
+	}
+	if (toHex(stored[0].data(), stored[0].size()) != streamHex(stored[0].data(), stored[0].size()))
+	{
+		std::cerr << "Encoders disagree\n";
+		return 1;
+	}
+
+	measure("ostringstream hex:         ", iterations, [&](size_t i)
+			{ return streamHex(stored[i % pathCount].data(), SHA256_DIGEST_LENGTH); });
+	measure("table hex:                 ", iterations, [&](size_t i)
+			{ return toHex(stored[i % pathCount].data(), SHA256_DIGEST_LENGTH); });
+	measure("old: SHA-256 + stream hex: ", iterations, [&](size_t i)
+			{ auto hash = sha256(paths[i % pathCount]);
+			  return streamHex(hash.data(), hash.size()); });
+	measure("new: stored id + table hex:", iterations, [&](size_t i)
+			{ return toHex(stored[i % pathCount].data(), SHA256_DIGEST_LENGTH); });
+	return 0;
+}
@@ -0,0 +1,115 @@
+// Cold scans of a file with and without the File Server's readahead: sequential,
+// strided, and two sequential readers taking turns on the same descriptor, as two
+// clients reading one object do. It writes a file, then for each pattern and mode
+// drops the file from the page cache and reads it in small preads the way the
+// File Server serves them: each read is reported to Readahead first. With
+// --work=US each read is followed by that much busy time, standing in for sending
+// the data on.
+//
+// Usage: ReadaheadBench [--work=US] [fileMiB] [readKiB] [maxWindowKiB] [dir]
+#include "../file_server/Readahead.h"
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Reads the file with reads of readSize bytes, stride bytes apart, and returns MB/s.
+// With several readers, each one scans its own part of the file and they take turns.
+static double scan(const std::string &path, size_t fileSize, size_t readSize, size_t stride, size_t readers,
+				   size_t maxWindow, int workMicros)
+{
+	int fd = open(path.c_str(), O_RDWR);
+	if (fd < 0)
+		return 0;
+	// Clean pages are dropped, so every read starts from the disk.
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	auto file = std::make_shared<OpenFile>(fd);
+	Readahead readahead(maxWindow);
+	std::vector<char> buffer(readSize);
+	size_t bytes = 0;
+	auto start = Clock::now();
+	size_t part = fileSize / readers;
+	for (size_t position = 0; position + readSize <= part; position += stride)
+	{
+		for (size_t reader = 0; reader < readers; reader++)
+		{
+			size_t offset = reader * part + position;
+			readahead.access(path, file, offset, readSize);
+			ssize_t n = pread(fd, buffer.data(), readSize, offset);
+			if (n <= 0)
+				break;
+			bytes += n;
+			for (auto until = Clock::now() + std::chrono::microseconds(workMicros); Clock::now() < until;)
+				;
+		}
+	}
+	return bytes / 1e6 / elapsed(start);
+}
+
+int main(int argc, char *argv[])
+{
+	int workMicros = 0;
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--work=", 7) == 0)
+			workMicros = std::atoi(argv[i] + 7);
+		else
+			args.push_back(argv[i]);
+	}
+	size_t fileSize = (args.size() > 0 ? std::stoul(args[0]) : 256) * 1024 * 1024;
+	size_t readSize = (args.size() > 1 ? std::stoul(args[1]) : 16) * 1024;
+	size_t maxWindow = (args.size() > 2 ? std::stoul(args[2]) : 4096) * 1024;
+	std::string dir = args.size() > 3 ? args[3] : ".";
+
+	std::string path = dir + "/readahead_bench." + std::to_string(getpid());
+	int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0)
+	{
+		std::cerr << "Cannot create " << path << "\n";
+		return 1;
+	}
+	std::string block(1024 * 1024, '\0');
+	for (size_t i = 0; i < block.size(); i++)
+		block[i] = (char)('a' + i % 26);
+	for (size_t written = 0; written < fileSize; written += block.size())
+	{
+		if (write(fd, block.data(), block.size()) != (ssize_t)block.size())
+		{
+			std::cerr << "Cannot write " << path << "\n";
+			unlink(path.c_str());
+			return 1;
+		}
+	}
+	fsync(fd);
+	close(fd);
+
+	std::cout << "pattern       no readahead MB/s  readahead MB/s\n";
+	struct Pattern
+	{
+		const char *name;
+		size_t stride;
+		size_t readers;
+	};
+	for (const Pattern &p : {Pattern{"sequential", readSize, 1}, Pattern{"stride x4", 4 * readSize, 1},
+							 Pattern{"2 readers", readSize, 2}})
+	{
+		double off = scan(path, fileSize, readSize, p.stride, p.readers, 0, workMicros);
+		double on = scan(path, fileSize, readSize, p.stride, p.readers, maxWindow, workMicros);
+		std::cout << std::left << std::setw(14) << p.name << std::right << std::fixed << std::setprecision(1)
+				  << std::setw(17) << off << std::setw(16) << on << "\n";
+	}
+	unlink(path.c_str());
+	return 0;
+}
@@ -0,0 +1,78 @@
+// Throughput of striped files against live servers. For each stripe width from 1
+// to the given maximum it creates a file striped over that many File Servers,
+// writes it and reads it back through the Client in large calls, checks the data
+// and prints the write and read rates. The file is deleted afterwards.
+//
+// Usage: StripeBench [maxServers] [fileMiB] [stripeUnitKiB] [host] [port]
+#include "../client/Client.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+static const size_t CALL_SIZE = 8 * 1024 * 1024; // Bytes per readFile/writeFile call.
+
+static double elapsed(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+	size_t maxServers = argc > 1 ? std::stoul(argv[1]) : 5;
+	size_t fileSize = (argc > 2 ? std::stoul(argv[2]) : 64) * 1024 * 1024;
+	uint32_t unit = (argc > 3 ? std::stoul(argv[3]) : 1024) * 1024;
+	std::string host = argc > 4 ? argv[4] : "127.0.0.1";
+	int port = argc > 5 ? std::stoi(argv[5]) : 4000;
+
+	std::string block(CALL_SIZE, '\0');
+	for (size_t i = 0; i < block.size(); i++)
+		block[i] = (char)('a' + (i * 7 + i / 4096) % 26);
+
+	Client client(host, port);
+	std::cout << "servers  write MB/s  read MB/s\n";
+	for (size_t width = 1; width <= maxServers; width++)
+	{
+		std::string path = "/stripebench" + std::to_string(getpid()) + "_" + std::to_string(width);
+		std::string response = client.createFile(path, unit, width);
+		if (response.compare(0, 3, "OK ") != 0)
+		{
+			std::cerr << "CREATE_FILE " << path << ": " << response << "\n";
+			return 1;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		for (size_t offset = 0; offset < fileSize; offset += CALL_SIZE)
+		{
+			response = client.writeFile(path, offset, block.substr(0, std::min(CALL_SIZE, fileSize - offset)));
+			if (response.compare(0, 3, "OK ") != 0)
+			{
+				std::cerr << "write " << path << " at " << offset << ": " << response << "\n";
+				return 1;
+			}
+		}
+		double writeSeconds = elapsed(start);
+
+		start = std::chrono::steady_clock::now();
+		for (size_t offset = 0; offset < fileSize; offset += CALL_SIZE)
+		{
+			size_t length = std::min(CALL_SIZE, fileSize - offset);
+			response = client.readFile(path, offset, length);
+			std::string expected = "DATA " + std::to_string(length) + " ";
+			if (response.compare(0, expected.size(), expected) != 0 ||
+				response.compare(expected.size(), length, block, 0, length) != 0)
+			{
+				std::cerr << "read " << path << " at " << offset << ": " << response.substr(0, 80) << "\n";
+				return 1;
+			}
+		}
+		double readSeconds = elapsed(start);
+		client.deletePath(path);
+
+		double mb = fileSize / 1e6;
+		std::cout << std::setw(7) << width << std::fixed << std::setprecision(1) << std::setw(12) << mb / writeSeconds
+				  << std::setw(11) << mb / readSeconds << "\n";
+	}
+	return 0;
+}
@@ -0,0 +1,76 @@
+// Small sequential writes against live servers, with and without write-back. Each
+// run creates a file, appends to it in writes of the given size through the
+// Client, flushes, reads the file back to check it and prints the write rate.
+// The files are deleted afterwards.
+//
+// Usage: WriteBackBench [writes] [writeSize] [bufferKiB] [host] [port]
+#include "../client/Client.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+static double elapsed(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+	size_t writes = argc > 1 ? std::stoul(argv[1]) : 20000;
+	size_t writeSize = argc > 2 ? std::stoul(argv[2]) : 100;
+	size_t buffer = (argc > 3 ? std::stoul(argv[3]) : 1024) * 1024;
+	std::string host = argc > 4 ? argv[4] : "127.0.0.1";
+	int port = argc > 5 ? std::stoi(argv[5]) : 4000;
+
+	std::string expected(writes * writeSize, '\0');
+	for (size_t i = 0; i < expected.size(); i++)
+		expected[i] = (char)('a' + (i * 7 + i / writeSize) % 26);
+
+	std::cout << "mode          writes/s      MB/s\n";
+	for (bool writeBack : {false, true})
+	{
+		Client client(host, port);
+		client.setWriteBack(writeBack ? buffer : 0);
+		std::string path = "/writebackbench" + std::to_string(getpid()) + (writeBack ? "_back" : "_through");
+		std::string response = client.createFile(path);
+		if (response.compare(0, 3, "OK ") != 0)
+		{
+			std::cerr << "CREATE_FILE " << path << ": " << response << "\n";
+			return 1;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < writes; i++)
+		{
+			response = client.writeFile(path, i * writeSize, expected.substr(i * writeSize, writeSize));
+			if (response.compare(0, 3, "OK ") != 0)
+			{
+				std::cerr << "write " << path << " #" << i << ": " << response << "\n";
+				return 1;
+			}
+		}
+		response = client.flush();
+		double seconds = elapsed(start);
+		if (response != "OK")
+		{
+			std::cerr << "flush " << path << ": " << response << "\n";
+			return 1;
+		}
+
+		response = client.readFile(path, 0, expected.size());
+		std::string header = "DATA " + std::to_string(expected.size()) + " ";
+		if (response.compare(0, header.size(), header) != 0 || response.compare(header.size(), expected.size(), expected) != 0)
+		{
+			std::cerr << "read " << path << ": " << response.substr(0, 80) << "\n";
+			return 1;
+		}
+		client.deletePath(path);
+
+		std::cout << std::left << std::setw(10) << (writeBack ? "write-back" : "through") << std::right << std::fixed
+				  << std::setprecision(0) << std::setw(12) << writes / seconds << std::setprecision(1) << std::setw(10)
+				  << expected.size() / 1e6 / seconds << "\n";
+	}
+	return 0;
+}
@@ -0,0 +1,63 @@
+#include "FdCache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+OpenFile::~OpenFile()
+{
+	close(fd);
+}
+
+FdCache::FdCache(size_t capacity)
+	: maxEntries(capacity)
+{
+}
+
+std::shared_ptr<OpenFile> FdCache::acquire(const std::string &name, const std::string &fullPath, bool create)
+{
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto it = index.find(name);
+		if (it != index.end())
+		{
+			lru.splice(lru.begin(), lru, it->second);
+			return it->second->second;
+		}
+	}
+
+	// Open outside the cache lock; the caller's file lock keeps others off this object.
+	int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0);
+	int fd = open(fullPath.c_str(), flags, 0666);
+	if (fd < 0)
+		return nullptr;
+	std::shared_ptr<OpenFile> file = std::make_shared<OpenFile>(fd);
+	if (maxEntries == 0)
+		return file;
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	auto it = index.find(name);
+	if (it != index.end())
+	{
+		// Another object sharing our lock stripe raced us here; keep the cached one.
+		lru.splice(lru.begin(), lru, it->second);
+		return it->second->second;
+	}
+	lru.emplace_front(name, file);
+	index[name] = lru.begin();
+	if (lru.size() > maxEntries)
+	{
+		index.erase(lru.back().first);
+		lru.pop_back();
+	}
+	return file;
+}
+
+void FdCache::invalidate(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	auto it = index.find(name);
+	if (it == index.end())
+		return;
+	lru.erase(it->second);
+	index.erase(it);
+}
@@ -0,0 +1,48 @@
+#ifndef FD_CACHE_H
+#define FD_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// An open descriptor shared by the cache and the requests using it. The descriptor
+// is closed when the last holder drops it, so evicting an entry never closes a
+// file under an in-flight read or write.
+struct OpenFile
+{
+	int fd;
+	explicit OpenFile(int fd) : fd(fd) {}
+	~OpenFile();
+	OpenFile(const OpenFile &) = delete;
+	OpenFile &operator=(const OpenFile &) = delete;
+};
+
+// LRU cache of read-write descriptors keyed by stored object name, so repeated
+// I/O on a hot object skips the open/close pair.
+// Callers serialize per object with FileServer's file locks; the cache itself is thread-safe.
+class FdCache
+{
+public:
+	// capacity is the maximum number of cached descriptors; 0 disables caching.
+	explicit FdCache(size_t capacity);
+
+	// Returns an open descriptor for the object stored at fullPath, or null with errno
+	// set. On a miss the file is opened, and created first if create is set.
+	std::shared_ptr<OpenFile> acquire(const std::string &name, const std::string &fullPath, bool create);
+	// Drops the cached descriptor for name, if any. Call before removing the file.
+	void invalidate(const std::string &name);
+
+	size_t capacity() const { return maxEntries; }
+
+private:
+	typedef std::pair<std::string, std::shared_ptr<OpenFile>> Entry;
+
+	size_t maxEntries;
+	std::mutex cacheMutex;
+	std::list<Entry> lru; // Most recently used at the front.
+	std::unordered_map<std::string, std::list<Entry>::iterator> index;
+};
+
+#endif // FD_CACHE_H
@@ -1,17 +1,24 @@
 #include "FileServer.h"
 #include "../common/util.h"
 #include "../common/protocol.h"
+#include "../common/capability.h"
 
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <cstring>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <thread>
+#include <algorithm>
 
 // Helper function to extract the basename from a path.
 static std::string getBaseName(const std::string &path)
@@ -22,63 +29,160 @@ static std::string getBaseName(const std::string &path)
 	return path.substr(pos + 1);
 }
 
-// FileServer constructor: accepts a storage directory prefix.
-FileServer::FileServer(const std::string &storageDir)
-	: storageDirectory(storageDir)
+// FileServer constructor: accepts a storage directory prefix and tuning options.
+FileServer::FileServer(const std::string &storageDir, const FileServerOptions &options)
+	: storageDirectory(storageDir), options(options), readyQueue(options.queueCapacity),
+	  fdCache(options.fdCacheSize), hotCache(options.blockCacheSize), readahead(options.readaheadWindow),
+	  forwardQueue(options.queueCapacity), peers(16, 60, options.peerTimeout, options.maxMessageSize)
 {
 	// Ensure the base storage directory exists.
 	mkdir(storageDirectory.c_str(), 0777);
+	// Count what earlier runs stored.
+	if (DIR *dir = opendir(storageDirectory.c_str()))
+	{
+		struct stat st;
+		while (struct dirent *entry = readdir(dir))
+		{
+			std::string fullPath = storageDirectory + "/" + entry->d_name;
+			if (stat(fullPath.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+				bytesStored += st.st_size;
+		}
+		closedir(dir);
+	}
+}
+
+// Size of a file, or 0 if it cannot be read.
+static uint64_t fileSize(int fd)
+{
+	struct stat st;
+	return fstat(fd, &st) == 0 ? st.st_size : 0;
+}
+
+static uint64_t fileSize(const std::string &fullPath)
+{
+	struct stat st;
+	return stat(fullPath.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// Returns the lock stripe guarding the given stored file.
+std::shared_mutex &FileServer::lockFor(const std::string &fileName)
+{
+	return fileLocks[std::hash<std::string>()(fileName) % NUM_FILE_LOCKS];
+}
+
+// Reads up to length bytes at offset, stopping early only at the end of the file.
+static size_t preadFully(int fd, char *buffer, size_t length, uint64_t offset)
+{
+	size_t bytesRead = 0;
+	while (bytesRead < length)
+	{
+		ssize_t n = pread(fd, buffer + bytesRead, length - bytesRead, offset + bytesRead);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		bytesRead += n;
+	}
+	return bytesRead;
+}
+
+// Missing blocks are read whole and offered to the cache. A block that comes back
+// short is the end of the file.
+void FileServer::readBlocks(const std::string &fileName, int fd, size_t offset, size_t length, std::string &data)
+{
+	std::string block;
+	data.clear();
+	data.reserve(length);
+	size_t end = offset + length;
+	for (uint64_t b = offset / HotCache::BLOCK_SIZE; b * HotCache::BLOCK_SIZE < end; b++)
+	{
+		uint64_t blockStart = b * HotCache::BLOCK_SIZE;
+		size_t from = std::max<uint64_t>(offset, blockStart) - blockStart;
+		size_t count = std::min<uint64_t>(end, blockStart + HotCache::BLOCK_SIZE) - blockStart - from;
+		if (hotCache.read(fileName, b, from, count, data))
+			continue;
+		block.resize(HotCache::BLOCK_SIZE);
+		block.resize(preadFully(fd, &block[0], HotCache::BLOCK_SIZE, blockStart));
+		hotCache.insert(fileName, b, block);
+		if (block.size() > from)
+			data.append(block, from, std::min(count, block.size() - from));
+		if (block.size() < HotCache::BLOCK_SIZE)
+			break;
+	}
 }
 
 // Reads a file from storageDirectory using only the file's basename.
-std::string FileServer::readFile(const std::string &path, size_t offset, size_t length)
+std::string FileServer::readFile(const std::string &path, size_t offset, size_t length, std::string &data,
+								 uint64_t leaseHolder, uint32_t &lease)
 {
+	if (length > maxReadLength())
+		return messageTooLarge();
 	std::string fileName = getBaseName(path);
 	std::string fullPath = storageDirectory + "/" + fileName;
-	std::ifstream in(fullPath, std::ios::binary);
-	if (!in)
+	std::shared_lock<std::shared_mutex> lock(lockFor(fileName));
+	std::shared_ptr<OpenFile> file = fdCache.acquire(fileName, fullPath, false);
+	if (!file)
 		return "ERR FileNotFound";
-	in.seekg(offset, std::ios::beg);
-	char *buffer = new char[length];
-	in.read(buffer, length);
-	size_t bytesRead = in.gcount();
-	std::string data(buffer, bytesRead);
-	delete[] buffer;
-	return "DATA " + std::to_string(bytesRead) + " " + data;
+	lease = grantLease(fileName, leaseHolder);
+	readahead.access(fileName, file, offset, length);
+	if (hotCache.enabled() && length <= MAX_CACHED_READ)
+	{
+		readBlocks(fileName, file->fd, offset, length, data);
+		return "OK";
+	}
+	data.resize(length);
+	data.resize(preadFully(file->fd, &data[0], length, offset));
+	return "OK";
 }
 
 // Writes data to a file in storageDirectory using only the file's basename.
-std::string FileServer::writeFile(const std::string &path, size_t offset, const std::string &data)
+// The file is created if it does not exist yet.
+std::string FileServer::writeFile(const std::string &path, size_t offset, const char *data, size_t size,
+								  uint64_t leaseHolder)
 {
 	std::string fileName = getBaseName(path);
 	std::string fullPath = storageDirectory + "/" + fileName;
-	std::fstream out;
-	out.open(fullPath, std::ios::in | std::ios::out | std::ios::binary);
-	if (!out.is_open())
+	std::unique_lock<std::shared_mutex> lock(lockFor(fileName));
+	if (uint32_t wait = leaseConflict(fileName, leaseHolder))
+		return "ERR LeaseHeld " + std::to_string(wait);
+	std::shared_ptr<OpenFile> file = fdCache.acquire(fileName, fullPath, true);
+	if (!file)
+		return "ERR CannotOpenFile";
+	uint64_t oldSize = fileSize(file->fd);
+	size_t written = 0;
+	while (written < size)
 	{
-		out.clear();
-		out.open(fullPath, std::ios::out | std::ios::binary);
-		out.close();
-		out.open(fullPath, std::ios::in | std::ios::out | std::ios::binary);
-		if (!out.is_open())
-			return "ERR CannotOpenFile";
+		ssize_t n = pwrite(file->fd, data + written, size - written, offset + written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			if (offset + written > oldSize)
+				bytesStored += offset + written - oldSize;
+			hotCache.invalidate(fileName);
+			return "ERR WriteFailed: " + std::string(strerror(errno));
+		}
+		written += n;
 	}
-	out.seekp(offset, std::ios::beg);
-	out.write(data.c_str(), data.size());
-	out.flush();
-	out.close();
-	return "OK " + std::to_string(data.size());
+	hotCache.update(fileName, offset, data, size);
+	if (offset + size > oldSize)
+		bytesStored += offset + size - oldSize;
+	return "OK " + std::to_string(size);
 }
 
 // Creates an empty file in storageDirectory using only the file's basename.
+// An existing file is truncated, as before.
 std::string FileServer::createFile(const std::string &path)
 {
 	std::string fileName = getBaseName(path);
 	std::string fullPath = storageDirectory + "/" + fileName;
-	std::ofstream ofs(fullPath, std::ios::binary);
-	if (ofs)
+	std::unique_lock<std::shared_mutex> lock(lockFor(fileName));
+	hotCache.invalidate(fileName);
+	std::shared_ptr<OpenFile> file = fdCache.acquire(fileName, fullPath, true);
+	uint64_t oldSize = file ? fileSize(file->fd) : 0;
+	if (file && ftruncate(file->fd, 0) == 0)
 	{
-		ofs.close();
+		bytesStored -= oldSize;
 		return "OK";
 	}
 	else
@@ -90,12 +194,328 @@ std::string FileServer::deleteFile(const std::string &path)
 {
 	std::string fileName = getBaseName(path);
 	std::string fullPath = storageDirectory + "/" + fileName;
+	std::unique_lock<std::shared_mutex> lock(lockFor(fileName));
+	// Drop the cached descriptor so a later CREATE of the same name gets the new file.
+	fdCache.invalidate(fileName);
+	hotCache.invalidate(fileName);
+	readahead.forget(fileName);
+	uint64_t size = fileSize(fullPath);
 	if (remove(fullPath.c_str()) == 0)
+	{
+		bytesStored -= size;
 		return "OK";
+	}
 	else
 		return "ERR CannotDeleteFile: " + std::string(strerror(errno));
 }
 
+// Deletes several files in one request. A file that is already gone counts as
+// deleted, so a batch can be sent again after a partial failure. Returns "OK" or
+// "ERR DeleteFailed" followed by the names that could not be deleted.
+std::string FileServer::deleteFiles(const std::vector<std::string> &paths)
+{
+	std::string failed;
+	for (const auto &path : paths)
+	{
+		std::string fileName = getBaseName(path);
+		std::string fullPath = storageDirectory + "/" + fileName;
+		std::unique_lock<std::shared_mutex> lock(lockFor(fileName));
+		fdCache.invalidate(fileName);
+		hotCache.invalidate(fileName);
+		readahead.forget(fileName);
+		uint64_t size = fileSize(fullPath);
+		if (remove(fullPath.c_str()) == 0)
+			bytesStored -= size;
+		else if (errno != ENOENT)
+			failed += " " + fileName;
+	}
+	if (failed.empty())
+		return "OK";
+	return "ERR DeleteFailed" + failed;
+}
+
+uint32_t FileServer::grantLease(const std::string &fileName, uint64_t holder)
+{
+	if (holder == 0 || options.leaseTerm <= 0)
+		return 0;
+	auto now = std::chrono::steady_clock::now();
+	auto term = std::chrono::milliseconds(options.leaseTerm);
+	std::lock_guard<std::mutex> lock(leaseMutex);
+	// Forget files whose leases have all run out, at most once per term.
+	if (now >= nextLeaseSweep)
+	{
+		for (auto it = leases.begin(); it != leases.end();)
+		{
+			bool live = it->second.writerWaiting > now;
+			for (const auto &entry : it->second.holders)
+				live = live || entry.second > now;
+			it = live ? std::next(it) : leases.erase(it);
+		}
+		nextLeaseSweep = now + term;
+	}
+	FileLeases &file = leases[fileName];
+	if (file.writerWaiting > now)
+		return 0;
+	file.holders[holder] = now + term;
+	return options.leaseTerm;
+}
+
+uint32_t FileServer::leaseConflict(const std::string &fileName, uint64_t holder)
+{
+	if (options.leaseTerm <= 0)
+		return 0;
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(leaseMutex);
+	auto it = leases.find(fileName);
+	if (it == leases.end())
+		return 0;
+	auto latest = now;
+	for (auto h = it->second.holders.begin(); h != it->second.holders.end();)
+	{
+		if (h->second <= now)
+			h = it->second.holders.erase(h);
+		else
+		{
+			if (h->first != holder)
+				latest = std::max(latest, h->second);
+			++h;
+		}
+	}
+	if (latest == now)
+		return 0;
+	// Leave the writer a term to come back in before leases are granted again.
+	it->second.writerWaiting = latest + std::chrono::milliseconds(options.leaseTerm);
+	return std::chrono::duration_cast<std::chrono::milliseconds>(latest - now).count() + 1;
+}
+
+// Reports the load the Namespace Server places files by, then the block cache's
+// hits and misses (in blocks) and the bytes it holds.
+std::string FileServer::statistics()
+{
+	return "OK bytes=" + std::to_string(bytesStored.load()) + " requests=" + std::to_string(requestsServed.load()) +
+		   " cache_hits=" + std::to_string(hotCache.hitCount()) + " cache_misses=" + std::to_string(hotCache.missCount()) +
+		   " cache_bytes=" + std::to_string(hotCache.usedBytes());
+}
+
+// Times a write to a peer is retried after waiting for leases there.
+static const int MAX_LEASE_WAITS = 4;
+
+void FileServer::recordLagging(const std::string &object, const std::string &address)
+{
+	std::lock_guard<std::mutex> lock(laggingMutex);
+	lagging.insert({object, address});
+}
+
+// Answers LAGGING with "OK <object> <ip>:<port> ..." and forgets what it reported.
+std::string FileServer::collectLagging()
+{
+	std::lock_guard<std::mutex> lock(laggingMutex);
+	std::string response = "OK";
+	for (const auto &[object, address] : lagging)
+		response += " " + object + " " + address;
+	lagging.clear();
+	return response;
+}
+
+std::string FileServer::peerRequest(const std::string &address, const MessageHeader &header, std::string_view path,
+									std::string_view token, std::string_view payload)
+{
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos)
+		return "ERR InvalidAddress";
+	std::string ip = address.substr(0, colon);
+	int port = std::atoi(address.c_str() + colon + 1);
+	std::string request = encodeMessage(header, path, token, payload);
+	int leaseWaits = 0;
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		bool reused = false;
+		int fd = peers.acquire(ip, port, &reused);
+		if (fd < 0)
+			return "ERR ConnectionFailed";
+		// Pooled connections are only opened here, so every one of them is binary.
+		std::string response;
+		size_t sent = 0;
+		bool ok = reused || (sendMessage(fd, BINARY_HELLO) >= 0 && readMessage(fd, response) > 0 &&
+							 response == BINARY_ACCEPT);
+		if (ok && sendMessage(fd, request, &sent) >= 0 && readMessage(fd, response, options.maxMessageSize) > 0)
+		{
+			peers.release(ip, port, fd);
+			BinaryMessage msg;
+			if (!decodeMessage(response, msg))
+				return "ERR MalformedResponse";
+			std::string result = msg.header.status == STATUS_OK ? "OK" : std::string(msg.payload);
+			// Wait for readers' leases on the peer to run out, then try again.
+			if (result.compare(0, 14, "ERR LeaseHeld ") == 0 && leaseWaits++ < MAX_LEASE_WAITS)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(std::atol(result.c_str() + 14)));
+				attempt--;
+				continue;
+			}
+			return result;
+		}
+		peers.discard(fd);
+		// A request that went out, or timed out waiting for its answer, is not
+		// sent again.
+		if (!reused || sent > 0)
+			break;
+	}
+	return "ERR ConnectionFailed";
+}
+
+// Passes a write that succeeded here on to the first server of the chain that
+// takes it, along with the rest of the chain. The servers it skips are lagging.
+void FileServer::forwardWrite(const std::string &object, const std::string &chain, size_t offset,
+							  const std::string &capability, const std::string &data)
+{
+	std::vector<std::string> next;
+	for (const auto &entry : split(chain, CHAIN_SEPARATOR))
+	{
+		if (entry.empty())
+			continue;
+		if (entry[0] == CHAIN_SKIPPED)
+			recordLagging(object, entry.substr(1));
+		else
+			next.push_back(entry);
+	}
+	for (size_t i = 0; i < next.size(); i++)
+	{
+		std::string rest = object;
+		for (size_t j = i + 1; j < next.size(); j++)
+			rest += CHAIN_SEPARATOR + next[j];
+		MessageHeader h;
+		h.opcode = OP_WRITE;
+		h.offset = offset;
+		if (peerRequest(next[i], h, rest, capability, data) == "OK")
+			return;
+		recordLagging(object, next[i]);
+	}
+}
+
+bool FileServer::serveChainedWrite(ClientConnection *conn, const std::string &frame, bool &sent, bool &deferred)
+{
+	std::string path, capability, data, tag;
+	size_t offset = 0;
+	BinaryMessage msg;
+	if (conn->binary)
+	{
+		if (!decodeMessage(frame, msg) || msg.header.opcode != OP_WRITE ||
+			msg.path.find(CHAIN_SEPARATOR) == std::string_view::npos)
+			return false;
+		path = std::string(msg.path);
+		capability = std::string(msg.token);
+		offset = msg.header.offset;
+		data = std::string(msg.payload);
+	}
+	else
+	{
+		uint32_t id;
+		std::string body;
+		if (untagMessage(frame, id, body))
+			tag = frame.substr(0, frame.size() - body.size());
+		else
+			body = frame;
+		// WRITE <object>,<chain> <offset> <capability> <data>
+		std::istringstream iss(body);
+		std::string command;
+		iss >> command >> path;
+		if (command != "WRITE" || path.find(CHAIN_SEPARATOR) == std::string::npos)
+			return false;
+		iss >> offset >> capability;
+		std::getline(iss >> std::ws, data);
+	}
+	size_t separator = path.find(CHAIN_SEPARATOR);
+	std::string object = path.substr(0, separator);
+	std::string chain = path.substr(separator + 1);
+	bool binary = conn->binary;
+	MessageHeader request = msg.header;
+	auto respond = [binary, request, tag](const std::string &result, size_t written)
+	{
+		if (binary)
+			return result.compare(0, 3, "OK ") == 0 ? encodeResponse(request, STATUS_OK, std::string_view(), written)
+													: encodeResponse(request, STATUS_ERROR, result);
+		return tag + result;
+	};
+
+	// The holder goes down the chain with the capability.
+	std::string token = capability;
+	uint64_t holder = splitLeaseHolder(token);
+	std::string error;
+	if (!verifyCapability(token, getBaseName(object), 'w', error))
+	{
+		sent = sendMessage(conn->fd, respond(error, 0)) >= 0;
+		return true;
+	}
+	// Nothing is written until a forwarder takes the write, so a refused one leaves
+	// every replica as it was.
+	auto forward = [this, conn, object, chain, offset, capability, holder, data = std::move(data), respond]()
+	{
+		std::string result = writeFile(object, offset, data.data(), data.size(), holder);
+		if (result.compare(0, 3, "OK ") == 0)
+			forwardWrite(object, chain, offset, capability, data);
+		if (sendMessage(conn->fd, respond(result, data.size())) >= 0)
+			rearm(conn);
+		else
+		{
+			close(conn->fd);
+			delete conn;
+		}
+	};
+	if (!forwardQueue.tryPush(std::move(forward)))
+	{
+		sent = sendMessage(conn->fd, respond("ERR ServerBusy", 0)) >= 0;
+		return true;
+	}
+	deferred = true;
+	return true;
+}
+
+// Forwarder thread body: runs queued chained writes until it pops an empty task.
+void FileServer::forwarderLoop()
+{
+	while (std::function<void()> task = forwardQueue.pop())
+		task();
+}
+
+// Copies the object with a CREATE and WRITEs of TRANSFER_CHUNK bytes over a pooled
+// connection. It stays locked meanwhile, so writes that pass through this server
+// wait for the copy. The capability must grant reading the object here; the peer
+// checks that it grants writing it there.
+std::string FileServer::replicateFile(const std::string &path, const std::string &address, const std::string &capability)
+{
+	std::string fileName = getBaseName(path);
+	std::string error;
+	if (!verifyCapability(capability, fileName, 'r', error))
+		return error;
+	std::string fullPath = storageDirectory + "/" + fileName;
+	std::unique_lock<std::shared_mutex> lock(lockFor(fileName));
+	std::shared_ptr<OpenFile> file = fdCache.acquire(fileName, fullPath, false);
+	if (!file)
+		return "ERR FileNotFound";
+	MessageHeader h;
+	h.opcode = OP_CREATE;
+	std::string result = peerRequest(address, h, fileName, issueServerCapability(), std::string_view());
+	if (result != "OK")
+		return result;
+	uint64_t size = fileSize(file->fd);
+	std::string buffer(std::min<uint64_t>(size, TRANSFER_CHUNK), '\0');
+	h.opcode = OP_WRITE;
+	for (uint64_t offset = 0; offset < size;)
+	{
+		ssize_t n = pread(file->fd, &buffer[0], std::min<uint64_t>(buffer.size(), size - offset), offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return "ERR ReadFailed";
+		h.offset = offset;
+		result = peerRequest(address, h, fileName, capability, std::string_view(buffer.data(), n));
+		if (result != "OK")
+			return result;
+		offset += n;
+	}
+	return "OK";
+}
+
 // Handles incoming requests from the client.
 std::string FileServer::handleRequest(const std::string &request)
 {
@@ -104,33 +524,86 @@ std::string FileServer::handleRequest(const std::string &request)
 	iss >> command;
 	if (command == "READ")
 	{
-		std::string path;
+		// READ <object> <offset> <length> <capability>
+		std::string path, capability, error;
 		size_t offset, length;
-		iss >> path >> offset >> length;
-		return readFile(path, offset, length);
+		iss >> path >> offset >> length >> capability;
+		uint64_t holder = splitLeaseHolder(capability);
+		if (!verifyCapability(capability, getBaseName(path), 'r', error))
+			return error;
+		std::string data;
+		uint32_t lease = 0;
+		std::string result = readFile(path, offset, length, data, holder, lease);
+		if (result != "OK")
+			return result;
+		std::string granted = lease ? "LEASE " + std::to_string(lease) + " " : "";
+		return granted + "DATA " + std::to_string(data.size()) + " " + data;
 	}
 	else if (command == "WRITE")
 	{
-		std::string path;
+		// WRITE <object> <offset> <capability> <data>
+		std::string path, capability, error;
 		size_t offset;
-		iss >> path >> offset;
+		iss >> path >> offset >> capability;
+		uint64_t holder = splitLeaseHolder(capability);
+		if (!verifyCapability(capability, getBaseName(path), 'w', error))
+			return error;
 		std::string data;
 		std::getline(iss >> std::ws , data);
 		std::cout<<"Data to be written: "<<data<<std::endl;
-		return writeFile(path, offset, data);
+		return writeFile(path, offset, data.data(), data.size(), holder);
 	}
 	else if (command == "CREATE")
 	{
-		std::string path;
-		iss >> path;
+		// CREATE <object> <server capability>
+		std::string path, capability, error;
+		iss >> path >> capability;
+		if (!verifyServerCapability(capability, error))
+			return error;
 		return createFile(path);
 	}
 	else if (command == "DELETE")
 	{
-		std::string path;
-		iss >> path;
+		// DELETE <object> <server capability>
+		std::string path, capability, error;
+		iss >> path >> capability;
+		if (!verifyServerCapability(capability, error))
+			return error;
 		return deleteFile(path);
 	}
+	else if (command == "DELETE_MANY")
+	{
+		// DELETE_MANY <server capability> <object> <object> ...
+		std::string capability, error;
+		iss >> capability;
+		if (!verifyServerCapability(capability, error))
+			return error;
+		std::vector<std::string> paths;
+		std::string path;
+		while (iss >> path)
+			paths.push_back(path);
+		return deleteFiles(paths);
+	}
+	else if (command == "STATS")
+	{
+		return statistics();
+	}
+	else if (command == "LAGGING")
+	{
+		// LAGGING <server capability>
+		std::string capability, error;
+		iss >> capability;
+		if (!verifyServerCapability(capability, error))
+			return error;
+		return collectLagging();
+	}
+	else if (command == "REPLICATE")
+	{
+		// REPLICATE <object> <ip>:<port> <capability>
+		std::string path, address, capability;
+		iss >> path >> address >> capability;
+		return replicateFile(path, address, capability);
+	}
 	else if (command == "MKDIR")
 	{
 		// Although directories are not stored on file servers, we support this command
@@ -140,15 +613,268 @@ std::string FileServer::handleRequest(const std::string &request)
 	return "ERR UnknownCommand";
 }
 
-// Processes client requests on the given socket.
-void FileServer::processRequest(int clientSock)
+// Handles a binary protocol request. Sections are used in place; WRITE payloads go
+// to disk straight from the received frame.
+std::string FileServer::handleBinaryRequest(const std::string &frame)
+{
+	BinaryMessage msg;
+	if (!decodeMessage(frame, msg))
+		return encodeResponse(msg.header, STATUS_ERROR, "ERR MalformedMessage");
+	std::string path(msg.path);
+	std::string token(msg.token);
+	uint64_t holder = splitLeaseHolder(token);
+	std::string error;
+	switch (msg.header.opcode)
+	{
+	case OP_READ:
+	{
+		if (!verifyCapability(token, getBaseName(path), 'r', error))
+			return encodeResponse(msg.header, STATUS_ERROR, error);
+		std::string data;
+		uint32_t lease = 0;
+		std::string result = readFile(path, msg.header.offset, msg.header.length, data, holder, lease);
+		if (result != "OK")
+			return encodeResponse(msg.header, STATUS_ERROR, result);
+		std::string response = encodeResponse(msg.header, STATUS_OK, data, data.size());
+		if (lease)
+		{
+			MessageHeader h;
+			h.opcode = OP_READ;
+			h.requestId = msg.header.requestId;
+			h.flags = FLAG_LEASE;
+			h.offset = lease;
+			h.length = data.size();
+			encodeHeader(h, &response[0]);
+		}
+		return response;
+	}
+	case OP_WRITE:
+	{
+		if (!verifyCapability(token, getBaseName(path), 'w', error))
+			return encodeResponse(msg.header, STATUS_ERROR, error);
+		std::string result = writeFile(path, msg.header.offset, msg.payload.data(), msg.payload.size(), holder);
+		if (result.compare(0, 3, "OK ") != 0)
+			return encodeResponse(msg.header, STATUS_ERROR, result);
+		return encodeResponse(msg.header, STATUS_OK, std::string_view(), msg.payload.size());
+	}
+	case OP_CREATE:
+	case OP_DELETE:
+	{
+		if (!verifyServerCapability(token, error))
+			return encodeResponse(msg.header, STATUS_ERROR, error);
+		std::string result = (msg.header.opcode == OP_CREATE) ? createFile(path) : deleteFile(path);
+		return encodeResponse(msg.header, result == "OK" ? STATUS_OK : STATUS_ERROR, result);
+	}
+	default:
+		return encodeResponse(msg.header, STATUS_ERROR, "ERR UnknownCommand");
+	}
+}
+
+// Zero-copy READ: the response header is built in memory and the payload is sent
+// from the page cache with sendfile(), so no user-space buffer holds the data.
+bool FileServer::serveZeroCopyRead(ClientConnection *conn, const std::string &frame, bool &sent)
+{
+	std::string path, capability, tag;
+	size_t offset = 0, length = 0;
+	BinaryMessage msg;
+	if (conn->binary)
+	{
+		if (!decodeMessage(frame, msg) || msg.header.opcode != OP_READ)
+			return false;
+		path = std::string(msg.path);
+		capability = std::string(msg.token);
+		offset = msg.header.offset;
+		length = msg.header.length;
+	}
+	else
+	{
+		uint32_t id;
+		std::string body;
+		if (untagMessage(frame, id, body))
+			tag = frame.substr(0, frame.size() - body.size());
+		else
+			body = frame;
+		std::istringstream iss(body);
+		std::string command;
+		iss >> command;
+		if (command != "READ")
+			return false;
+		iss >> path >> offset >> length >> capability;
+	}
+	// Small reads go through the block cache instead.
+	if (hotCache.enabled() && length <= MAX_CACHED_READ)
+		return false;
+
+	std::string fileName = getBaseName(path);
+	uint64_t holder = splitLeaseHolder(capability);
+	std::string error;
+	std::shared_ptr<OpenFile> file;
+	std::shared_lock<std::shared_mutex> lock(lockFor(fileName));
+	if (length > maxReadLength())
+		error = messageTooLarge();
+	else if (verifyCapability(capability, fileName, 'r', error))
+	{
+		file = fdCache.acquire(fileName, storageDirectory + "/" + fileName, false);
+		if (!file)
+			error = "ERR FileNotFound";
+	}
+	if (!file)
+	{
+		std::string response = conn->binary ? encodeResponse(msg.header, STATUS_ERROR, error) : tag + error;
+		sent = sendMessage(conn->fd, response) >= 0;
+		return true;
+	}
+
+	// Clamp the range to the file size, as a buffered read would.
+	struct stat st;
+	size_t available = 0;
+	if (fstat(file->fd, &st) == 0 && (size_t)st.st_size > offset)
+		available = st.st_size - offset;
+	if (length > available)
+		length = available;
+	uint32_t lease = grantLease(fileName, holder);
+	readahead.access(fileName, file, offset, length);
+
+	std::string head;
+	if (conn->binary)
+	{
+		MessageHeader h;
+		h.opcode = OP_READ;
+		h.requestId = msg.header.requestId;
+		h.length = length;
+		if (lease)
+		{
+			h.flags = FLAG_LEASE;
+			h.offset = lease;
+		}
+		head.assign(HEADER_SIZE, '\0');
+		encodeHeader(h, &head[0]);
+	}
+	else
+		head = tag + (lease ? "LEASE " + std::to_string(lease) + " " : "") + "DATA " + std::to_string(length) + " ";
+	sent = sendMessageWithFile(conn->fd, head, file->fd, offset, length) >= 0;
+	return true;
+}
+
+std::string FileServer::messageTooLarge() const
 {
-	std::string line;
-	while (readMessage(clientSock, line) > 0)
+	return "ERR MessageTooLarge " + std::to_string(options.maxMessageSize);
+}
+
+// Serves the first buffered request of the given connection.
+// Returns false if the socket failed.
+bool FileServer::processRequest(ClientConnection *conn, bool &deferred)
+{
+	std::string line = std::move(conn->frames.front());
+	conn->frames.pop_front();
+	requestsServed++;
+	bool sent;
+	if (options.zeroCopyReads && serveZeroCopyRead(conn, line, sent))
+		return sent;
+	if (serveChainedWrite(conn, line, sent, deferred))
+		return deferred || sent;
+	std::string response;
+	if (conn->binary)
+		response = handleBinaryRequest(line);
+	else if (line == BINARY_HELLO)
+	{
+		conn->binary = true;
+		response = BINARY_ACCEPT;
+	}
+	else
 	{
 		std::cout << "FileServer received: " << line << "\n";
-		std::string response = handleRequest(line);
-		sendMessage(clientSock, response);
+		uint32_t id;
+		std::string body;
+		if (untagMessage(line, id, body))
+			response = tagMessage(id, handleRequest(body));
+		else
+			response = handleRequest(line);
+	}
+	return sendMessage(conn->fd, response) >= 0;
+}
+
+// Worker thread body: serves the requests buffered for a ready connection in
+// order, then hands the connection back to epoll so that its next request can go
+// to any worker.
+void FileServer::workerLoop()
+{
+	while (true)
+	{
+		ClientConnection *conn = readyQueue.pop();
+		if (!conn)
+			return;
+		bool open = true, deferred = false;
+		while (open && !deferred && !conn->frames.empty())
+			open = processRequest(conn, deferred);
+		if (!open)
+		{
+			close(conn->fd);
+			delete conn;
+		}
+		else if (!deferred)
+			rearm(conn);
+	}
+}
+
+bool FileServer::readFrames(ClientConnection *conn)
+{
+	char buf[65536];
+	while (!conn->peerClosed)
+	{
+		ssize_t n = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n > 0)
+		{
+			conn->inBuf.append(buf, n);
+			continue;
+		}
+		// A peer that half-closes after its last requests still gets the answers.
+		if (n == 0)
+			conn->peerClosed = true;
+		else if (errno == EINTR)
+			continue;
+		else if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return false;
+		break;
+	}
+	size_t pos = 0;
+	std::string frame;
+	int extracted;
+	while ((extracted = extractMessage(conn->inBuf, pos, frame, options.maxMessageSize)) > 0)
+		conn->frames.push_back(std::move(frame));
+	conn->inBuf.erase(0, pos);
+	if (extracted < 0)
+	{
+		std::cerr << "FileServer: closing a connection that sent a message over " << options.maxMessageSize
+				  << " bytes\n";
+		return false;
+	}
+	return !conn->peerClosed || !conn->frames.empty();
+}
+
+// Called by the worker or forwarder that owns the connection. Frames buffered
+// meanwhile are already off the socket, so epoll would not report them.
+void FileServer::rearm(ClientConnection *conn)
+{
+	if (!conn->frames.empty())
+	{
+		readyQueue.push(conn);
+		return;
+	}
+	if (conn->peerClosed)
+	{
+		close(conn->fd);
+		delete conn;
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+	{
+		close(conn->fd);
+		delete conn;
 	}
 }
 
@@ -177,6 +903,8 @@ void FileServer::run(int port)
 		std::cerr << "FileServer: Error opening socket\n";
 		return;
 	}
+	int reuse = 1;
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 	memset((char *)&serv_addr, 0, sizeof(serv_addr));
 
 	serv_addr.sin_family = AF_INET;
@@ -189,19 +917,92 @@ void FileServer::run(int port)
 		close(sockfd);
 		return;
 	}
-	listen(sockfd, 5);
-	std::cout << "FileServer running on port " << port << "\n";
-	clilen = sizeof(cli_addr);
+	listen(sockfd, SOMAXCONN);
+
+	epfd = epoll_create1(0);
+	if (epfd < 0)
+	{
+		std::cerr << "FileServer: Error creating epoll instance\n";
+		close(sockfd);
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr; // Marks the listening socket.
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+
+	for (int i = 0; i < options.numThreads; i++)
+	{
+		workers.emplace_back(&FileServer::workerLoop, this);
+		forwarders.emplace_back(&FileServer::forwarderLoop, this);
+	}
+	std::cout << "FileServer running on port " << port << " with " << options.numThreads << " worker threads, "
+			  << (options.zeroCopyReads ? "zero-copy" : "buffered") << " reads, "
+			  << fdCache.capacity() << " cached descriptors, " << hotCache.capacityBytes() / (1024 * 1024)
+			  << " MiB block cache, " << readahead.maxWindowBytes() / 1024 << " KiB readahead, " << options.leaseTerm
+			  << " ms read leases, " << options.maxMessageSize / 1024 << " KiB messages\n";
+
+	// Connections are registered one-shot: each readiness event is handled by this
+	// loop, which reads what has arrived and hands the connection to exactly one
+	// worker once a whole request is buffered. When the queue is full push() blocks,
+	// so we stop accepting and reading until the workers catch up.
+	const int maxEvents = 256;
+	struct epoll_event events[maxEvents];
 	while (true)
 	{
-		newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-		if (newsockfd < 0)
+		int n = epoll_wait(epfd, events, maxEvents, -1);
+		if (n < 0)
 		{
-			std::cerr << "FileServer: Error on accept\n";
-			continue;
+			if (errno == EINTR)
+				continue;
+			std::cerr << "FileServer: Error on epoll_wait: " << strerror(errno) << "\n";
+			break;
+		}
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr != nullptr)
+			{
+				ClientConnection *conn = static_cast<ClientConnection *>(events[i].data.ptr);
+				if (!readFrames(conn))
+				{
+					close(conn->fd);
+					delete conn;
+				}
+				else
+					rearm(conn);
+				continue;
+			}
+			clilen = sizeof(cli_addr);
+			newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
+			if (newsockfd < 0)
+			{
+				std::cerr << "FileServer: Error on accept\n";
+				continue;
+			}
+			int one = 1;
+			setsockopt(newsockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			ClientConnection *conn = new ClientConnection{newsockfd};
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLONESHOT;
+			ev.data.ptr = conn;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0)
+			{
+				close(newsockfd);
+				delete conn;
+			}
 		}
-		processRequest(newsockfd);
-		close(newsockfd);
 	}
+	// Workers stop at a null connection and forwarders at an empty task; the
+	// forwarders go last, since workers hand them writes.
+	for (size_t i = 0; i < workers.size(); i++)
+		readyQueue.push(nullptr);
+	for (auto &worker : workers)
+		worker.join();
+	for (size_t i = 0; i < forwarders.size(); i++)
+		forwardQueue.push(std::function<void()>());
+	for (auto &forwarder : forwarders)
+		forwarder.join();
+	close(epfd);
 	close(sockfd);
 }
@@ -4,6 +4,22 @@
 #include <string>
 #include <queue>
 #include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <set>
+#include <unordered_map>
+#include "../common/connection_pool.h"
+#include "../common/protocol.h"
+#include "../common/util.h"
+#include "../common/work_queue.h"
+#include "FdCache.h"
+#include "HotCache.h"
+#include "Readahead.h"
 
 // Structure representing a file operation request.
 struct FileOp
@@ -15,25 +31,160 @@ struct FileOp
 	std::string data; // Data for WRITE operations.
 };
 
+// Tunables for a FileServer instance, set from fs_main arguments.
+struct FileServerOptions
+{
+	int numThreads = 4;
+	size_t queueCapacity = 1024;
+	// Serve READ payloads with sendfile() instead of copying them through a buffer.
+	bool zeroCopyReads = true;
+	// Maximum number of open descriptors kept in the LRU descriptor cache.
+	size_t fdCacheSize = 1024;
+	// Bytes of object data kept in the in-memory block cache; 0 disables it.
+	size_t blockCacheSize = 64 * 1024 * 1024;
+	// Largest readahead window for sequential and strided readers; 0 disables it.
+	size_t readaheadWindow = 4 * 1024 * 1024;
+	// Length of a read lease in milliseconds; 0 grants none.
+	int leaseTerm = 2000;
+	// Longest message accepted on a connection; at least 2 * TRANSFER_CHUNK.
+	size_t maxMessageSize = MAX_MESSAGE_SIZE;
+	// Longest wait for another file server to take or answer a request; 0 waits forever.
+	int peerTimeout = 10000;
+};
+
+// State kept for each client connection while it is registered with epoll.
+// The event loop reads into inBuf and moves whole frames to frames; a worker only
+// gets the connection once there is one to serve.
+struct ClientConnection
+{
+	int fd;
+	bool binary = false; // Switched on by the BINARY_HELLO handshake.
+	bool peerClosed = false; // The peer has sent everything; serve frames, then close.
+	std::string inBuf;
+	std::deque<std::string> frames;
+};
+
 class FileServer
 {
 public:
-	FileServer(const std::string &storageDir);
+	FileServer(const std::string &storageDir, const FileServerOptions &options = FileServerOptions());
 	void run(int port);
 
 private:
 	std::string storageDirectory;
-	std::mutex fsMutex; // For potential concurrency (used in the threaded demo)
+	FileServerOptions options;
+
+	// Worker pool: the event loop queues connections that have a whole request
+	// buffered, and workers serve the buffered requests before re-arming the
+	// connection. A client sending a frame slowly never holds a worker.
+	int epfd = -1;
+	BoundedQueue<ClientConnection *> readyQueue;
+	std::vector<std::thread> workers;
+	void workerLoop();
+	// Reads what the socket has without blocking and splits off whole frames.
+	// Returns false on a socket error, a frame over the limit, or once the peer
+	// has closed with no whole frame left to serve.
+	bool readFrames(ClientConnection *conn);
+	// Queues a connection with buffered frames for a worker, or hands it back to
+	// epoll for its next request, or closes it.
+	void rearm(ClientConnection *conn);
+
+	// Striped per-file locks: READ takes a shared lock, mutations an exclusive one.
+	static const size_t NUM_FILE_LOCKS = 64;
+	std::shared_mutex fileLocks[NUM_FILE_LOCKS];
+	std::shared_mutex &lockFor(const std::string &fileName);
+
+	// Open descriptors for recently used objects, accessed with pread/pwrite.
+	FdCache fdCache;
+	// Hot blocks of objects. Reads up to MAX_CACHED_READ bytes go through it, and
+	// writes update the blocks it holds.
+	HotCache hotCache;
+	static const size_t MAX_CACHED_READ = 256 * 1024;
+	// Prefetches ahead of objects that are read in a pattern.
+	Readahead readahead;
+	// Fills data from cached blocks and from whole blocks read from fd.
+	void readBlocks(const std::string &fileName, int fd, size_t offset, size_t length, std::string &data);
+
+	// Read leases per stored file (see LEASE_HOLDER_SEPARATOR). A write refused for a
+	// lease stops new leases on its file for a while, so readers cannot starve it.
+	struct FileLeases
+	{
+		std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> holders;
+		std::chrono::steady_clock::time_point writerWaiting; // No new leases before this.
+	};
+	std::mutex leaseMutex;
+	std::unordered_map<std::string, FileLeases> leases;
+	std::chrono::steady_clock::time_point nextLeaseSweep;
+	// Both are called with the file's lock held. grantLease returns the term in ms,
+	// or 0 if no lease was granted. leaseConflict returns the ms until the leases of
+	// other holders run out, or 0 if there are none.
+	uint32_t grantLease(const std::string &fileName, uint64_t holder);
+	uint32_t leaseConflict(const std::string &fileName, uint64_t holder);
+
+	// Load reported by STATS: bytes held in storageDirectory, counted once at
+	// startup and kept current by every mutation, and requests served.
+	std::atomic<uint64_t> bytesStored{0};
+	std::atomic<uint64_t> requestsServed{0};
+	std::string statistics();
+
+	// Replication. A WRITE that names a replica chain (see CHAIN_SEPARATOR) is
+	// handed to the forwarder pool, which writes it here, passes it on and answers
+	// the client once the rest of the chain has the data. When the forward queue is
+	// full the write is refused with ERR ServerBusy. A worker never waits for
+	// another file server, but a forwarder does: servers forwarding to each other
+	// can fill each other's forwarders. Peer requests therefore time out after
+	// options.peerTimeout, and a hop that timed out is recorded as lagging, so such
+	// a cycle breaks instead of hanging.
+	// Replicas that could not be reached are kept as (object, "<ip>:<port>") until
+	// the Namespace Server collects them with LAGGING.
+	BoundedQueue<std::function<void()>> forwardQueue;
+	std::vector<std::thread> forwarders;
+	void forwarderLoop();
+	ConnectionPool peers;
+	std::mutex laggingMutex;
+	std::set<std::pair<std::string, std::string>> lagging;
+	void recordLagging(const std::string &object, const std::string &address);
+	std::string collectLagging();
+	// Returns false if the frame is not a chained WRITE. Otherwise the request is
+	// answered here, or deferred is set and a forwarder answers it and re-arms the
+	// connection.
+	bool serveChainedWrite(ClientConnection *conn, const std::string &frame, bool &sent, bool &deferred);
+	void forwardWrite(const std::string &object, const std::string &chain, size_t offset,
+					  const std::string &capability, const std::string &data);
+	// Sends a binary request to the file server at "<ip>:<port>" and returns "OK"
+	// or its error. A peer that holds the request back for lease holders is asked
+	// again up to MAX_LEASE_WAITS times, each wait also bounded by the peer timeout.
+	std::string peerRequest(const std::string &address, const MessageHeader &header, std::string_view path,
+							std::string_view token, std::string_view payload);
+	// REPLICATE: copies an object to another file server, replacing its copy there.
+	std::string replicateFile(const std::string &path, const std::string &address, const std::string &capability);
+
+	// READs longer than this are refused with messageTooLarge(), since their data
+	// would not fit in a response.
+	size_t maxReadLength() const { return options.maxMessageSize - MESSAGE_OVERHEAD; }
+	std::string messageTooLarge() const;
 
-	// Processes a single client connection.
-	void processRequest(int clientSock);
+	// Serves the first buffered request of a client connection. Returns false if
+	// the socket failed. Sets deferred if another thread will answer the request.
+	bool processRequest(ClientConnection *conn, bool &deferred);
 	// Parses and handles a request line.
 	std::string handleRequest(const std::string &request);
+	// Decodes and handles a binary protocol frame, returning the encoded response.
+	std::string handleBinaryRequest(const std::string &frame);
+	// Answers a READ by sending the file range with sendfile(). Returns false if
+	// the request is not a READ (nothing has been sent) and sets sent to whether
+	// the socket is still usable otherwise.
+	bool serveZeroCopyRead(ClientConnection *conn, const std::string &frame, bool &sent);
 
 	// Helper functions for file I/O.
-	std::string readFile(const std::string &path, size_t offset, size_t length);
-	std::string writeFile(const std::string &path, size_t offset, const std::string &data);
+	// readFile returns "OK" and fills data, or an error response. A non-zero
+	// leaseHolder asks for a lease, whose term is stored in lease.
+	std::string readFile(const std::string &path, size_t offset, size_t length, std::string &data,
+						 uint64_t leaseHolder, uint32_t &lease);
+	// Refused with "ERR LeaseHeld <ms>" while holders other than leaseHolder have a lease.
+	std::string writeFile(const std::string &path, size_t offset, const char *data, size_t size, uint64_t leaseHolder);
 	std::string deleteFile(const std::string &path);
+	std::string deleteFiles(const std::vector<std::string> &paths);
 	std::string createFile(const std::string &path);
 };
 
@@ -0,0 +1,132 @@
+#include "HotCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+HotCache::HotCache(size_t capacity)
+	: capacity(capacity), shardCapacity(capacity / NUM_SHARDS)
+{
+}
+
+HotCache::Shard &HotCache::shardFor(const std::string &name, uint64_t block)
+{
+	return shards[(std::hash<std::string>()(name) + block) % NUM_SHARDS];
+}
+
+std::list<const HotCache::Key *> &HotCache::queueOf(Shard &shard, Queue queue)
+{
+	return queue == A1IN ? shard.a1in : queue == AM ? shard.am : shard.a1out;
+}
+
+void HotCache::erase(Shard &shard, EntryMap::iterator it)
+{
+	Entry &entry = it->second;
+	if (entry.queue == A1IN)
+		shard.a1inBytes -= entry.data.size();
+	else if (entry.queue == AM)
+		shard.amBytes -= entry.data.size();
+	used -= entry.data.size();
+	queueOf(shard, entry.queue).erase(entry.position);
+	shard.entries.erase(it);
+}
+
+bool HotCache::read(const std::string &name, uint64_t block, size_t from, size_t length, std::string &out)
+{
+	Shard &shard = shardFor(name, block);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.entries.find({name, block});
+	if (it == shard.entries.end() || it->second.queue == A1OUT)
+	{
+		misses++;
+		return false;
+	}
+	Entry &entry = it->second;
+	if (entry.queue == AM)
+		shard.am.splice(shard.am.begin(), shard.am, entry.position);
+	out.append(entry.data, from, length);
+	hits++;
+	return true;
+}
+
+void HotCache::insert(const std::string &name, uint64_t block, const std::string &data)
+{
+	if (data.size() != BLOCK_SIZE || shardCapacity < BLOCK_SIZE)
+		return;
+	Shard &shard = shardFor(name, block);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.entries.find({name, block});
+	Queue queue = A1IN;
+	if (it != shard.entries.end())
+	{
+		// Another reader loaded it meanwhile.
+		if (it->second.queue != A1OUT)
+			return;
+		// Seen before and read again since: the block is hot.
+		queue = AM;
+		erase(shard, it);
+	}
+	it = shard.entries.emplace(Key(name, block), Entry()).first;
+	std::list<const Key *> &list = queueOf(shard, queue);
+	list.push_front(&it->first);
+	it->second.queue = queue;
+	it->second.position = list.begin();
+	it->second.data = data;
+	(queue == AM ? shard.amBytes : shard.a1inBytes) += data.size();
+	used += data.size();
+	reclaim(shard);
+}
+
+// A1in keeps a quarter of the shard; what leaves it is remembered in A1out, which
+// holds names for as many blocks as half the shard.
+void HotCache::reclaim(Shard &shard)
+{
+	while (shard.a1inBytes + shard.amBytes > shardCapacity)
+	{
+		if (shard.a1inBytes > shardCapacity / 4 || shard.am.empty())
+		{
+			auto it = shard.entries.find(*shard.a1in.back());
+			Entry &entry = it->second;
+			shard.a1inBytes -= entry.data.size();
+			used -= entry.data.size();
+			std::string().swap(entry.data);
+			shard.a1in.pop_back();
+			shard.a1out.push_front(&it->first);
+			entry.queue = A1OUT;
+			entry.position = shard.a1out.begin();
+		}
+		else
+			erase(shard, shard.entries.find(*shard.am.back()));
+	}
+	while (shard.a1out.size() > shardCapacity / BLOCK_SIZE / 2)
+		erase(shard, shard.entries.find(*shard.a1out.back()));
+}
+
+void HotCache::update(const std::string &name, uint64_t offset, const char *data, size_t size)
+{
+	uint64_t end = offset + size;
+	for (uint64_t block = offset / BLOCK_SIZE; block * BLOCK_SIZE < end; block++)
+	{
+		Shard &shard = shardFor(name, block);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.entries.find({name, block});
+		if (it == shard.entries.end() || it->second.queue == A1OUT)
+			continue;
+		uint64_t start = std::max(offset, block * BLOCK_SIZE);
+		uint64_t stop = std::min(end, (block + 1) * BLOCK_SIZE);
+		memcpy(&it->second.data[start - block * BLOCK_SIZE], data + (start - offset), stop - start);
+	}
+}
+
+void HotCache::invalidate(const std::string &name)
+{
+	if (!enabled())
+		return;
+	for (Shard &shard : shards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.entries.lower_bound({name, 0});
+		while (it != shard.entries.end() && it->first.first == name)
+			erase(shard, it++);
+	}
+}
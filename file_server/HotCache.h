@@ -0,0 +1,89 @@
+#ifndef HOT_CACHE_H
+#define HOT_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+// In-memory cache of object data in fixed-size blocks, split into shards by block
+// so that readers of one hot object do not all queue on one lock.
+//
+// Each shard evicts by 2Q. A block read for the first time goes into A1in, a FIFO
+// that takes a quarter of the shard. Hits there do not count as reuse, so a scan
+// reading a block in several small pieces passes through without effect. A block
+// leaving A1in is remembered in A1out, which holds names only. A block read again
+// while still in A1out is hot and goes into Am, which is LRU. One pass over a large
+// object therefore cannot push hot blocks out of Am.
+//
+// Only full blocks are cached, so a cached block never ends the file and a write
+// past the end of a file cannot make one stale. Callers hold FileServer's file
+// lock, which orders cache updates with the reads and writes of the file.
+class HotCache
+{
+public:
+	static const size_t BLOCK_SIZE = 64 * 1024;
+
+	// capacity is the most data kept, in bytes; 0 disables the cache.
+	explicit HotCache(size_t capacity);
+
+	bool enabled() const { return capacity > 0; }
+	// Appends bytes [from, from + length) of the block to out if it is cached.
+	bool read(const std::string &name, uint64_t block, size_t from, size_t length, std::string &out);
+	// Offers a full block read from disk after a miss.
+	void insert(const std::string &name, uint64_t block, const std::string &data);
+	// Applies a write to the cached blocks it covers.
+	void update(const std::string &name, uint64_t offset, const char *data, size_t size);
+	// Drops every block of an object, e.g. before it is truncated or removed.
+	void invalidate(const std::string &name);
+
+	size_t capacityBytes() const { return capacity; }
+	size_t usedBytes() const { return used; }
+	uint64_t hitCount() const { return hits; }
+	uint64_t missCount() const { return misses; }
+
+private:
+	static const size_t NUM_SHARDS = 16;
+
+	enum Queue
+	{
+		A1IN,
+		A1OUT,
+		AM
+	};
+	typedef std::pair<std::string, uint64_t> Key;
+	struct Entry
+	{
+		Queue queue;
+		// Place in the entry's queue, which holds a pointer to its key.
+		std::list<const Key *>::iterator position;
+		std::string data; // Empty in A1out.
+	};
+	typedef std::map<Key, Entry> EntryMap;
+	struct Shard
+	{
+		std::mutex mutex;
+		EntryMap entries;
+		std::list<const Key *> a1in, a1out, am; // Newest at the front.
+		size_t a1inBytes = 0;
+		size_t amBytes = 0;
+	};
+
+	size_t capacity;
+	size_t shardCapacity;
+	Shard shards[NUM_SHARDS];
+	std::atomic<size_t> used{0};
+	std::atomic<uint64_t> hits{0};
+	std::atomic<uint64_t> misses{0};
+
+	Shard &shardFor(const std::string &name, uint64_t block);
+	std::list<const Key *> &queueOf(Shard &shard, Queue queue);
+	// Unlinks an entry from its queue and forgets it.
+	void erase(Shard &shard, EntryMap::iterator it);
+	// Evicts until the shard fits its share of the capacity.
+	void reclaim(Shard &shard);
+};
+
+#endif // HOT_CACHE_H
@@ -0,0 +1,150 @@
+#include "Readahead.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+Readahead::Readahead(size_t maxWindow)
+	: maxWindow(maxWindow), queue(MAX_QUEUED)
+{
+	if (enabled())
+		thread = std::thread(&Readahead::prefetchLoop, this);
+}
+
+Readahead::~Readahead()
+{
+	if (thread.joinable())
+	{
+		queue.push(Prefetch{nullptr, 0, 0, 0, 0});
+		thread.join();
+	}
+}
+
+// A read that continues no stream teaches the most recently used stream without a
+// pattern its stride, or starts a new stream.
+void Readahead::access(const std::string &name, const std::shared_ptr<OpenFile> &file, uint64_t offset, size_t length)
+{
+	if (!enabled() || length == 0)
+		return;
+	auto now = std::chrono::steady_clock::now();
+	Prefetch prefetch{file, 0, 0, 0, 0};
+	{
+		std::lock_guard<std::mutex> lock(streamMutex);
+		auto it = streams.find(name);
+		if (it == streams.end())
+		{
+			// Make room by dropping the object that has been idle longest.
+			if (streams.size() >= MAX_OBJECTS)
+				streams.erase(std::min_element(streams.begin(), streams.end(), [](const auto &a, const auto &b)
+											   { return a.second.back().lastUsed < b.second.back().lastUsed; }));
+			it = streams.emplace(name, std::vector<Stream>()).first;
+		}
+		std::vector<Stream> &objectStreams = it->second;
+		Stream *s = nullptr;
+		Stream *candidate = nullptr;
+		bool contiguous = false;
+		for (Stream &stream : objectStreams)
+		{
+			contiguous = offset == stream.lastOffset + stream.lastLength;
+			if (offset > stream.lastOffset && (contiguous || offset - stream.lastOffset == (uint64_t)stream.stride))
+			{
+				s = &stream;
+				break;
+			}
+			if (stream.window == 0 && offset > stream.lastOffset &&
+				(!candidate || stream.lastUsed > candidate->lastUsed))
+				candidate = &stream;
+		}
+		if (!s)
+		{
+			if (!candidate)
+			{
+				if (objectStreams.size() >= STREAMS_PER_OBJECT)
+					objectStreams.erase(std::min_element(objectStreams.begin(), objectStreams.end(),
+														 [](const Stream &a, const Stream &b)
+														 { return a.lastUsed < b.lastUsed; }));
+				objectStreams.push_back(Stream());
+				candidate = &objectStreams.back();
+				candidate->stride = 0;
+			}
+			else
+				candidate->stride = offset - candidate->lastOffset;
+			candidate->window = 0;
+			candidate->lastOffset = offset;
+			candidate->lastLength = length;
+			candidate->lastUsed = now;
+			// The most recently used stream goes last.
+			std::rotate(candidate, candidate + 1, objectStreams.data() + objectStreams.size());
+			return;
+		}
+
+		int64_t stride = offset - s->lastOffset;
+		// Strided streams skip the data between their reads.
+		bool sparse = !contiguous && (uint64_t)stride > length;
+		if (s->window == 0)
+		{
+			s->window = std::min(MIN_WINDOW, maxWindow);
+			s->fetchedUntil = sparse ? offset + stride : offset + length;
+		}
+		s->stride = stride;
+		s->lastOffset = offset;
+		s->lastLength = length;
+		s->lastUsed = now;
+		uint64_t end = offset + length;
+		bool due = end + s->window / 2 >= s->fetchedUntil;
+		if (due && sparse)
+		{
+			size_t count = std::max<size_t>(1, std::min<size_t>(s->window / stride, MAX_STRIDED_READS));
+			uint64_t from = std::max<uint64_t>(s->fetchedUntil, offset + stride);
+			prefetch = Prefetch{file, from, length, (uint64_t)stride, count};
+			s->fetchedUntil = from + count * stride;
+		}
+		else if (due)
+		{
+			uint64_t from = std::max(s->fetchedUntil, end);
+			prefetch = Prefetch{file, from, (size_t)(end + s->window - from), 0, 1};
+			s->fetchedUntil = end + s->window;
+		}
+		if (due)
+			s->window = std::min(s->window * 2, maxWindow);
+		std::rotate(s, s + 1, objectStreams.data() + objectStreams.size());
+		if (!due)
+			return;
+	}
+	// A full queue means the disk is behind already; skip this window.
+	queue.tryPush(std::move(prefetch));
+}
+
+void Readahead::forget(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(streamMutex);
+	streams.erase(name);
+}
+
+// Whether the last byte of the range is in the page cache already, e.g. because
+// the kernel's own readahead got there first.
+static bool cached(int fd, uint64_t offset, size_t length)
+{
+	char byte;
+	struct iovec iov = {&byte, 1};
+	return preadv2(fd, &iov, 1, offset + length - 1, RWF_NOWAIT) == 1;
+}
+
+// POSIX_FADV_WILLNEED starts reading the range into the page cache.
+void Readahead::prefetchLoop()
+{
+	while (true)
+	{
+		Prefetch prefetch = queue.pop();
+		if (!prefetch.file)
+			break;
+		for (size_t i = 0; i < prefetch.count; i++)
+		{
+			uint64_t offset = prefetch.offset + i * prefetch.stride;
+			if (cached(prefetch.file->fd, offset, prefetch.length))
+				continue;
+			posix_fadvise(prefetch.file->fd, offset, prefetch.length, POSIX_FADV_WILLNEED);
+			prefetched += prefetch.length;
+		}
+	}
+}
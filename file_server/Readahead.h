@@ -0,0 +1,88 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "../common/work_queue.h"
+#include "FdCache.h"
+
+// Detects reads that walk through an object at a fixed stride and has the data of
+// the reads to come loaded into the page cache ahead of them, by a thread of its
+// own. Plain sequential reads are the case where each read starts where the last
+// one ended.
+//
+// An object has up to STREAMS_PER_OBJECT streams, so that several clients reading
+// one object through the same descriptor are told apart. The kernel's own
+// readahead, which follows the descriptor, cannot do that. A read that continues
+// a stream, or repeats its stride, starts a window of MIN_WINDOW bytes past it.
+// When a read gets into the second half of what has been fetched, the next window
+// is queued and the window doubles, up to the maximum. So streams that keep using
+// the prefetched data fetch further and further ahead. A stream that is not
+// continued any more is replaced once it is the least recently used. Strided
+// streams fetch only the ranges their next reads will touch, and ranges already in
+// the page cache are not fetched again.
+class Readahead
+{
+public:
+	static constexpr size_t MIN_WINDOW = 128 * 1024;
+
+	// maxWindow is the largest window in bytes; 0 disables readahead.
+	explicit Readahead(size_t maxWindow);
+	~Readahead();
+	Readahead(const Readahead &) = delete;
+	Readahead &operator=(const Readahead &) = delete;
+
+	bool enabled() const { return maxWindow > 0; }
+	size_t maxWindowBytes() const { return maxWindow; }
+	// Records a read of [offset, offset + length) and queues a prefetch if the
+	// stream calls for one.
+	void access(const std::string &name, const std::shared_ptr<OpenFile> &file, uint64_t offset, size_t length);
+	// Forgets the stream of an object, e.g. when it is deleted.
+	void forget(const std::string &name);
+	// Bytes asked for ahead of the reads so far.
+	uint64_t prefetchedBytes() const { return prefetched; }
+
+private:
+	static const size_t MAX_OBJECTS = 4096;
+	static const size_t STREAMS_PER_OBJECT = 4;
+	static const size_t MAX_QUEUED = 256;
+	// Most reads of a strided stream fetched by one prefetch.
+	static constexpr size_t MAX_STRIDED_READS = 64;
+
+	struct Stream
+	{
+		uint64_t lastOffset = 0;
+		size_t lastLength = 0;
+		int64_t stride = 0;	// Distance between the last two reads.
+		size_t window = 0;	// 0 while the stream shows no pattern.
+		uint64_t fetchedUntil = 0; // Where the next prefetch starts.
+		std::chrono::steady_clock::time_point lastUsed;
+	};
+	// count ranges of length bytes, stride bytes apart.
+	struct Prefetch
+	{
+		std::shared_ptr<OpenFile> file; // Null stops the thread.
+		uint64_t offset;
+		size_t length;
+		uint64_t stride;
+		size_t count;
+	};
+
+	size_t maxWindow;
+	std::mutex streamMutex;
+	std::unordered_map<std::string, std::vector<Stream>> streams;
+	BoundedQueue<Prefetch> queue;
+	std::thread thread;
+	std::atomic<uint64_t> prefetched{0};
+
+	void prefetchLoop();
+};
+
+#endif // READAHEAD_H
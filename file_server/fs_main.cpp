@@ -1,22 +1,86 @@
 #include "FileServer.h"
 #include <iostream>
 #include <cstdlib>
+#include <csignal>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+
+static void usage(const char *prog)
+{
+	std::cerr << "Usage: " << prog << " [--buffered-reads] [--fd-cache=N] [--block-cache=MIB] [--readahead=KIB] [--lease=MS] [--max-message=KIB] [--peer-timeout=MS] [port] [storageDir] [threads] [queueCapacity]\n";
+}
 
 int main(int argc, char *argv[])
 {
 	int port = 4001;
 	std::string storageDir = "storage";
-	if (argc > 1)
+	FileServerOptions options;
+	options.numThreads = std::thread::hardware_concurrency();
+	if (options.numThreads <= 0)
+		options.numThreads = 4;
+
+	// Options start with "--"; everything else is positional.
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--buffered-reads")
+			options.zeroCopyReads = false;
+		else if (arg.compare(0, 11, "--fd-cache=") == 0)
+			options.fdCacheSize = std::strtoul(arg.c_str() + 11, nullptr, 10);
+		else if (arg.compare(0, 14, "--block-cache=") == 0)
+			options.blockCacheSize = std::strtoul(arg.c_str() + 14, nullptr, 10) * 1024 * 1024;
+		else if (arg.compare(0, 12, "--readahead=") == 0)
+			options.readaheadWindow = std::strtoul(arg.c_str() + 12, nullptr, 10) * 1024;
+		else if (arg.compare(0, 8, "--lease=") == 0)
+			options.leaseTerm = std::atoi(arg.c_str() + 8);
+		else if (arg.compare(0, 14, "--max-message=") == 0)
+			options.maxMessageSize = std::strtoul(arg.c_str() + 14, nullptr, 10) * 1024;
+		else if (arg.compare(0, 15, "--peer-timeout=") == 0)
+			options.peerTimeout = std::atoi(arg.c_str() + 15);
+		else if (arg.compare(0, 2, "--") == 0)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		else
+			args.push_back(arg);
+	}
+	if (args.size() > 0)
+	{
+		port = std::atoi(args[0].c_str());
+	}
+	if (args.size() > 1)
+	{
+		storageDir = args[1];
+	}
+	if (args.size() > 2)
+	{
+		options.numThreads = std::atoi(args[2].c_str());
+	}
+	if (args.size() > 3)
+	{
+		options.queueCapacity = std::atoi(args[3].c_str());
+	}
+	// Clients send and ask for up to TRANSFER_CHUNK bytes per message.
+	if (options.numThreads <= 0 || options.queueCapacity == 0 || options.maxMessageSize < 2 * TRANSFER_CHUNK)
 	{
-		port = std::atoi(argv[1]);
+		usage(argv[0]);
+		return 1;
 	}
-	if (argc > 2)
+	// Leave at least half of the descriptor limit for sockets.
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && options.fdCacheSize > rl.rlim_cur / 2)
 	{
-		storageDir = argv[2];
+		options.fdCacheSize = rl.rlim_cur / 2;
+		std::cerr << "Descriptor cache limited to " << options.fdCacheSize << " by RLIMIT_NOFILE\n";
 	}
+	// Writes to a client that hung up must not kill the server.
+	signal(SIGPIPE, SIG_IGN);
 	// Create a subdirectory for this file server instance.
 	storageDir += "/server" + std::to_string(port);
-	FileServer fs(storageDir);
+	FileServer fs(storageDir, options);
 	fs.run(port);
 	return 0;
 }
@@ -0,0 +1,188 @@
+#include "MetadataJournal.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+MetadataJournal::MetadataJournal(const std::string &filename, const JournalOptions &options)
+	: filename(filename), rotatedFilename(filename + ".old"), options(options)
+{
+}
+
+MetadataJournal::~MetadataJournal()
+{
+	{
+		std::lock_guard<std::mutex> lock(journalMutex);
+		stopping = true;
+	}
+	syncNeeded.notify_one();
+	if (syncThread.joinable())
+		syncThread.join();
+	if (fd >= 0)
+	{
+		fdatasync(fd);
+		close(fd);
+	}
+}
+
+bool MetadataJournal::open()
+{
+	fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		std::cerr << "Cannot open metadata journal " << filename << ": " << strerror(errno) << "\n";
+		return false;
+	}
+	if (options.syncIntervalMs > 0)
+		syncThread = std::thread(&MetadataJournal::syncLoop, this);
+	return true;
+}
+
+// A record that is only partly written is cut off again, so it cannot run into
+// the next one.
+bool MetadataJournal::append(const std::string &record, uint64_t *sequence)
+{
+	std::string line = record + "\n";
+	std::unique_lock<std::mutex> lock(journalMutex);
+	off_t start = lseek(fd, 0, SEEK_END);
+	size_t written = 0;
+	while (written < line.size())
+	{
+		ssize_t n = write(fd, line.data() + written, line.size() - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		written += n;
+	}
+	if (written < line.size() || (options.syncIntervalMs == 0 && fdatasync(fd) != 0))
+	{
+		std::cerr << "Metadata journal write failed: " << strerror(errno) << "\n";
+		if (written > 0 && (start < 0 || ftruncate(fd, start) != 0))
+			std::cerr << "Metadata journal may hold a torn record\n";
+		return false;
+	}
+	records++;
+	appended++;
+	if (sequence)
+		*sequence = appended;
+	if (options.syncIntervalMs == 0)
+	{
+		synced = appended;
+		return true;
+	}
+	if (++unsynced >= options.maxUnsyncedRecords)
+		syncNeeded.notify_one();
+	return true;
+}
+
+void MetadataJournal::setSyncListener(std::function<void()> listener)
+{
+	std::lock_guard<std::mutex> lock(journalMutex);
+	syncListener = std::move(listener);
+}
+
+size_t MetadataJournal::recordCount()
+{
+	std::lock_guard<std::mutex> lock(journalMutex);
+	return records;
+}
+
+// Group commit: one fdatasync covers every record appended since the last one.
+void MetadataJournal::syncLoop()
+{
+	std::unique_lock<std::mutex> lock(journalMutex);
+	while (!stopping)
+	{
+		syncNeeded.wait_for(lock, std::chrono::milliseconds(options.syncIntervalMs), [this]
+							{ return stopping || unsynced >= options.maxUnsyncedRecords; });
+		if (unsynced == 0)
+			continue;
+		unsynced = 0;
+		uint64_t target = appended;
+		// Appends may continue while the disk flush is in progress. rotate() may close
+		// fd meanwhile, so the flush goes through a duplicate that stays ours.
+		int syncFd = dup(fd);
+		bool ok;
+		if (syncFd < 0)
+			ok = fdatasync(fd) == 0;
+		else
+		{
+			lock.unlock();
+			ok = fdatasync(syncFd) == 0;
+			close(syncFd);
+			lock.lock();
+		}
+		if (!ok)
+			std::cerr << "Metadata journal sync failed: " << strerror(errno) << "\n";
+		// rotate() may have synced further meanwhile.
+		if (synced < target)
+			synced = target;
+		if (syncListener)
+			syncListener();
+	}
+}
+
+void MetadataJournal::rotate()
+{
+	std::lock_guard<std::mutex> lock(journalMutex);
+	fdatasync(fd);
+	std::ifstream leftover(rotatedFilename);
+	if (leftover.good())
+	{
+		// An earlier checkpoint did not finish; keep its records in front of ours.
+		leftover.close();
+		std::ifstream current(filename, std::ios::binary);
+		std::ofstream old(rotatedFilename, std::ios::binary | std::ios::app);
+		old << current.rdbuf();
+		old.close();
+		if (ftruncate(fd, 0) != 0)
+			std::cerr << "Metadata journal truncate failed: " << strerror(errno) << "\n";
+	}
+	else
+	{
+		std::rename(filename.c_str(), rotatedFilename.c_str());
+		close(fd);
+		fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	}
+	records = 0;
+	unsynced = 0;
+	synced = appended;
+	if (syncListener)
+		syncListener();
+}
+
+void MetadataJournal::discardRotated()
+{
+	std::remove(rotatedFilename.c_str());
+}
+
+size_t MetadataJournal::replay(const std::function<void(const std::string &)> &apply)
+{
+	size_t count = 0;
+	for (const std::string &name : {rotatedFilename, filename})
+	{
+		std::ifstream in(name, std::ios::binary);
+		std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		size_t start = 0;
+		size_t end;
+		// Only newline-terminated records count: a crash mid-append can leave a torn last line.
+		while ((end = contents.find('\n', start)) != std::string::npos)
+		{
+			if (end > start)
+			{
+				apply(contents.substr(start, end - start));
+				count++;
+			}
+			start = end + 1;
+		}
+	}
+	std::lock_guard<std::mutex> lock(journalMutex);
+	records = count;
+	return count;
+}
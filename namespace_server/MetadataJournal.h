@@ -0,0 +1,83 @@
+#ifndef METADATA_JOURNAL_H
+#define METADATA_JOURNAL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Group commit and checkpoint settings for the metadata journal.
+struct JournalOptions
+{
+	// fsync the journal at most this often; 0 syncs after every record.
+	int syncIntervalMs = 10;
+	// Sync early once this many records are waiting, even inside the interval.
+	size_t maxUnsyncedRecords = 256;
+	// Fold the journal into a new snapshot once it holds this many records...
+	size_t checkpointRecords = 100000;
+	// ...or at least this often if it holds any.
+	int checkpointIntervalSec = 300;
+};
+
+// Append-only write-ahead log of namespace mutations.
+// Each record is one text line (see NamespaceServer::applyRecord for the format).
+// append() hands the record to the kernel immediately, so a crashed server loses
+// nothing. A background thread batches the fsyncs that make records survive a
+// machine crash; callers that must not answer before then wait for the record's
+// sequence number to be synced. Records are idempotent state changes, so replaying a prefix that
+// a snapshot already contains is harmless.
+class MetadataJournal
+{
+public:
+	MetadataJournal(const std::string &filename, const JournalOptions &options);
+	~MetadataJournal();
+
+	// Opens the journal for appending and starts the group commit thread.
+	bool open();
+	// Appends one record. Safe from several threads; the caller holds the lock of the
+	// shard the record changes, so records for the same path stay in order. Returns
+	// false if the record could not be written; nothing of it is left in the journal.
+	// sequence, if given, is set to the record's sequence number.
+	bool append(const std::string &record, uint64_t *sequence = nullptr);
+	// Every record up to this sequence number is on disk.
+	uint64_t syncedSequence() const { return synced; }
+	// Called after each group commit, with no other journal call in progress.
+	void setSyncListener(std::function<void()> listener);
+	// Number of records appended since the last rotation.
+	size_t recordCount();
+
+	// Starts a new journal for records made after a checkpoint's state copy.
+	// The previous records move to the ".old" file until the snapshot is safely
+	// written and discardRotated() is called.
+	void rotate();
+	void discardRotated();
+
+	// Calls apply for every record in the rotated and current journal, oldest first.
+	// Returns the number of records replayed.
+	size_t replay(const std::function<void(const std::string &)> &apply);
+
+	const JournalOptions &settings() const { return options; }
+
+private:
+	std::string filename;
+	std::string rotatedFilename;
+	JournalOptions options;
+	int fd = -1;
+
+	std::mutex journalMutex;
+	std::condition_variable syncNeeded;
+	size_t records = 0;
+	size_t unsynced = 0;
+	// Sequence numbers count every record appended since the server started.
+	uint64_t appended = 0;
+	std::atomic<uint64_t> synced{0};
+	std::function<void()> syncListener;
+	bool stopping = false;
+	std::thread syncThread;
+
+	void syncLoop();
+};
+
+#endif // METADATA_JOURNAL_H
@@ -0,0 +1,245 @@
+#include "MetadataSnapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char SNAPSHOT_MAGIC[8] = {'N', 'S', 'S', 'N', 'A', 'P', '0', '1'};
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+MetadataSnapshot::~MetadataSnapshot()
+{
+	if (mapping)
+		munmap(mapping, mappingSize);
+}
+
+bool MetadataSnapshot::open(const std::string &filename)
+{
+	int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+	{
+		close(fd);
+		return false;
+	}
+	mappingSize = st.st_size;
+	mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		mapping = nullptr;
+		return false;
+	}
+	// Entries are scanned once front to back while loading.
+	madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+
+	const char *base = static_cast<const char *>(mapping);
+	header = reinterpret_cast<const SnapshotHeader *>(base);
+	uint64_t tables = sizeof(SnapshotHeader) + (uint64_t)header->serverCount * sizeof(SnapshotString);
+	uint64_t entryBytes = header->entryCount * sizeof(SnapshotEntry);
+	bool valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+				 header->version == SNAPSHOT_VERSION &&
+				 header->entryCount <= mappingSize / sizeof(SnapshotEntry) &&
+				 tables + entryBytes + header->arenaSize == mappingSize;
+	if (valid)
+	{
+		servers = reinterpret_cast<const SnapshotString *>(base + sizeof(SnapshotHeader));
+		entries = reinterpret_cast<const SnapshotEntry *>(base + tables);
+		arena = base + tables + entryBytes;
+		for (uint32_t i = 0; valid && i < header->serverCount; i++)
+			valid = servers[i].offset + servers[i].length <= header->arenaSize;
+		for (uint64_t i = 0; valid && i < header->entryCount; i++)
+		{
+			uint64_t end = entries[i].pathOffset + entries[i].pathLength;
+			if (entries[i].flags & SNAPSHOT_HAS_OBJECT_ID)
+				end += SNAPSHOT_OBJECT_ID_SIZE;
+			valid = end <= header->arenaSize &&
+					(entries[i].serverIndex == SNAPSHOT_NO_SERVER || entries[i].serverIndex < header->serverCount);
+			if (valid && (entries[i].flags & SNAPSHOT_LAYOUT))
+			{
+				uint16_t count = 0;
+				valid = (entries[i].flags & SNAPSHOT_HAS_OBJECT_ID) && end + 6 <= header->arenaSize;
+				if (valid)
+				{
+					memcpy(&count, arena + end + 4, sizeof(count));
+					valid = end + 6 + 2 * (uint64_t)count <= header->arenaSize;
+				}
+				for (uint16_t s = 0; valid && s < count; s++)
+				{
+					uint16_t server;
+					memcpy(&server, arena + end + 6 + 2 * s, sizeof(server));
+					valid = server < header->serverCount;
+				}
+			}
+		}
+	}
+	if (!valid)
+	{
+		munmap(mapping, mappingSize);
+		mapping = nullptr;
+		header = nullptr;
+		return false;
+	}
+	return true;
+}
+
+std::string_view MetadataSnapshot::path(size_t i) const
+{
+	return std::string_view(arena + entries[i].pathOffset, entries[i].pathLength);
+}
+
+std::string_view MetadataSnapshot::server(size_t i) const
+{
+	uint16_t s = entries[i].serverIndex;
+	if (s == SNAPSHOT_NO_SERVER)
+		return std::string_view();
+	return std::string_view(arena + servers[s].offset, servers[s].length);
+}
+
+const uint8_t *MetadataSnapshot::objectId(size_t i) const
+{
+	if (!(entries[i].flags & SNAPSHOT_HAS_OBJECT_ID))
+		return nullptr;
+	return reinterpret_cast<const uint8_t *>(arena + entries[i].pathOffset + entries[i].pathLength);
+}
+
+uint32_t MetadataSnapshot::layout(size_t i, std::vector<std::string_view> &layoutServers) const
+{
+	layoutServers.clear();
+	if (!(entries[i].flags & SNAPSHOT_LAYOUT))
+		return 0;
+	const char *p = arena + entries[i].pathOffset + entries[i].pathLength + SNAPSHOT_OBJECT_ID_SIZE;
+	uint32_t unit;
+	uint16_t count;
+	memcpy(&unit, p, sizeof(unit));
+	memcpy(&count, p + 4, sizeof(count));
+	for (uint16_t s = 0; s < count; s++)
+	{
+		uint16_t server;
+		memcpy(&server, p + 6 + 2 * s, sizeof(server));
+		layoutServers.push_back(std::string_view(arena + servers[server].offset, servers[server].length));
+	}
+	return unit;
+}
+
+size_t MetadataSnapshot::find(std::string_view target) const
+{
+	size_t lo = 0, hi = size();
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (path(mid) < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < size() && path(lo) == target) ? lo : size();
+}
+
+static bool writeAll(int fd, const void *data, size_t size)
+{
+	const char *p = static_cast<const char *>(data);
+	while (size > 0)
+	{
+		ssize_t n = ::write(fd, p, size);
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool MetadataSnapshot::write(const std::string &filename, std::vector<SnapshotRecord> records)
+{
+	std::sort(records.begin(), records.end(), [](const SnapshotRecord &a, const SnapshotRecord &b)
+			  { return a.path != b.path ? a.path < b.path : a.kind < b.kind; });
+
+	std::string arenaData;
+	std::vector<SnapshotString> serverTable;
+	std::map<std::string, uint16_t> serverIndex;
+	std::vector<SnapshotEntry> entryTable;
+	entryTable.reserve(records.size());
+	// Server ids go into the arena on first use, so each record interns its servers
+	// before its own bytes are appended and its path, object id and layout stay
+	// contiguous.
+	auto intern = [&](const std::string &serverId, uint16_t &index) -> bool
+	{
+		auto it = serverIndex.find(serverId);
+		if (it == serverIndex.end())
+		{
+			if (serverTable.size() >= SNAPSHOT_NO_SERVER)
+				return false;
+			SnapshotString str;
+			memset(&str, 0, sizeof(str));
+			str.offset = arenaData.size();
+			str.length = serverId.size();
+			arenaData += serverId;
+			it = serverIndex.emplace(serverId, serverTable.size()).first;
+			serverTable.push_back(str);
+		}
+		index = it->second;
+		return true;
+	};
+	std::vector<uint16_t> layoutIndices;
+	for (const auto &r : records)
+	{
+		SnapshotEntry e;
+		memset(&e, 0, sizeof(e));
+		e.kind = r.kind;
+		e.serverIndex = SNAPSHOT_NO_SERVER;
+		if (!r.serverId.empty() && !intern(r.serverId, e.serverIndex))
+			return false;
+		layoutIndices.resize(r.layoutServers.size());
+		for (size_t s = 0; s < r.layoutServers.size(); s++)
+		{
+			if (!intern(r.layoutServers[s], layoutIndices[s]))
+				return false;
+		}
+		e.pathOffset = arenaData.size();
+		e.pathLength = r.path.size();
+		arenaData += r.path;
+		if (r.hasObjectId)
+		{
+			e.flags |= SNAPSHOT_HAS_OBJECT_ID;
+			arenaData.append(reinterpret_cast<const char *>(r.objectId.data()), r.objectId.size());
+			if (!r.layoutServers.empty())
+			{
+				uint16_t count = layoutIndices.size();
+				e.flags |= SNAPSHOT_LAYOUT;
+				arenaData.append(reinterpret_cast<const char *>(&r.layoutUnit), sizeof(r.layoutUnit));
+				arenaData.append(reinterpret_cast<const char *>(&count), sizeof(count));
+				arenaData.append(reinterpret_cast<const char *>(layoutIndices.data()), count * sizeof(uint16_t));
+			}
+		}
+		entryTable.push_back(e);
+	}
+
+	SnapshotHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	h.version = SNAPSHOT_VERSION;
+	h.serverCount = serverTable.size();
+	h.entryCount = entryTable.size();
+	h.arenaSize = arenaData.size();
+
+	// Write to a temporary file and rename it over the old snapshot, so a crash
+	// leaves either the old or the new snapshot in place.
+	std::string tmp = filename + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+	bool ok = writeAll(fd, &h, sizeof(h)) &&
+			  writeAll(fd, serverTable.data(), serverTable.size() * sizeof(SnapshotString)) &&
+			  writeAll(fd, entryTable.data(), entryTable.size() * sizeof(SnapshotEntry)) &&
+			  writeAll(fd, arenaData.data(), arenaData.size()) &&
+			  fsync(fd) == 0;
+	close(fd);
+	return ok && rename(tmp.c_str(), filename.c_str()) == 0;
+}
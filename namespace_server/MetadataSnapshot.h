@@ -0,0 +1,113 @@
+#ifndef METADATA_SNAPSHOT_H
+#define METADATA_SNAPSHOT_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Binary snapshot of the namespace metadata, designed to be memory-mapped.
+// Layout (host byte order; the magic and version reject foreign files):
+//   SnapshotHeader
+//   serverCount x SnapshotString   table of file server ids
+//   entryCount  x SnapshotEntry    sorted by path, then kind
+//   arenaSize bytes                all path and server id characters; a file's
+//                                  32-byte object id follows its path, and a
+//                                  striped or replicated file's layout
+//                                  follows that
+// Loading needs no parsing: every field is read straight out of the mapping.
+
+enum SnapshotKind : uint8_t
+{
+	SNAPSHOT_DIRECTORY = 1, // serverIndex: the directory's file server mapping, if any
+	SNAPSHOT_FILE = 2,		// serverIndex: the server that stores the file
+	SNAPSHOT_MAPPING = 3	// a directory mapping with no matching directory entry
+};
+
+const uint16_t SNAPSHOT_NO_SERVER = 0xffff;
+const size_t SNAPSHOT_OBJECT_ID_SIZE = 32;
+
+// SnapshotEntry flags.
+const uint8_t SNAPSHOT_HAS_OBJECT_ID = 1;
+// The object id is followed by the stripe unit (uint32_t, 0 for replicas), the
+// number of layout servers (uint16_t) and that many uint16_t indices into the
+// server table.
+const uint8_t SNAPSHOT_LAYOUT = 2;
+
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t serverCount;
+	uint64_t entryCount;
+	uint64_t arenaSize;
+};
+
+struct SnapshotString
+{
+	uint64_t offset;
+	uint32_t length;
+	uint32_t reserved;
+};
+
+struct SnapshotEntry
+{
+	uint64_t pathOffset;
+	uint32_t pathLength;
+	uint16_t serverIndex;
+	uint8_t kind;
+	uint8_t flags;
+};
+
+// One namespace entry to be written to a snapshot.
+struct SnapshotRecord
+{
+	std::string path;
+	uint8_t kind;
+	std::string serverId; // Empty for none.
+	bool hasObjectId = false;
+	std::array<uint8_t, SNAPSHOT_OBJECT_ID_SIZE> objectId;
+	// Set for striped and replicated files, which always have an object id.
+	uint32_t layoutUnit = 0;
+	std::vector<std::string> layoutServers;
+};
+
+// A read-only, memory-mapped snapshot.
+class MetadataSnapshot
+{
+public:
+	MetadataSnapshot() = default;
+	~MetadataSnapshot();
+	MetadataSnapshot(const MetadataSnapshot &) = delete;
+	MetadataSnapshot &operator=(const MetadataSnapshot &) = delete;
+
+	// Maps the file and validates its structure. Returns false if it is missing or invalid.
+	bool open(const std::string &filename);
+
+	size_t size() const { return header ? header->entryCount : 0; }
+	std::string_view path(size_t i) const;
+	uint8_t kind(size_t i) const { return entries[i].kind; }
+	// Server id for entry i, or an empty view if it has none.
+	std::string_view server(size_t i) const;
+	// The stored object id of file entry i, or nullptr if it has none.
+	const uint8_t *objectId(size_t i) const;
+	// Stripe unit of file entry i (0 if it is not striped) and its layout servers,
+	// which are empty for a file on a single server.
+	uint32_t layout(size_t i, std::vector<std::string_view> &layoutServers) const;
+	// Index of the first entry with the given path (binary search), or size() if absent.
+	size_t find(std::string_view path) const;
+
+	// Writes records as a snapshot, atomically replacing filename.
+	static bool write(const std::string &filename, std::vector<SnapshotRecord> records);
+
+private:
+	void *mapping = nullptr;
+	size_t mappingSize = 0;
+	const SnapshotHeader *header = nullptr;
+	const SnapshotString *servers = nullptr;
+	const SnapshotEntry *entries = nullptr;
+	const char *arena = nullptr;
+};
+
+#endif // METADATA_SNAPSHOT_H
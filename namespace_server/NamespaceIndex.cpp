@@ -0,0 +1,509 @@
+#include "NamespaceIndex.h"
+#include <algorithm>
+
+std::string getParentDirectory(const std::string &path)
+{
+	if (path == "/")
+		return "/";
+	size_t pos = path.rfind('/');
+	if (pos == 0)
+		return "/";
+	else if (pos != std::string::npos)
+		return path.substr(0, pos);
+	return "";
+}
+
+std::string getBaseName(const std::string &path)
+{
+	size_t pos = path.find_last_of('/');
+	if (pos == std::string::npos)
+		return path;
+	return path.substr(pos + 1);
+}
+
+void IdTable::insert(uint32_t id, size_t hash, const std::function<size_t(uint32_t)> &hashOf)
+{
+	// Grow at 70% load to keep probe sequences short.
+	if ((count + 1) * 10 > slots.size() * 7)
+	{
+		std::vector<uint32_t> old;
+		old.swap(slots);
+		slots.assign(std::max<size_t>(16, old.size() * 2), NO_ID);
+		for (uint32_t existing : old)
+		{
+			if (existing != NO_ID)
+				place(existing, hashOf(existing));
+		}
+	}
+	place(id, hash);
+	count++;
+}
+
+void IdTable::erase(uint32_t id, size_t hash, const std::function<size_t(uint32_t)> &hashOf)
+{
+	if (slots.empty())
+		return;
+	size_t mask = slots.size() - 1;
+	size_t i = hash & mask;
+	while (slots[i] != id)
+	{
+		if (slots[i] == NO_ID)
+			return;
+		i = (i + 1) & mask;
+	}
+	// Shift later entries of the probe sequence back instead of leaving a tombstone.
+	for (size_t j = (i + 1) & mask; slots[j] != NO_ID; j = (j + 1) & mask)
+	{
+		size_t home = hashOf(slots[j]) & mask;
+		bool between = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+		if (!between)
+		{
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	slots[i] = NO_ID;
+	count--;
+}
+
+void IdTable::clear()
+{
+	slots.clear();
+	count = 0;
+}
+
+void IdTable::place(uint32_t id, size_t hash)
+{
+	size_t mask = slots.size() - 1;
+	size_t i = hash & mask;
+	while (slots[i] != NO_ID)
+		i = (i + 1) & mask;
+	slots[i] = id;
+}
+
+NamespaceIndex::NamespaceIndex()
+{
+	clear();
+}
+
+uint16_t NamespaceIndex::serverIndex(const std::string &serverId)
+{
+	for (size_t i = 0; i < servers.size(); i++)
+	{
+		if (servers[i] == serverId)
+			return (uint16_t)i;
+	}
+	servers.push_back(serverId);
+	return (uint16_t)(servers.size() - 1);
+}
+
+uint32_t NamespaceIndex::findName(std::string_view component) const
+{
+	return nameTable.find(std::hash<std::string_view>{}(component), [&](uint32_t id)
+						  { return nameOf(id) == component; });
+}
+
+uint32_t NamespaceIndex::internName(std::string_view component)
+{
+	size_t hash = std::hash<std::string_view>{}(component);
+	uint32_t id = nameTable.find(hash, [&](uint32_t n)
+								 { return nameOf(n) == component; });
+	if (id != NO_ID)
+		return id;
+	Name name{(uint32_t)nameArena.size(), (uint32_t)component.size(), 0};
+	if (!freeNames.empty())
+	{
+		id = freeNames.back();
+		freeNames.pop_back();
+		names[id] = name;
+	}
+	else
+	{
+		id = (uint32_t)names.size();
+		names.push_back(name);
+	}
+	nameArena.append(component);
+	nameTable.insert(id, hash, [this](uint32_t n)
+					 { return std::hash<std::string_view>{}(nameOf(n)); });
+	return id;
+}
+
+void NamespaceIndex::releaseName(uint32_t id)
+{
+	Name &name = names[id];
+	if (--name.refs > 0)
+		return;
+	nameTable.erase(id, std::hash<std::string_view>{}(nameOf(id)), [this](uint32_t n)
+					{ return std::hash<std::string_view>{}(nameOf(n)); });
+	deadNameBytes += name.length;
+	name.offset = NO_ID;
+	name.length = 0;
+	freeNames.push_back(id);
+	// Compacting costs the live names, so it waits until they are at most half.
+	if (deadNameBytes > 4096 && deadNameBytes * 2 > nameArena.size())
+		compactNames();
+}
+
+void NamespaceIndex::compactNames()
+{
+	std::string arena;
+	arena.reserve(nameArena.size() - deadNameBytes);
+	for (Name &name : names)
+	{
+		if (name.offset == NO_ID)
+			continue;
+		uint32_t offset = (uint32_t)arena.size();
+		arena.append(nameArena, name.offset, name.length);
+		name.offset = offset;
+	}
+	nameArena.swap(arena);
+	deadNameBytes = 0;
+}
+
+size_t NamespaceIndex::childHash(uint32_t parent, uint32_t name) const
+{
+	// splitmix64 finalizer: spreads the key over the low bits used for the slot.
+	uint64_t x = ((uint64_t)parent << 32) | name;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return (size_t)(x ^ (x >> 31));
+}
+
+uint32_t NamespaceIndex::findChild(uint32_t parent, uint32_t name) const
+{
+	return children.find(childHash(parent, name), [&](uint32_t id)
+						 { return nodes[id].parent == parent && nodes[id].name == name; });
+}
+
+uint32_t NamespaceIndex::addChild(uint32_t parent, uint32_t name)
+{
+	uint32_t id;
+	if (freeNodes != NO_ID)
+	{
+		id = freeNodes;
+		freeNodes = nodes[id].nextSibling;
+		nodes[id] = Node();
+	}
+	else
+	{
+		id = (uint32_t)nodes.size();
+		nodes.emplace_back();
+	}
+	Node &node = nodes[id];
+	node.name = name;
+	node.parent = parent;
+	names[name].refs++;
+	node.nextSibling = nodes[parent].firstChild;
+	if (node.nextSibling != NO_ID)
+		nodes[node.nextSibling].prevSibling = id;
+	nodes[parent].firstChild = id;
+	children.insert(id, childHash(parent, name), [this](uint32_t n)
+					{ return childHash(nodes[n].parent, nodes[n].name); });
+	return id;
+}
+
+uint32_t NamespaceIndex::resolve(const std::string &path) const
+{
+	if (path.empty() || path[0] != '/')
+		return NO_ID;
+	uint32_t id = 0;
+	size_t pos = 1;
+	while (pos < path.size() && id != NO_ID)
+	{
+		size_t end = path.find('/', pos);
+		if (end == std::string::npos)
+			end = path.size();
+		if (end > pos)
+		{
+			uint32_t name = findName(std::string_view(path).substr(pos, end - pos));
+			id = (name == NO_ID) ? NO_ID : findChild(id, name);
+		}
+		pos = end + 1;
+	}
+	return id;
+}
+
+uint32_t NamespaceIndex::resolveOrCreate(const std::string &path)
+{
+	if (path.empty() || path[0] != '/')
+		return NO_ID;
+	uint32_t id = 0;
+	size_t pos = 1;
+	while (pos < path.size())
+	{
+		size_t end = path.find('/', pos);
+		if (end == std::string::npos)
+			end = path.size();
+		if (end > pos)
+		{
+			uint32_t name = internName(std::string_view(path).substr(pos, end - pos));
+			uint32_t child = findChild(id, name);
+			id = (child == NO_ID) ? addChild(id, name) : child;
+		}
+		pos = end + 1;
+	}
+	return id;
+}
+
+void NamespaceIndex::prune(uint32_t id)
+{
+	while (id != 0)
+	{
+		Node &node = nodes[id];
+		if ((node.flags & NODE_DIRECTORY) || node.fileServer != NO_SERVER || node.dirServer != NO_SERVER ||
+			node.firstChild != NO_ID)
+			return;
+		uint32_t parent = node.parent;
+		if (node.prevSibling != NO_ID)
+			nodes[node.prevSibling].nextSibling = node.nextSibling;
+		else
+			nodes[parent].firstChild = node.nextSibling;
+		if (node.nextSibling != NO_ID)
+			nodes[node.nextSibling].prevSibling = node.prevSibling;
+		children.erase(id, childHash(parent, node.name), [this](uint32_t n)
+					   { return childHash(nodes[n].parent, nodes[n].name); });
+		releaseName(node.name);
+		node.flags = NODE_FREE;
+		node.nextSibling = freeNodes;
+		freeNodes = id;
+		id = parent;
+	}
+}
+
+bool NamespaceIndex::hasDirectory(const std::string &path) const
+{
+	uint32_t id = resolve(path);
+	return id != NO_ID && (nodes[id].flags & NODE_DIRECTORY);
+}
+
+bool NamespaceIndex::addDirectory(const std::string &path)
+{
+	uint32_t id = resolveOrCreate(path);
+	if (id == NO_ID || (nodes[id].flags & NODE_DIRECTORY))
+		return false;
+	nodes[id].flags |= NODE_DIRECTORY;
+	dirCount++;
+	return true;
+}
+
+bool NamespaceIndex::removeDirectory(const std::string &path)
+{
+	uint32_t id = resolve(path);
+	if (id == NO_ID || !(nodes[id].flags & NODE_DIRECTORY))
+		return false;
+	nodes[id].flags &= ~NODE_DIRECTORY;
+	dirCount--;
+	prune(id);
+	return true;
+}
+
+bool NamespaceIndex::directoryServer(const std::string &path, std::string &serverId) const
+{
+	uint32_t id = resolve(path);
+	if (id == NO_ID || nodes[id].dirServer == NO_SERVER)
+		return false;
+	serverId = servers[nodes[id].dirServer];
+	return true;
+}
+
+void NamespaceIndex::mapDirectory(const std::string &path, const std::string &serverId)
+{
+	uint16_t server = serverIndex(serverId);
+	uint32_t id = resolveOrCreate(path);
+	if (id != NO_ID)
+		nodes[id].dirServer = server;
+}
+
+void NamespaceIndex::unmapDirectory(const std::string &path)
+{
+	uint32_t id = resolve(path);
+	if (id == NO_ID)
+		return;
+	nodes[id].dirServer = NO_SERVER;
+	prune(id);
+}
+
+bool NamespaceIndex::fileServer(const std::string &path, std::string &serverId) const
+{
+	uint32_t id = resolve(path);
+	if (id == NO_ID || nodes[id].fileServer == NO_SERVER)
+		return false;
+	serverId = servers[nodes[id].fileServer];
+	return true;
+}
+
+bool NamespaceIndex::fileServer(const std::string &path, std::string &serverId, ObjectId &objectId) const
+{
+	uint32_t id = resolve(path);
+	if (id == NO_ID || nodes[id].fileServer == NO_SERVER)
+		return false;
+	serverId = servers[nodes[id].fileServer];
+	objectId = objects[nodes[id].object];
+	return true;
+}
+
+bool NamespaceIndex::fileServer(const std::string &path, std::string &serverId, ObjectId &objectId,
+							FileLayout &layout) const
+{
+	uint32_t id = resolve(path);
+	if (id == NO_ID || nodes[id].fileServer == NO_SERVER)
+		return false;
+	serverId = servers[nodes[id].fileServer];
+	objectId = objects[nodes[id].object];
+	layout = layoutOf(nodes[id]);
+	return true;
+}
+
+FileLayout NamespaceIndex::layoutOf(const Node &node) const
+{
+	FileLayout layout;
+	if (!(node.flags & NODE_LAYOUT))
+		return layout;
+	const Layout &entry = layouts.at(node.object);
+	layout.unit = entry.unit;
+	for (uint16_t server : entry.servers)
+		layout.servers.push_back(servers[server]);
+	return layout;
+}
+
+void NamespaceIndex::addFile(const std::string &path, const std::string &serverId, const ObjectId &objectId,
+							 const FileLayout &layout)
+{
+	uint16_t server = serverIndex(serverId);
+	uint32_t id = resolveOrCreate(path);
+	if (id == NO_ID)
+		return;
+	Node &node = nodes[id];
+	if (node.fileServer == NO_SERVER)
+	{
+		filesCount++;
+		if (!freeObjects.empty())
+		{
+			node.object = freeObjects.back();
+			freeObjects.pop_back();
+		}
+		else
+		{
+			node.object = (uint32_t)objects.size();
+			objects.emplace_back();
+		}
+	}
+	node.fileServer = server;
+	objects[node.object] = objectId;
+	if (!layout.servers.empty())
+	{
+		Layout entry{layout.unit, {}};
+		for (const auto &layoutServer : layout.servers)
+			entry.servers.push_back(serverIndex(layoutServer));
+		layouts[node.object] = std::move(entry);
+		node.flags |= NODE_LAYOUT;
+	}
+	else if (node.flags & NODE_LAYOUT)
+	{
+		layouts.erase(node.object);
+		node.flags &= ~NODE_LAYOUT;
+	}
+}
+
+bool NamespaceIndex::removeFile(const std::string &path)
+{
+	uint32_t id = resolve(path);
+	if (id == NO_ID || nodes[id].fileServer == NO_SERVER)
+		return false;
+	nodes[id].fileServer = NO_SERVER;
+	if (nodes[id].flags & NODE_LAYOUT)
+	{
+		layouts.erase(nodes[id].object);
+		nodes[id].flags &= ~NODE_LAYOUT;
+	}
+	freeObjects.push_back(nodes[id].object);
+	nodes[id].object = NO_ID;
+	filesCount--;
+	prune(id);
+	return true;
+}
+
+bool NamespaceIndex::listChildren(const std::string &path, std::vector<std::string> &subdirs,
+								  std::vector<std::string> &fileNames) const
+{
+	if (!hasDirectory(path))
+		return false;
+	childNames(path, subdirs, fileNames);
+	return true;
+}
+
+void NamespaceIndex::childNames(const std::string &path, std::vector<std::string> &subdirs,
+								std::vector<std::string> &fileNames) const
+{
+	subdirs.clear();
+	fileNames.clear();
+	uint32_t id = resolve(path);
+	if (id == NO_ID)
+		return;
+	for (uint32_t child = nodes[id].firstChild; child != NO_ID; child = nodes[child].nextSibling)
+	{
+		const Node &node = nodes[child];
+		if (node.flags & NODE_DIRECTORY)
+			subdirs.emplace_back(nameOf(node.name));
+		if (node.fileServer != NO_SERVER)
+			fileNames.emplace_back(nameOf(node.name));
+	}
+	std::sort(subdirs.begin(), subdirs.end());
+	std::sort(fileNames.begin(), fileNames.end());
+}
+
+IndexMemoryUsage NamespaceIndex::memoryUsage() const
+{
+	IndexMemoryUsage usage;
+	usage.entries = dirCount + filesCount;
+	usage.nodeBytes = nodes.capacity() * sizeof(Node);
+	usage.nameBytes = nameArena.capacity() + names.capacity() * sizeof(Name) + nameTable.bytes();
+	usage.tableBytes = children.bytes();
+	usage.objectBytes = objects.capacity() * sizeof(ObjectId) + freeObjects.capacity() * sizeof(uint32_t);
+	for (const auto &entry : layouts)
+		usage.objectBytes += sizeof(entry) + entry.second.servers.capacity() * sizeof(uint16_t);
+	usage.uniqueNames = names.size() - freeNames.size();
+	return usage;
+}
+
+void NamespaceIndex::clear()
+{
+	nodes.clear();
+	freeNodes = NO_ID;
+	children.clear();
+	nameArena.clear();
+	names.clear();
+	nameTable.clear();
+	freeNames.clear();
+	deadNameBytes = 0;
+	objects.clear();
+	freeObjects.clear();
+	layouts.clear();
+	dirCount = 0;
+	filesCount = 0;
+	nodes.emplace_back();
+	nodes[0].name = internName("");
+	names[nodes[0].name].refs++;
+	nodes[0].parent = NO_ID;
+}
+
+void NamespaceIndex::walk(const std::function<void(const Node &, const std::string &)> &fn) const
+{
+	std::string path = "/";
+	fn(nodes[0], path);
+	// Each stack entry is a node and the length of its parent's path.
+	std::vector<std::pair<uint32_t, size_t>> stack;
+	for (uint32_t child = nodes[0].firstChild; child != NO_ID; child = nodes[child].nextSibling)
+		stack.push_back({child, 0});
+	while (!stack.empty())
+	{
+		auto [id, parentLength] = stack.back();
+		stack.pop_back();
+		path.resize(parentLength);
+		path += '/';
+		path += nameOf(nodes[id].name);
+		fn(nodes[id], path);
+		for (uint32_t child = nodes[id].firstChild; child != NO_ID; child = nodes[child].nextSibling)
+			stack.push_back({child, path.size()});
+	}
+}
@@ -0,0 +1,250 @@
+#ifndef NAMESPACE_INDEX_H
+#define NAMESPACE_INDEX_H
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Returns the parent of a path: "/home" for "/home/swarup", "/" for "/home".
+std::string getParentDirectory(const std::string &path);
+// Returns the last component of a path: "hello.txt" for "/home/swarup/hello.txt".
+std::string getBaseName(const std::string &path);
+
+// SHA-256 of a file's path: the name its data is stored under on the file server.
+typedef std::array<uint8_t, 32> ObjectId;
+
+// Servers that hold a file's data, for files spread over more than one; servers[0]
+// is the file's own server. A file on a single server has unit 0 and no servers.
+// Striped (unit != 0): stripe unit i of the file is stored on
+// servers[i % servers.size()], at the same offset as in the file.
+// Replicated (unit 0): every server holds a full copy, and writes pass down the
+// servers in this order.
+struct FileLayout
+{
+	uint32_t unit = 0;
+	std::vector<std::string> servers;
+	bool striped() const { return unit != 0; }
+	bool replicated() const { return unit == 0 && !servers.empty(); }
+};
+
+const uint32_t NO_ID = 0xffffffff;
+const uint16_t NO_SERVER = 0xffff;
+
+// Open-addressing hash set of 32-bit ids with linear probing. The ids refer to
+// objects owned elsewhere, so the caller supplies hashing and equality.
+class IdTable
+{
+public:
+	// Returns the id for which eq(id) holds, or NO_ID.
+	template <typename Eq>
+	uint32_t find(size_t hash, Eq eq) const
+	{
+		if (slots.empty())
+			return NO_ID;
+		size_t mask = slots.size() - 1;
+		for (size_t i = hash & mask;; i = (i + 1) & mask)
+		{
+			uint32_t id = slots[i];
+			if (id == NO_ID || eq(id))
+				return id;
+		}
+	}
+	// hashOf rehashes the stored ids when the table grows or entries shift.
+	void insert(uint32_t id, size_t hash, const std::function<size_t(uint32_t)> &hashOf);
+	void erase(uint32_t id, size_t hash, const std::function<size_t(uint32_t)> &hashOf);
+	void clear();
+	size_t bytes() const { return slots.capacity() * sizeof(uint32_t); }
+
+private:
+	std::vector<uint32_t> slots;
+	size_t count = 0;
+	void place(uint32_t id, size_t hash);
+};
+
+// Memory held by the index, from container capacities.
+struct IndexMemoryUsage
+{
+	size_t entries = 0;		   // directories and files
+	size_t nodeBytes = 0;	   // node array
+	size_t nameBytes = 0;	   // interned component arena and its lookup table
+	size_t tableBytes = 0;	   // (parent, name) -> node table
+	size_t objectBytes = 0;	   // file object ids and layouts
+	size_t uniqueNames = 0;
+	size_t total() const { return nodeBytes + nameBytes + tableBytes + objectBytes; }
+};
+
+// In-memory namespace: directories, the files in them and the directory to file
+// server mappings, stored as a tree of fixed-size nodes. Path components are
+// interned once in a shared arena, so "/home/alice/a.txt" and "/home/alice/b.txt"
+// share their first two components. Names are counted by the nodes that use them
+// and released with the last one; the arena is compacted once most of it is dead. Servers are 16-bit indices into a table that
+// follows the order of NamespaceServer::fileServers. Finding an entry walks its
+// components, O(depth); listing a directory walks its children, O(children).
+class NamespaceIndex
+{
+public:
+	NamespaceIndex();
+
+	// Index of a file server id, adding it to the server table if it is new.
+	uint16_t serverIndex(const std::string &serverId);
+	const std::string &serverName(uint16_t index) const { return servers[index]; }
+
+	bool hasDirectory(const std::string &path) const;
+	// Returns false if the directory already exists.
+	bool addDirectory(const std::string &path);
+	bool removeDirectory(const std::string &path);
+
+	// File server a directory's new files are placed on, if it is mapped.
+	bool directoryServer(const std::string &path, std::string &serverId) const;
+	void mapDirectory(const std::string &path, const std::string &serverId);
+	void unmapDirectory(const std::string &path);
+
+	// File server that stores a file, and the object id it is stored under.
+	// Returns false if there is no such file.
+	bool fileServer(const std::string &path, std::string &serverId) const;
+	bool fileServer(const std::string &path, std::string &serverId, ObjectId &objectId) const;
+	bool fileServer(const std::string &path, std::string &serverId, ObjectId &objectId, FileLayout &layout) const;
+	// Places a file, replacing any earlier placement.
+	void addFile(const std::string &path, const std::string &serverId, const ObjectId &objectId,
+				 const FileLayout &layout = FileLayout());
+	bool removeFile(const std::string &path);
+
+	// Names of the direct children of a directory, in sorted order.
+	// Returns false if the directory does not exist.
+	bool listChildren(const std::string &path, std::vector<std::string> &subdirs,
+					  std::vector<std::string> &files) const;
+	// Same, without requiring the directory itself to be recorded in this index.
+	void childNames(const std::string &path, std::vector<std::string> &subdirs,
+					std::vector<std::string> &files) const;
+
+	// fn(name, isDirectory, serverId, objectId, layout) for each direct child of a
+	// directory that is a directory or a file, in no particular order. serverId,
+	// objectId and layout are only set for files. Takes O(children), whatever the
+	// size of the index.
+	template <typename Fn>
+	void forEachChild(const std::string &path, Fn fn) const
+	{
+		static const std::string noServer;
+		uint32_t id = resolve(path);
+		if (id == NO_ID)
+			return;
+		for (uint32_t child = nodes[id].firstChild; child != NO_ID; child = nodes[child].nextSibling)
+		{
+			const Node &node = nodes[child];
+			if (node.flags & NODE_DIRECTORY)
+				fn(nameOf(node.name), true, noServer, (const ObjectId *)nullptr, FileLayout());
+			if (node.fileServer != NO_SERVER)
+				fn(nameOf(node.name), false, servers[node.fileServer], &objects[node.object], layoutOf(node));
+		}
+	}
+
+	size_t directoryCount() const { return dirCount; }
+	size_t fileCount() const { return filesCount; }
+	IndexMemoryUsage memoryUsage() const;
+	// Drops all entries; the server table is kept.
+	void clear();
+
+	// fn(path, isDirectory, serverId) for every directory and every directory mapping;
+	// a mapping whose directory does not exist has isDirectory false.
+	template <typename Fn>
+	void forEachDirectory(Fn fn) const
+	{
+		walk([&](const Node &node, const std::string &path)
+			 {
+			if (node.flags & NODE_DIRECTORY || node.dirServer != NO_SERVER)
+				fn(path, (node.flags & NODE_DIRECTORY) != 0,
+				   node.dirServer == NO_SERVER ? std::string() : servers[node.dirServer]); });
+	}
+
+	// fn(path, serverId, objectId, layout) for every file.
+	template <typename Fn>
+	void forEachFile(Fn fn) const
+	{
+		walk([&](const Node &node, const std::string &path)
+			 {
+			if (node.fileServer != NO_SERVER)
+				fn(path, servers[node.fileServer], objects[node.object], layoutOf(node)); });
+	}
+
+private:
+	enum : uint8_t
+	{
+		NODE_DIRECTORY = 1,
+		NODE_FREE = 2,
+		NODE_LAYOUT = 4 // The file has an entry in layouts.
+	};
+
+	// One path component. A node is a directory if NODE_DIRECTORY is set and a file
+	// if fileServer is set; nodes with neither are kept while they hold a mapping or
+	// children (parents of entries loaded out of order).
+	struct Node
+	{
+		uint32_t name;
+		uint32_t parent;
+		uint32_t firstChild = NO_ID;
+		uint32_t nextSibling = NO_ID; // Also links the free list.
+		uint32_t prevSibling = NO_ID;
+		uint32_t object = NO_ID; // Slot in objects while the node is a file.
+		uint16_t fileServer = NO_SERVER;
+		uint16_t dirServer = NO_SERVER;
+		uint8_t flags = 0;
+	};
+
+	// A released name has offset NO_ID until its id is reused.
+	struct Name
+	{
+		uint32_t offset;
+		uint32_t length;
+		uint32_t refs; // Nodes with this name.
+	};
+
+	std::vector<Node> nodes; // nodes[0] is the root.
+	uint32_t freeNodes = NO_ID;
+	IdTable children; // (parent, name) -> node
+
+	std::string nameArena;
+	std::vector<Name> names;
+	IdTable nameTable; // component -> name id
+	std::vector<uint32_t> freeNames;
+	size_t deadNameBytes = 0; // Arena bytes of released names.
+
+	// Object ids of files, kept out of the nodes so directories do not pay for them.
+	std::vector<ObjectId> objects;
+	std::vector<uint32_t> freeObjects;
+	// Layouts of striped and replicated files by object slot.
+	struct Layout
+	{
+		uint32_t unit;
+		std::vector<uint16_t> servers;
+	};
+	std::unordered_map<uint32_t, Layout> layouts;
+	FileLayout layoutOf(const Node &node) const;
+
+	std::vector<std::string> servers;
+	size_t dirCount = 0;
+	size_t filesCount = 0;
+
+	std::string_view nameOf(uint32_t id) const { return std::string_view(nameArena).substr(names[id].offset, names[id].length); }
+	uint32_t findName(std::string_view component) const;
+	uint32_t internName(std::string_view component);
+	// Drops a node's reference to a name, releasing the name with the last one.
+	void releaseName(uint32_t id);
+	// Rewrites the arena with only the names in use.
+	void compactNames();
+	size_t childHash(uint32_t parent, uint32_t name) const;
+	uint32_t findChild(uint32_t parent, uint32_t name) const;
+	uint32_t addChild(uint32_t parent, uint32_t name);
+	// Node for a path, or NO_ID. resolveOrCreate adds missing components.
+	uint32_t resolve(const std::string &path) const;
+	uint32_t resolveOrCreate(const std::string &path);
+	// Frees a node, and then its parents, once nothing refers to them.
+	void prune(uint32_t id);
+	// Depth-first walk over every node with its full path.
+	void walk(const std::function<void(const Node &, const std::string &)> &fn) const;
+};
+
+#endif // NAMESPACE_INDEX_H
@@ -1,53 +1,165 @@
 #include "NamespaceServer.h"
 #include "../common/util.h"
+#include "../common/protocol.h"
+#include "../common/capability.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <cstring>
+#include <cerrno>
 #include <climits>
 #include <algorithm>
+#include <optional>
 #include <openssl/sha.h>
-#include <iomanip>
-#include <sstream>
+#include <set>
+#include <tuple>
+#include <ctime>
+
+static const char *const JOURNAL_FAILED = "ERR JournalWriteFailed";
 
-// Helper function to validate that a path is non-empty and starts with '/'
+// Helper function to validate that a path is non-empty and starts with '/'.
+// Journal records and text requests separate fields with whitespace, so a path
+// may not contain any, nor other control characters.
+// Paths must also be canonical, since shards are chosen by hashing the string:
+// "/a/" or "//a" would land in another shard than "/a".
 static bool isValidPath(const std::string &path)
 {
-	return !path.empty() && path[0] == '/';
+	if (path.empty() || path[0] != '/')
+		return false;
+	if (path.size() > 1 && path.back() == '/')
+		return false;
+	for (size_t i = 0; i < path.size(); i++)
+	{
+		unsigned char c = path[i];
+		if (c <= ' ' || c == 0x7f || (c == '/' && i > 0 && path[i - 1] == '/'))
+			return false;
+	}
+	return true;
 }
 
-// Helper function to extract the parent directory from a given path.
-// For example, for "/home/swarup", it returns "/home". For paths directly under root, returns "/".
-static std::string getParentDirectory(const std::string &path)
+// Drops repeated and trailing slashes from a request's path, then validates it.
+static bool canonicalize(std::string &path)
 {
-	if (path == "/")
-		return "/";
-	size_t pos = path.rfind('/');
-	if (pos == 0)
-		return "/";
-	else if (pos != std::string::npos)
-		return path.substr(0, pos);
-	return "";
+	std::string canonical;
+	canonical.reserve(path.size());
+	for (char c : path)
+	{
+		if (c != '/' || canonical.empty() || canonical.back() != '/')
+			canonical += c;
+	}
+	if (canonical.size() > 1 && canonical.back() == '/')
+		canonical.pop_back();
+	path = std::move(canonical);
+	return isValidPath(path);
 }
 
-// Helper function to extract the basename from a full path.
-// For example, for "/home/swarup/hello.txt", returns "hello.txt".
-static std::string getBaseName(const std::string &path)
+// Computes the object id of a file: the SHA256 hash of its full path. It is stored
+// with the file's metadata, so this only runs when a file is created or when an
+// entry is loaded without one.
+static ObjectId computeObjectId(const std::string &path)
 {
-	size_t pos = path.find_last_of('/');
-	if (pos == std::string::npos)
-		return path;
-	return path.substr(pos + 1);
+	ObjectId id;
+	SHA256((const unsigned char *)path.data(), path.size(), id.data());
+	return id;
 }
 
-// Constructor: initializes file servers and loads metadata.
+// The name a file is stored under on its file server: the object id in hex.
+static std::string objectName(const ObjectId &id)
+{
+	return toHex(id.data(), id.size());
+}
+
+// Locks a set of shards in index order. Every operation that holds more than one
+// shard locks them this way, so two operations never wait on each other. A shard
+// requested both shared and exclusive is locked exclusively.
+class ShardGuard
+{
+public:
+	ShardGuard(NamespaceShard *shards, std::vector<std::pair<size_t, bool>> requests) : shards(shards)
+	{
+		std::sort(requests.begin(), requests.end());
+		for (const auto &[shard, exclusive] : requests)
+		{
+			if (!held.empty() && held.back().first == shard)
+				held.back().second = held.back().second || exclusive;
+			else
+				held.push_back({shard, exclusive});
+		}
+		for (const auto &[shard, exclusive] : held)
+		{
+			if (exclusive)
+				shards[shard].mutex.lock();
+			else
+				shards[shard].mutex.lock_shared();
+		}
+	}
+
+	// Locks every shard in the same mode.
+	ShardGuard(NamespaceShard *shards, bool exclusive) : shards(shards)
+	{
+		for (size_t i = 0; i < NAMESPACE_SHARDS; i++)
+		{
+			held.push_back({i, exclusive});
+			if (exclusive)
+				shards[i].mutex.lock();
+			else
+				shards[i].mutex.lock_shared();
+		}
+	}
+
+	~ShardGuard()
+	{
+		for (auto it = held.rbegin(); it != held.rend(); ++it)
+		{
+			if (it->second)
+				shards[it->first].mutex.unlock();
+			else
+				shards[it->first].mutex.unlock_shared();
+		}
+	}
+
+	ShardGuard(const ShardGuard &) = delete;
+	ShardGuard &operator=(const ShardGuard &) = delete;
+
+private:
+	NamespaceShard *shards;
+	std::vector<std::pair<size_t, bool>> held;
+};
+
+// Objects per DELETE_MANY request.
+const size_t DELETE_BATCH = 1024;
+// How often deletes a file server did not confirm are tried again.
+const std::chrono::seconds DELETE_RETRY_INTERVAL(10);
+// How often the file servers are asked for their load and lagging replicas.
+const std::chrono::seconds LOAD_REFRESH_INTERVAL(2);
+// How often lagging replicas are checked for repair.
+const std::chrono::seconds REPAIR_INTERVAL(5);
+
+size_t NamespaceServer::shardFor(const std::string &dir) const
+{
+	return std::hash<std::string>{}(dir) % NAMESPACE_SHARDS;
+}
+
+// Constructor: initializes file servers, loads metadata and replays the journal.
 // Also ensures the root directory ("/") exists and is mapped.
 NamespaceServer::NamespaceServer(const std::string &dirFile, const std::string &fileFile,
-								 const std::string &userFile, const std::string &dirMapFile)
-	: dirFilename(dirFile), fileFilename(fileFile), userFilename(userFile), dirMapFilename(dirMapFile)
+								 const std::string &userFile, const std::string &dirMapFile,
+								 const std::string &snapshotFile, const std::string &journalFile,
+								 const std::string &pendingDeletesFile, const std::string &laggingReplicasFile,
+								 const std::string &placementPolicy, size_t replicas,
+								 const JournalOptions &journalOptions, int fileServerTimeoutMs, size_t maxMessageSize)
+	: dirFilename(dirFile), fileFilename(fileFile), userFilename(userFile), dirMapFilename(dirMapFile),
+	  snapshotFilename(snapshotFile), replicas(replicas), maxMessageSize(maxMessageSize),
+	  fsPool(16, 60, fileServerTimeoutMs, maxMessageSize),
+	  journal(journalFile, journalOptions),
+	  pendingDeletesFilename(pendingDeletesFile), laggingReplicasFilename(laggingReplicasFile)
 {
 	// Hard-code five file servers.
 	fileServers.push_back({"Server1", "127.0.0.1", 4001, 0});
@@ -55,48 +167,136 @@ NamespaceServer::NamespaceServer(const std::string &dirFile, const std::string &
 	fileServers.push_back({"Server3", "127.0.0.1", 4003, 0});
 	fileServers.push_back({"Server4", "127.0.0.1", 4004, 0});
 	fileServers.push_back({"Server5", "127.0.0.1", 4005, 0});
+	placement = makePlacementPolicy(placementPolicy, fileServers);
+	if (!placement)
+	{
+		std::cerr << "Unknown placement policy '" << placementPolicy << "', using hash\n";
+		placement = makePlacementPolicy("hash", fileServers);
+	}
+	this->replicas = std::max<size_t>(1, std::min(replicas, fileServers.size()));
+	// The index stores servers as positions in this table.
+	for (auto &shard : shards)
+	{
+		for (const auto &fs : fileServers)
+			shard.index.serverIndex(fs.serverId);
+	}
+
+	auto startTime = std::chrono::steady_clock::now();
+	loadUsers();
+	// The text files are only read until the first snapshot has been written.
+	bool fromSnapshot = loadSnapshot();
+	if (!fromSnapshot)
+	{
+		loadMetadata();
+		loadDirMapping();
+	}
+	auto loadedTime = std::chrono::steady_clock::now();
+	// No worker threads exist yet, so startup needs no shard locks.
+	size_t replayed = journal.replay([this](const std::string &record)
+									 { applyRecord(record); });
+	auto replayedTime = std::chrono::steady_clock::now();
+	journal.open();
 
-	loadMetadata();
-	loadDirMapping();
+	// Ensure the root directory "/" exists in the metadata. It is added again at every
+	// start, so it is kept in memory even if the journal cannot be written.
+	std::string rootServer;
+	if (!entryIndex("/").hasDirectory("/") && !commit("+D /"))
+		applyRecord("+D /");
+	if (!mappingIndex("/").directoryServer("/", rootServer) && !commit("+M / Server1"))
+		applyRecord("+M / Server1");
+	if (!fromSnapshot)
+		checkpoint(true);
+	loadPendingDeletes();
+	loadLaggingReplicas();
+	countPlacedFiles();
+	auto readyTime = std::chrono::steady_clock::now();
 
-	// Ensure the root directory "/" exists in the metadata.
+	auto ms = [](std::chrono::steady_clock::duration d)
+	{ return std::chrono::duration<double, std::milli>(d).count(); };
+	std::cout << "Metadata loaded from " << (fromSnapshot ? "snapshot" : "text files") << " in "
+			  << ms(loadedTime - startTime) << " ms; replayed " << replayed << " journal records in "
+			  << ms(replayedTime - loadedTime) << " ms";
+	if (!fromSnapshot)
+		std::cout << "; converted to snapshot in " << ms(readyTime - replayedTime) << " ms";
+	std::cout << std::endl;
+	std::cout << "Namespace memory: " << statistics() << std::endl;
+	std::cout << "Placement policy: " << placement->name() << ", " << this->replicas << " replica(s) per file" << std::endl;
+	if (!pendingDeletes.empty())
+		std::cout << pendingDeletes.size() << " file server deletes pending from an earlier run" << std::endl;
+	if (!laggingReplicas.empty())
+		std::cout << laggingReplicas.size() << " replicas to repair from an earlier run" << std::endl;
+	checkpointThread = std::thread(&NamespaceServer::checkpointLoop, this);
+}
+
+NamespaceServer::~NamespaceServer()
+{
+	stopping = true;
+	if (checkpointThread.joinable())
+		checkpointThread.join();
+}
+
+// Loads the memory-mapped binary snapshot. Entries are copied straight out of the
+// mapping without any parsing. Returns false if there is no valid snapshot.
+bool NamespaceServer::loadSnapshot()
+{
+	MetadataSnapshot snapshot;
+	if (!snapshot.open(snapshotFilename))
+		return false;
+	for (auto &shard : shards)
+		shard.index.clear();
+	std::vector<std::string_view> layoutServers;
+	for (size_t i = 0; i < snapshot.size(); i++)
 	{
-		std::lock_guard<std::mutex> lock(nsMutex);
-		if (std::find(directories.begin(), directories.end(), "/") == directories.end())
+		std::string path(snapshot.path(i));
+		std::string server(snapshot.server(i));
+		switch (snapshot.kind(i))
 		{
-			directories.push_back("/");
-			saveMetadata();
-		}
-		if (dirMapping.find("/") == dirMapping.end())
+		case SNAPSHOT_DIRECTORY:
+			entryIndex(path).addDirectory(path);
+			if (!server.empty())
+				mappingIndex(path).mapDirectory(path, server);
+			break;
+		case SNAPSHOT_FILE:
 		{
-			dirMapping["/"] = "Server1";
-			saveDirMapping();
+			const uint8_t *stored = snapshot.objectId(i);
+			ObjectId objectId;
+			if (stored)
+				std::copy(stored, stored + objectId.size(), objectId.begin());
+			else
+				objectId = computeObjectId(path);
+			FileLayout layout;
+			layout.unit = snapshot.layout(i, layoutServers);
+			for (auto layoutServer : layoutServers)
+				layout.servers.emplace_back(layoutServer);
+			entryIndex(path).addFile(path, server, objectId, layout);
+			break;
+		}
+		case SNAPSHOT_MAPPING:
+			mappingIndex(path).mapDirectory(path, server);
+			break;
 		}
 	}
+	return true;
 }
 
-// Loads directories, file mappings, and users from their respective files.
+// Loads directories and file mappings from the legacy text files.
 void NamespaceServer::loadMetadata()
 {
-	std::lock_guard<std::mutex> lock(nsMutex);
 	std::ifstream dirFileStream(dirFilename);
 	std::string line;
-	directories.clear();
+	for (auto &shard : shards)
+		shard.index.clear();
 	if (dirFileStream.is_open())
 	{
 		while (std::getline(dirFileStream, line))
 		{
 			line = trim(line);
 			if (!line.empty())
-			{
-				directories.push_back(line);
-				std::cout << "Directory loaded: " << line << "\n";
-			}
+				entryIndex(line).addDirectory(line);
 		}
 		dirFileStream.close();
 	}
 	std::ifstream fileFileStream(fileFilename);
-	fileMapping.clear();
 	if (fileFileStream.is_open())
 	{
 		while (std::getline(fileFileStream, line))
@@ -109,14 +309,19 @@ void NamespaceServer::loadMetadata()
 				{
 					std::string filepath = trim(line.substr(0, pos));
 					std::string serverId = trim(line.substr(pos + 1));
-					fileMapping[filepath] = serverId;
-					std::cout << "File mapping loaded: " << filepath << " -> " << serverId << "\n";
+					entryIndex(filepath).addFile(filepath, serverId, computeObjectId(filepath));
 				}
 			}
 		}
 		fileFileStream.close();
 	}
+}
+
+// Loads user credentials.
+void NamespaceServer::loadUsers()
+{
 	std::ifstream userFileStream(userFilename);
+	std::string line;
 	users.clear();
 	if (userFileStream.is_open())
 	{
@@ -138,33 +343,139 @@ void NamespaceServer::loadMetadata()
 	}
 }
 
-// Note: These functions assume that the caller holds nsMutex.
-void NamespaceServer::saveMetadata()
+// Journal records, one per line:
+//   "+D <dir>"             directory created
+//   "-D <dir>"             directory removed
+//   "+F <file> <serverId> <objectId> [<stripeUnit> <serverId>...]"
+//                          file placed on a file server; the object id is
+//                          recomputed if an older record lacks it. A striped
+//                          file lists its other stripe servers after the unit.
+//   "-F <file>"            file removed
+//   "+M <dir> <serverId>"  directory mapped to a file server
+//   "-M <dir>"             directory mapping removed
+// Each record sets state rather than changing it relatively, so applying one twice is harmless.
+void NamespaceServer::applyRecord(const std::string &record)
+{
+	std::istringstream iss(record);
+	std::string op, path, serverId, objectHex;
+	iss >> op >> path >> serverId >> objectHex;
+	if (!isValidPath(path))
+		return;
+	if (op == "+D")
+		entryIndex(path).addDirectory(path);
+	else if (op == "-D")
+		entryIndex(path).removeDirectory(path);
+	else if (op == "+F" && !serverId.empty())
+	{
+		ObjectId objectId;
+		if (!fromHex(objectHex, objectId.data(), objectId.size()))
+			objectId = computeObjectId(path);
+		FileLayout layout;
+		std::string stripeServer;
+		if (iss >> layout.unit)
+		{
+			layout.servers.push_back(serverId);
+			while (iss >> stripeServer)
+				layout.servers.push_back(stripeServer);
+		}
+		entryIndex(path).addFile(path, serverId, objectId, layout);
+	}
+	else if (op == "-F")
+		entryIndex(path).removeFile(path);
+	else if (op == "+M" && !serverId.empty())
+		mappingIndex(path).mapDirectory(path, serverId);
+	else if (op == "-M")
+		mappingIndex(path).unmapDirectory(path);
+}
+
+// Journal sequence number of the last record committed on this thread; the worker
+// holds the request's response until it is synced.
+static thread_local uint64_t lastCommitted = 0;
+
+// Makes a mutation durable in the journal and applies it in memory.
+// Note: assumes that the caller holds the record's shard exclusively.
+bool NamespaceServer::commit(const std::string &record)
+{
+	if (!journal.append(record, &lastCommitted))
+		return false;
+	applyRecord(record);
+	return true;
+}
+
+// Writes a binary snapshot of the records copied out of the index.
+bool NamespaceServer::writeSnapshot(std::vector<SnapshotRecord> records)
 {
-	std::ofstream dirFileStream(dirFilename, std::ios::trunc);
-	for (const auto &d : directories)
-		dirFileStream << d << "\n";
-	dirFileStream.close();
-	std::ofstream fileFileStream(fileFilename, std::ios::trunc);
-	for (const auto &pair : fileMapping)
-		fileFileStream << pair.first << " = " << pair.second << "\n";
-	fileFileStream.close();
+	return MetadataSnapshot::write(snapshotFilename, std::move(records));
 }
 
-void NamespaceServer::saveDirMapping()
+// Folds the journal into a new snapshot. The journal is rotated first, then each
+// shard is copied under its own shared lock, so mutations only wait for the copy
+// of the shard they change. Every record in the rotated journal was applied
+// before the copy of its shard, so the snapshot holds it. Records made during the
+// copy may or may not be in the snapshot; they are in the new journal, and since
+// each record sets state, replaying them over the snapshot gives the same result
+// either way. The snapshot is written while mutations continue.
+void NamespaceServer::checkpoint(bool force)
 {
-	std::ofstream mapFile(dirMapFilename, std::ios::trunc);
-	for (const auto &pair : dirMapping)
-		mapFile << pair.first << " = " << pair.second << "\n";
-	mapFile.close();
+	if (!force && journal.recordCount() == 0)
+		return;
+	journal.rotate();
+	std::vector<SnapshotRecord> records;
+	for (auto &shard : shards)
+	{
+		std::shared_lock<std::shared_mutex> lock(shard.mutex);
+		shard.index.forEachDirectory([&](const std::string &path, bool isDirectory, const std::string &serverId)
+									 { records.push_back({path, isDirectory ? SNAPSHOT_DIRECTORY : SNAPSHOT_MAPPING, serverId}); });
+		shard.index.forEachFile([&](const std::string &path, const std::string &serverId, const ObjectId &objectId,
+									const FileLayout &layout)
+								{ records.push_back({path, SNAPSHOT_FILE, serverId, true, objectId, layout.unit, layout.servers}); });
+	}
+	if (writeSnapshot(std::move(records)))
+		journal.discardRotated();
+	else
+		std::cerr << "Checkpoint failed; journal kept for replay\n";
+}
+
+void NamespaceServer::checkpointLoop()
+{
+	const JournalOptions &options = journal.settings();
+	auto lastCheckpoint = std::chrono::steady_clock::now();
+	auto lastDeleteRetry = lastCheckpoint - DELETE_RETRY_INTERVAL;
+	auto lastLoadRefresh = lastDeleteRetry;
+	auto lastRepair = lastCheckpoint;
+	while (!stopping)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		size_t records = journal.recordCount();
+		bool due = std::chrono::steady_clock::now() - lastCheckpoint >= std::chrono::seconds(options.checkpointIntervalSec);
+		if (records >= options.checkpointRecords || (records > 0 && due))
+		{
+			checkpoint();
+			lastCheckpoint = std::chrono::steady_clock::now();
+		}
+		if (std::chrono::steady_clock::now() - lastLoadRefresh >= LOAD_REFRESH_INTERVAL)
+		{
+			refreshServerLoad();
+			collectLaggingReplicas();
+			lastLoadRefresh = std::chrono::steady_clock::now();
+		}
+		if (std::chrono::steady_clock::now() - lastRepair >= REPAIR_INTERVAL)
+		{
+			repairReplicas();
+			lastRepair = std::chrono::steady_clock::now();
+		}
+		if (std::chrono::steady_clock::now() - lastDeleteRetry >= DELETE_RETRY_INTERVAL)
+		{
+			retryPendingDeletes();
+			lastDeleteRetry = std::chrono::steady_clock::now();
+		}
+	}
 }
 
 void NamespaceServer::loadDirMapping()
 {
-	std::lock_guard<std::mutex> lock(nsMutex);
 	std::ifstream mapFile(dirMapFilename);
 	std::string line;
-	dirMapping.clear();
 	if (mapFile.is_open())
 	{
 		while (std::getline(mapFile, line))
@@ -177,7 +488,7 @@ void NamespaceServer::loadDirMapping()
 				{
 					std::string dir = trim(line.substr(0, pos));
 					std::string serverId = trim(line.substr(pos + 1));
-					dirMapping[dir] = serverId;
+					mappingIndex(dir).mapDirectory(dir, serverId);
 				}
 			}
 		}
@@ -199,142 +510,228 @@ std::string NamespaceServer::listDirectory(const std::string &path)
 	if (!isValidPath(path))
 		return "ERR InvalidPath";
 
-	std::lock_guard<std::mutex> lock(nsMutex);
-
-	// Confirm that the directory exists.
-	bool found = false;
-	for (const auto &d : directories)
-	{
-		if (d == path)
-		{
-			found = true;
-			break;
-		}
-	}
-	if (!found)
+	// The directory's own entry and its children may live in different shards.
+	ShardGuard guard(shards, {{entryShard(path), false}, {shardFor(path), false}});
+	if (!entryIndex(path).hasDirectory(path))
 		return "ERR DirectoryNotFound";
+	std::vector<std::string> subdirs, files;
+	mappingIndex(path).childNames(path, subdirs, files);
 
 	std::ostringstream oss;
-
-	// List all direct child directories.
 	oss << "Directories:\n";
-	for (const auto &dir : directories)
-	{
-		if (dir == path)
-			continue; // Skip the directory itself.
-
-		// Check if 'dir' is an immediate child of 'path'
-		// Example: if path is "/home", then "/home/docs" qualifies but "/home/docs/reports" does not.
-		if (getParentDirectory(dir) == path)
-		{
-			oss << getBaseName(dir) << "\n";
-		}
-	}
-
-	// List all direct child files.
+	for (const auto &name : subdirs)
+		oss << name << "\n";
 	oss << "Files:\n";
-	for (const auto &pair : fileMapping)
-	{
-		const std::string &filePath = pair.first;
-		// Use getParentDirectory to determine if the file is directly in 'path'.
-		if (getParentDirectory(filePath) == path)
-		{
-			oss << getBaseName(filePath) << "\n";
-		}
-	}
-	return oss.str();
-}
-// Computes the SHA256 hash of a given string and returns it as a hex string.
-std::string computeSHA256(const std::string &data)
-{
-	unsigned char hash[SHA256_DIGEST_LENGTH];
-	SHA256((const unsigned char *)data.c_str(), data.size(), hash);
-
-	std::ostringstream oss;
-	for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
-	{
-		// Convert each byte to a hex string.
-		oss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
-	}
+	for (const auto &name : files)
+		oss << name << "\n";
 	return oss.str();
 }
-
 // Creates a new file entry by assigning it to a file server.
 // Returns an error if the file already exists or if the path is invalid.
-std::string NamespaceServer::createFile(const std::string &path)
+// The file is reserved in its shard, created on the file server with no shard
+// locked, and then committed to the journal or released again.
+// A non-zero stripeUnit stripes the file over stripeCount servers (0 for all of
+// them), starting with the one the placement policy chooses. Other files get
+// their replicas on the servers after that one, reachable ones first. A replica
+// whose create fails is left lagging, to be repaired from the first.
+std::string NamespaceServer::createFile(const std::string &path, uint32_t stripeUnit, size_t stripeCount)
 {
 	if (!isValidPath(path))
 		return "ERR InvalidPath";
 
-	std::lock_guard<std::mutex> lock(nsMutex);
-	if (fileMapping.find(path) != fileMapping.end())
-		return "ERR FileAlreadyExists";
+	// The object id is computed once here and kept with the file's entry.
+	ObjectId objectId = computeObjectId(path);
+	std::string hashedFileName = objectName(objectId);
+	std::string dir = getParentDirectory(path);
+	std::string assignedServer;
+	FileLayout layout;
+	bool createdMapping = false;
+
+	// 1. Reserve the path. The parent's entry is only read; the new file and the
+	// parent's mapping both live in the parent's own shard.
+	{
+		ShardGuard guard(shards, {{entryShard(dir), false}, {shardFor(dir), true}});
+		NamespaceShard &shard = shards[shardFor(dir)];
+		if (shard.index.fileServer(path, assignedServer))
+			return "ERR FileAlreadyExists";
+		// A pending delete of the same object could otherwise remove the new file.
+		if (shard.pending.count(path) || isDeletePending(hashedFileName))
+			return "ERR FileBusy";
 
-	size_t pos = path.rfind('/');
-	std::string dir = (pos == 0) ? "/" : (pos != std::string::npos ? path.substr(0, pos) : "/");
+		if (!entryIndex(dir).hasDirectory(dir))
+			return "ERR ParentDirectoryNotFound";
 
-	bool parentFound = false;
-	for (const auto &d : directories)
+		std::lock_guard<std::mutex> placementLock(placementMutex);
+		if (!placement->perDirectory())
+			assignedServer = fileServers[placement->place(objectId, fileServers)].serverId;
+		else if (!shard.index.directoryServer(dir, assignedServer))
+		{
+			assignedServer = fileServers[placement->place(objectId, fileServers)].serverId;
+			if (!commit("+M " + dir + " " + assignedServer))
+				return JOURNAL_FAILED;
+			createdMapping = true;
+		}
+		size_t first = 0;
+		while (first < fileServers.size() && fileServers[first].serverId != assignedServer)
+			first++;
+		if (stripeUnit != 0 && first < fileServers.size())
+		{
+			// Stripe units go round-robin over the servers that follow the first one.
+			if (stripeCount == 0 || stripeCount > fileServers.size())
+				stripeCount = fileServers.size();
+			layout.unit = stripeUnit;
+			for (size_t i = 0; i < stripeCount; i++)
+				layout.servers.push_back(fileServers[(first + i) % fileServers.size()].serverId);
+		}
+		else if (replicas > 1 && first < fileServers.size())
+		{
+			layout.servers.push_back(assignedServer);
+			for (int pass = 0; pass < 2; pass++)
+			{
+				for (size_t i = 1; i < fileServers.size() && layout.servers.size() < replicas; i++)
+				{
+					const FileServer &fs = fileServers[(first + i) % fileServers.size()];
+					if (fs.reachable == (pass == 0))
+						layout.servers.push_back(fs.serverId);
+				}
+			}
+		}
+		for (auto &fs : fileServers)
+		{
+			if (fs.serverId == assignedServer ||
+				std::find(layout.servers.begin(), layout.servers.end(), fs.serverId) != layout.servers.end())
+				fs.fileCount++;
+		}
+		shard.pending.insert(path);
+	}
+	std::vector<std::string> objectServers = layout.servers.empty() ? std::vector<std::string>{assignedServer} : layout.servers;
+
+	// 2. Send the create command along with the hashed file name to every server
+	// that holds part of the file.
+	std::string fsResponse = "OK";
+	std::vector<std::string> created, missed;
+	for (const auto &serverId : objectServers)
 	{
-		if (d == dir)
+		std::string response = forwardToFileServer("CREATE " + hashedFileName + " " + issueServerCapability(), serverId);
+		if (response == "OK")
+			created.push_back(serverId);
+		else if (layout.replicated() && serverId != assignedServer)
+			missed.push_back(serverId);
+		else
 		{
-			parentFound = true;
+			fsResponse = response;
 			break;
 		}
 	}
-	if (!parentFound)
-		return "ERR ParentDirectoryNotFound";
 
-	std::string assignedServer;
-	auto it = dirMapping.find(dir);
-	if (it != dirMapping.end())
-		assignedServer = it->second;
-	else
+	// 3. Commit the file, unless the create failed or the parent was deleted meanwhile.
 	{
-		int minCount = INT_MAX;
-		for (auto &fs : fileServers)
+		ShardGuard guard(shards, {{entryShard(dir), false}, {shardFor(dir), true}});
+		shards[shardFor(dir)].pending.erase(path);
+		if (fsResponse == "OK")
 		{
-			if (fs.fileCount < minCount)
+			if (entryIndex(dir).hasDirectory(dir))
 			{
-				minCount = fs.fileCount;
-				assignedServer = fs.serverId;
+				std::string record = "+F " + path + " " + assignedServer + " " + hashedFileName;
+				std::string response = "OK " + assignedServer;
+				if (!layout.servers.empty())
+				{
+					record += " " + std::to_string(layout.unit);
+					for (size_t i = 1; i < layout.servers.size(); i++)
+					{
+						record += " " + layout.servers[i];
+						response += " " + layout.servers[i];
+					}
+				}
+				if (commit(record))
+				{
+					for (const auto &serverId : missed)
+						markLagging(hashedFileName, serverId, assignedServer);
+					return response;
+				}
+				fsResponse = JOURNAL_FAILED;
 			}
+			else
+				fsResponse = "ERR ParentDirectoryNotFound";
+		}
+		// A mapping made for this file goes with it, unless another file in the
+		// directory uses it by now. A deleted parent took its mapping along.
+		NamespaceShard &shard = shards[shardFor(dir)];
+		std::string mappedServer;
+		if (createdMapping && shard.index.directoryServer(dir, mappedServer) && mappedServer == assignedServer)
+		{
+			bool inUse = false;
+			shard.index.forEachChild(dir, [&](std::string_view, bool isDirectory, const std::string &, const ObjectId *,
+											  const FileLayout &)
+									 { inUse = inUse || !isDirectory; });
+			for (const auto &pendingPath : shard.pending)
+				inUse = inUse || getParentDirectory(pendingPath) == dir;
+			if (!inUse)
+				commit("-M " + dir);
 		}
-		dirMapping[dir] = assignedServer;
-		saveDirMapping();
 	}
+	for (const auto &serverId : objectServers)
+		releasePlacement(serverId);
+	for (const auto &serverId : created)
+		forwardToFileServer("DELETE " + hashedFileName + " " + issueServerCapability(), serverId);
+	return fsResponse;
+}
+
+void NamespaceServer::countPlacedFiles()
+{
+	std::map<std::string, int> counts;
+	for (auto &shard : shards)
+	{
+		shard.index.forEachFile([&](const std::string &, const std::string &serverId, const ObjectId &, const FileLayout &layout)
+								{
+			if (layout.servers.empty())
+				counts[serverId]++;
+			for (const auto &layoutServer : layout.servers)
+				counts[layoutServer]++; });
+	}
+	std::lock_guard<std::mutex> lock(placementMutex);
 	for (auto &fs : fileServers)
+		fs.fileCount = counts[fs.serverId];
+}
+
+// STATS answers "OK bytes=<stored bytes> requests=<requests served>". The request
+// rate is the difference between two answers over the time between them.
+void NamespaceServer::refreshServerLoad()
+{
+	auto now = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(now - loadRefreshedAt).count();
+	loadRefreshedAt = now;
+	for (size_t i = 0; i < fileServers.size(); i++)
 	{
-		if (fs.serverId == assignedServer)
+		std::string response = sendRequestToServer(fileServers[i].ip, fileServers[i].port, "STATS");
+		unsigned long long bytes = 0, requests = 0;
+		bool ok = sscanf(response.c_str(), "OK bytes=%llu requests=%llu", &bytes, &requests) == 2;
+		std::lock_guard<std::mutex> lock(placementMutex);
+		FileServer &fs = fileServers[i];
+		if (ok && fs.reachable && requests >= fs.requestsReported)
+			fs.requestRate = (requests - fs.requestsReported) / seconds;
+		else
+			fs.requestRate = 0;
+		fs.reachable = ok;
+		if (ok)
 		{
-			fs.fileCount++;
-			break;
+			fs.bytesStored = bytes;
+			fs.requestsReported = requests;
 		}
 	}
+}
 
-	// Compute a unique hash for the full file path.
-	std::string hashedFileName = computeSHA256(path);
-	fileMapping[path] = assignedServer;
-	saveMetadata();
-
-	// Send the create command along with the hashed file name.
-	std::string fsResponse = forwardToFileServer("CREATE " + hashedFileName, assignedServer);
-	if (fsResponse == "OK")
-		return "OK " + assignedServer;
-	else
+// Undoes the file count increment made when a file was placed on a server.
+void NamespaceServer::releasePlacement(const std::string &serverId)
+{
+	std::lock_guard<std::mutex> lock(placementMutex);
+	for (auto &fs : fileServers)
 	{
-		std::lock_guard<std::mutex> lock(nsMutex);
-		fileMapping.erase(path);
-		for (auto &fs : fileServers)
+		if (fs.serverId == serverId && fs.fileCount > 0)
 		{
-			if (fs.serverId == assignedServer && fs.fileCount > 0)
-			{
-				fs.fileCount--;
-				break;
-			}
+			fs.fileCount--;
+			break;
 		}
-		saveMetadata();
-		return fsResponse;
 	}
 }
 
@@ -346,28 +743,16 @@ std::string NamespaceServer::makeDirectory(const std::string &path)
 	if (!isValidPath(path))
 		return "ERR InvalidPath";
 
-	std::lock_guard<std::mutex> lock(nsMutex);
-	for (const auto &d : directories)
-	{
-		if (d == path)
-			return "ERR DirectoryAlreadyExists";
-	}
-
 	std::string parent = getParentDirectory(path);
-	bool parentFound = false;
-	for (const auto &d : directories)
-	{
-		if (d == parent)
-		{
-			parentFound = true;
-			break;
-		}
-	}
-	if (!parentFound)
+	ShardGuard guard(shards, {{entryShard(path), true}, {entryShard(parent), false}});
+	if (entryIndex(path).hasDirectory(path))
+		return "ERR DirectoryAlreadyExists";
+
+	if (!entryIndex(parent).hasDirectory(parent))
 		return "ERR ParentDirectoryNotFound";
 
-	directories.push_back(path);
-	saveMetadata();
+	if (!commit("+D " + path))
+		return JOURNAL_FAILED;
 
 	// Forward a "MKDIR" command to all file servers that might store files under this directory.
 	// Since file servers store only file basenames, they don't store directories.
@@ -375,87 +760,250 @@ std::string NamespaceServer::makeDirectory(const std::string &path)
 	return "OK";
 }
 
+static std::string partialDelete(size_t failed, size_t total)
+{
+	return "ERR PartialDelete " + std::to_string(failed) + " of " + std::to_string(total) +
+		   " objects not yet deleted on their file servers; retrying";
+}
+
 // Deletes a file or directory.
-// If a file is deleted, forward a "DELETE" command to the assigned file server (using basename).
+// If a file is deleted, it leaves the namespace first and its objects are then
+// deleted on their file servers through the pending deletes.
 // If a directory is deleted, recursively delete all files (by forwarding "DELETE" commands)
 // for each file that has a path prefix matching the directory.
+// As in createFile, files are reserved under the shard locks and the file servers
+// are contacted with no shard locked.
 std::string NamespaceServer::deletePath(const std::string &path)
 {
 	if (!isValidPath(path))
 		return "ERR InvalidPath";
 
-	std::lock_guard<std::mutex> lock(nsMutex);
 	bool found = false;
-
-	// Helper lambda to check if 'target' is the same as or a child (immediate or nested)
-	// of 'basePath' (e.g., "/foo" and "/foo/bar").
-	auto isUnderPath = [&](const std::string &target, const std::string &basePath) -> bool
-	{
-		if (target == basePath)
-			return true;
-		if (target.size() > basePath.size() && target.compare(0, basePath.size(), basePath) == 0 && target[basePath.size()] == '/')
-			return true;
-		return false;
-	};
+	bool isDirectory;
 
 	// 1. If the given path exactly matches a file, delete it using its hashed name.
-	if (fileMapping.find(path) != fileMapping.end())
+	std::string serverId;
+	ObjectId objectId;
+	FileLayout layout;
 	{
-		std::string serverId = fileMapping[path];
-		std::string hashedFileName = computeSHA256(path);
-		std::string fsResponse = forwardToFileServer("DELETE " + hashedFileName, serverId);
-		if (fsResponse != "OK")
-			return fsResponse;
-		fileMapping.erase(path);
-		found = true;
-	}
-
-	// 2. Recursively delete files that are under the given directory path.
-	std::vector<std::string> filesToDelete;
-	for (const auto &pair : fileMapping)
-	{
-		const std::string &filePath = pair.first;
-		if (isUnderPath(filePath, path))
+		std::unique_lock<std::shared_mutex> lock(shards[entryShard(path)].mutex);
+		NamespaceShard &shard = shards[entryShard(path)];
+		if (shard.index.fileServer(path, serverId, objectId, layout))
 		{
-			filesToDelete.push_back(filePath);
+			if (!shard.pending.insert(path).second)
+				return "ERR FileBusy";
+			found = true;
 		}
+		isDirectory = shard.index.hasDirectory(path);
 	}
-	for (const auto &f : filesToDelete)
+	if (!found && !isDirectory)
+		return "ERR NotFound";
+	if (found)
 	{
-		std::string serverId = fileMapping[f];
-		std::string hashedFileName = computeSHA256(f);
-		forwardToFileServer("DELETE " + hashedFileName, serverId);
-		fileMapping.erase(f);
-		found = true;
+		// Every server in the layout holds an object of the same name. One that is
+		// down or slow must not keep the file alive, or fail the delete once the file
+		// is gone, so the objects go through the pending deletes, as for a directory.
+		std::vector<std::string> objectServers = layout.servers.empty() ? std::vector<std::string>{serverId} : layout.servers;
+		std::vector<std::pair<std::string, std::string>> objects;
+		for (const auto &objectServer : objectServers)
+			objects.push_back({objectServer, objectName(objectId)});
+		{
+			std::lock_guard<std::mutex> pendingLock(pendingDeletesMutex);
+			for (const auto &[objectServer, hashedFileName] : objects)
+				pendingDeletes[{hashedFileName, objectServer}] = true;
+			savePendingDeletes();
+		}
+		bool committed;
+		{
+			std::unique_lock<std::shared_mutex> lock(shards[entryShard(path)].mutex);
+			shards[entryShard(path)].pending.erase(path);
+			committed = commit("-F " + path);
+		}
+		if (!committed)
+		{
+			// The file stays, so its objects must not be deleted.
+			std::lock_guard<std::mutex> pendingLock(pendingDeletesMutex);
+			for (const auto &[objectServer, hashedFileName] : objects)
+				pendingDeletes.erase({hashedFileName, objectServer});
+			savePendingDeletes();
+			return JOURNAL_FAILED;
+		}
+		std::vector<std::pair<std::string, std::string>> failed = deleteObjects(objects);
+		finishPendingDeletes(objects, failed);
+		for (const auto &objectServer : objectServers)
+			releasePlacement(objectServer);
+		if (!failed.empty())
+			return partialDelete(failed.size(), objects.size());
+		if (!isDirectory)
+			return "OK";
 	}
 
-	// 3. Recursively remove directory metadata.
-	std::vector<std::string> dirsToDelete;
-	for (const auto &d : directories)
+	// 2. Remove the files under the given directory path and the directory metadata
+	// in one step, so no new files can be created in the subtree. Only the shards the
+	// subtree spans are locked. They are found without holding them, so the subtree
+	// is walked again once they are held, and the set is grown until it covers it.
+	// Files already being created or deleted are left to that operation, and the
+	// directories above them stay, so such a file never outlives its parent; the
+	// delete then answers ERR FileBusy. The objects of the removed files are marked as
+	// pending deletes before their entries go, and the list is saved once the shards
+	// are released. A failed object delete only leaves the object to retry.
+	// If the journal fails, the files removed so far still have their objects
+	// deleted, and the rest of the subtree stays.
+	std::vector<std::pair<std::string, std::string>> objectsToDelete;
+	bool journalFailed = false;
+	std::set<std::string> keptDirs;
+	std::set<size_t> subtreeShards;
+	collectSubtreeShards(path, subtreeShards, nullptr);
 	{
-		if (isUnderPath(d, path) && d != "/") // Avoid deleting root if not intended
+		std::optional<ShardGuard> guard;
+		for (;;)
 		{
-			dirsToDelete.push_back(d);
+			std::vector<std::pair<size_t, bool>> requests = {{entryShard(path), true}};
+			for (size_t shard : subtreeShards)
+				requests.push_back({shard, true});
+			guard.emplace(shards, requests);
+			std::set<size_t> reached;
+			collectSubtreeShards(path, reached, &subtreeShards);
+			if (std::includes(subtreeShards.begin(), subtreeShards.end(), reached.begin(), reached.end()))
+				break;
+			guard.reset();
+			subtreeShards.insert(reached.begin(), reached.end());
 		}
-	}
-	for (const auto &d : dirsToDelete)
-	{
-		auto it = std::find(directories.begin(), directories.end(), d);
-		if (it != directories.end())
+		// Each file with the end of its objects in objectsToDelete.
+		std::vector<std::pair<std::string, size_t>> filesToDelete;
+		std::vector<std::string> dirsToDelete = {path};
+		visitSubtree(path, [&](const std::string &p, bool isDir, const std::string &fileServerId, const ObjectId *fileObjectId,
+							   const FileLayout &fileLayout)
+					 {
+			if (isDir)
+				dirsToDelete.push_back(p);
+			else if (shards[entryShard(p)].pending.count(p))
+			{
+				for (std::string d = getParentDirectory(p); keptDirs.insert(d).second && d != path;)
+					d = getParentDirectory(d);
+			}
+			else
+			{
+				if (fileLayout.servers.empty())
+					objectsToDelete.push_back({fileServerId, objectName(*fileObjectId)});
+				for (const auto &layoutServer : fileLayout.servers)
+					objectsToDelete.push_back({layoutServer, objectName(*fileObjectId)});
+				filesToDelete.push_back({p, objectsToDelete.size()});
+			} });
+		if (!objectsToDelete.empty())
 		{
-			directories.erase(it);
-			found = true;
+			std::lock_guard<std::mutex> lock(pendingDeletesMutex);
+			for (const auto &[fileServerId, hashedFileName] : objectsToDelete)
+				pendingDeletes[{hashedFileName, fileServerId}] = true;
+		}
+		size_t removedObjects = 0;
+		for (const auto &[f, objectsEnd] : filesToDelete)
+		{
+			if (!commit("-F " + f))
+			{
+				journalFailed = true;
+				break;
+			}
+			removedObjects = objectsEnd;
+		}
+		if (journalFailed)
+		{
+			std::lock_guard<std::mutex> lock(pendingDeletesMutex);
+			for (size_t i = removedObjects; i < objectsToDelete.size(); i++)
+				pendingDeletes.erase({objectsToDelete[i].second, objectsToDelete[i].first});
+			objectsToDelete.resize(removedObjects);
 		}
-		dirMapping.erase(d);
+
+		// A directory's entry and its mapping live in different shards. Children go
+		// before their parents, so a failure cannot leave a subtree without its root.
+		for (size_t i = dirsToDelete.size(); i > 0 && !journalFailed; i--)
+		{
+			const std::string &d = dirsToDelete[i - 1];
+			if (d == "/" || keptDirs.count(d)) // Avoid deleting root if not intended
+				continue;
+			std::string mappedServer;
+			if (entryIndex(d).hasDirectory(d))
+			{
+				journalFailed = !commit("-D " + d);
+				found = true;
+			}
+			if (!journalFailed && mappingIndex(d).directoryServer(d, mappedServer))
+			{
+				journalFailed = !commit("-M " + d);
+				found = true;
+			}
+		}
+	}
+	if (!objectsToDelete.empty() || journalFailed)
+	{
+		std::lock_guard<std::mutex> lock(pendingDeletesMutex);
+		savePendingDeletes();
 	}
+	if (objectsToDelete.empty())
+		return journalFailed ? JOURNAL_FAILED : !keptDirs.empty() ? "ERR FileBusy" : found ? "OK" : "ERR NotFound";
 
-	if (!found)
-		return "ERR NotFound";
+	// 3. Delete the objects on their servers. Failed ones stay pending.
+	std::vector<std::pair<std::string, std::string>> failed = deleteObjects(objectsToDelete);
+	finishPendingDeletes(objectsToDelete, failed);
+	for (const auto &object : objectsToDelete)
+		releasePlacement(object.first);
 
-	saveDirMapping();
-	saveMetadata();
+	if (journalFailed)
+		return JOURNAL_FAILED;
+	if (!keptDirs.empty())
+		return "ERR FileBusy";
+	if (!failed.empty())
+		return partialDelete(failed.size(), objectsToDelete.size());
 	return "OK";
 }
+// Calls fn(path, isDirectory, serverId, objectId, layout) for everything below a directory,
+// parents before their children. Each directory's children are read from its own
+// shard, so the cost is proportional to the subtree, not to the namespace. The
+// caller holds every shard the subtree can reach.
+void NamespaceServer::visitSubtree(const std::string &dir, const SubtreeVisitor &fn)
+{
+	std::vector<std::string> stack = {dir};
+	while (!stack.empty())
+	{
+		std::string current = std::move(stack.back());
+		stack.pop_back();
+		std::string prefix = current == "/" ? current : current + "/";
+		mappingIndex(current).forEachChild(current, [&](std::string_view name, bool isDirectory, const std::string &serverId,
+														const ObjectId *objectId, const FileLayout &layout)
+										   {
+			std::string child = prefix + std::string(name);
+			fn(child, isDirectory, serverId, objectId, layout);
+			if (isDirectory)
+				stack.push_back(std::move(child)); });
+	}
+}
+
+// Adds the shards a directory's subtree spans to result: the shard holding each
+// directory's children. With held set, only those shards are read, and the caller
+// holds them; otherwise each shard is locked shared while it is read.
+void NamespaceServer::collectSubtreeShards(const std::string &dir, std::set<size_t> &result, const std::set<size_t> *held)
+{
+	std::vector<std::string> stack = {dir};
+	while (!stack.empty())
+	{
+		std::string current = std::move(stack.back());
+		stack.pop_back();
+		size_t shard = shardFor(current);
+		result.insert(shard);
+		if (held && !held->count(shard))
+			continue;
+		std::shared_lock<std::shared_mutex> lock;
+		if (!held)
+			lock = std::shared_lock<std::shared_mutex>(shards[shard].mutex);
+		std::string prefix = current == "/" ? current : current + "/";
+		shards[shard].index.forEachChild(current, [&](std::string_view name, bool isDirectory, const std::string &,
+													 const ObjectId *, const FileLayout &)
+										 {
+			if (isDirectory)
+				stack.push_back(prefix + std::string(name)); });
+	}
+}
+
 // Forwards the given command to the appropriate file server.
 std::string NamespaceServer::forwardToFileServer(const std::string &cmd, const std::string &serverId)
 {
@@ -469,33 +1017,412 @@ std::string NamespaceServer::forwardToFileServer(const std::string &cmd, const s
 	return "ERR FileServerNotFound";
 }
 
-// Opens a socket connection to a file server, sends the request, and returns its response.
+// Sends the request to a file server over a pooled connection and returns its response.
 std::string NamespaceServer::sendRequestToServer(const std::string &ip, int port, const std::string &request)
 {
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0)
-		return "ERR SocketError";
-	struct sockaddr_in serv_addr;
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(port);
-	if (inet_pton(AF_INET, ip.c_str(), &serv_addr.sin_addr) <= 0)
+	return fsPool.request(ip, port, request);
+}
+
+// Deletes objects on their file servers. Each server gets its own sender thread,
+// which sends the server's objects in DELETE_MANY batches over a pooled connection.
+std::vector<std::pair<std::string, std::string>> NamespaceServer::deleteObjects(
+	const std::vector<std::pair<std::string, std::string>> &objects)
+{
+	std::map<std::string, std::vector<std::string>> byServer;
+	for (const auto &[serverId, name] : objects)
+		byServer[serverId].push_back(name);
+
+	std::mutex failedMutex;
+	std::vector<std::pair<std::string, std::string>> failed;
+	std::vector<std::thread> senders;
+	for (const auto &entry : byServer)
 	{
-		close(sockfd);
-		return "ERR InvalidAddress";
+		senders.emplace_back([this, &entry, &failedMutex, &failed]()
+							 {
+			const std::string &serverId = entry.first;
+			const std::vector<std::string> &names = entry.second;
+			std::vector<std::string> serverFailed;
+			for (size_t begin = 0; begin < names.size(); begin += DELETE_BATCH)
+			{
+				size_t end = std::min(names.size(), begin + DELETE_BATCH);
+				std::string request = "DELETE_MANY " + issueServerCapability();
+				for (size_t i = begin; i < end; i++)
+					request += " " + names[i];
+				std::string response = forwardToFileServer(request, serverId);
+				if (response == "OK")
+					continue;
+				if (response.compare(0, 16, "ERR DeleteFailed") == 0)
+				{
+					std::istringstream iss(response.substr(16));
+					std::string name;
+					while (iss >> name)
+						serverFailed.push_back(name);
+					continue;
+				}
+				// The server is unreachable or refused the request: leave the rest for a retry.
+				serverFailed.insert(serverFailed.end(), names.begin() + begin, names.end());
+				break;
+			}
+			std::lock_guard<std::mutex> lock(failedMutex);
+			for (const auto &name : serverFailed)
+				failed.push_back({serverId, name}); });
 	}
-	if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+	for (auto &sender : senders)
+		sender.join();
+	return failed;
+}
+
+bool NamespaceServer::isDeletePending(const std::string &objectName)
+{
+	std::lock_guard<std::mutex> lock(pendingDeletesMutex);
+	auto it = pendingDeletes.lower_bound({objectName, std::string()});
+	return it != pendingDeletes.end() && it->first.first == objectName;
+}
+
+// Pending deletes file: one "<serverId> <object name>" line per object.
+void NamespaceServer::loadPendingDeletes()
+{
+	std::ifstream in(pendingDeletesFilename);
+	std::string serverId, name;
+	while (in >> serverId >> name)
+		pendingDeletes[{name, serverId}] = false;
+}
+
+// Replaces a file through a temporary file, so a crash leaves either the old or
+// the new contents.
+static bool replaceFile(const std::string &filename, const std::string &data)
+{
+	std::string tmp = filename + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	bool ok = fd >= 0;
+	for (size_t written = 0; ok && written < data.size();)
 	{
-		close(sockfd);
-		return "ERR ConnectionFailed";
+		ssize_t n = write(fd, data.data() + written, data.size() - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		ok = n > 0;
+		written += ok ? n : 0;
+	}
+	ok = ok && fsync(fd) == 0;
+	if (fd >= 0)
+		close(fd);
+	return ok && rename(tmp.c_str(), filename.c_str()) == 0;
+}
+
+void NamespaceServer::savePendingDeletes()
+{
+	std::string data;
+	for (const auto &[object, inFlight] : pendingDeletes)
+		data += object.second + " " + object.first + "\n";
+	if (!replaceFile(pendingDeletesFilename, data))
+		std::cerr << "Failed to save pending deletes to " << pendingDeletesFilename << "\n";
+}
+
+void NamespaceServer::retryPendingDeletes()
+{
+	std::vector<std::pair<std::string, std::string>> objects;
+	{
+		std::lock_guard<std::mutex> lock(pendingDeletesMutex);
+		for (auto &[object, inFlight] : pendingDeletes)
+		{
+			if (!inFlight)
+			{
+				inFlight = true;
+				objects.push_back({object.second, object.first});
+			}
+		}
+	}
+	if (objects.empty())
+		return;
+	std::vector<std::pair<std::string, std::string>> failed = deleteObjects(objects);
+	finishPendingDeletes(objects, failed);
+	std::cout << "Retried " << objects.size() << " pending file server deletes, " << failed.size() << " still pending" << std::endl;
+}
+
+// Drops the pending deletes that were sent and did not fail; the failed ones
+// become eligible for the next retry.
+void NamespaceServer::finishPendingDeletes(const std::vector<std::pair<std::string, std::string>> &sent,
+										   const std::vector<std::pair<std::string, std::string>> &failed)
+{
+	std::set<std::pair<std::string, std::string>> stillPending(failed.begin(), failed.end());
+	std::lock_guard<std::mutex> lock(pendingDeletesMutex);
+	for (const auto &[serverId, name] : sent)
+	{
+		if (stillPending.count({serverId, name}))
+			pendingDeletes[{name, serverId}] = false;
+		else
+			pendingDeletes.erase({name, serverId});
+	}
+	savePendingDeletes();
+}
+
+const FileServer *NamespaceServer::findServer(const std::string &serverId) const
+{
+	for (const auto &fs : fileServers)
+	{
+		if (fs.serverId == serverId)
+			return &fs;
+	}
+	return nullptr;
+}
+
+// Server listening at "<ip>:<port>".
+const FileServer *NamespaceServer::findServerAt(const std::string &address) const
+{
+	for (const auto &fs : fileServers)
+	{
+		if (address == fs.ip + ":" + std::to_string(fs.port))
+			return &fs;
+	}
+	return nullptr;
+}
+
+// Reads are spread over the healthy replicas whose request rate is within a
+// quarter of the lowest, taking turns between them.
+bool NamespaceServer::replicaChain(const std::string &objectName, const FileLayout &layout,
+								   std::vector<const FileServer *> &chain, const FileServer *&reader)
+{
+	std::set<std::string> lagging;
+	{
+		std::lock_guard<std::mutex> lock(laggingMutex);
+		for (auto it = laggingReplicas.lower_bound({objectName, std::string()});
+			 it != laggingReplicas.end() && it->first.first == objectName; ++it)
+			lagging.insert(it->first.second);
+	}
+	std::vector<const FileServer *> behind;
+	chain.clear();
+	std::lock_guard<std::mutex> lock(placementMutex);
+	for (const auto &serverId : layout.servers)
+	{
+		const FileServer *fs = findServer(serverId);
+		if (!fs)
+			return false;
+		(fs->reachable && !lagging.count(serverId) ? chain : behind).push_back(fs);
+	}
+	reader = chain.empty() ? behind[0] : nullptr;
+	double lowest = 0;
+	for (size_t i = 0; i < chain.size(); i++)
+	{
+		if (i == 0 || chain[i]->requestRate < lowest)
+			lowest = chain[i]->requestRate;
+	}
+	size_t start = readRotation++;
+	for (size_t i = 0; i < chain.size() && !reader; i++)
+	{
+		const FileServer *fs = chain[(start + i) % chain.size()];
+		if (fs->requestRate <= lowest * 1.25)
+			reader = fs;
+	}
+	chain.insert(chain.end(), behind.begin(), behind.end());
+	return true;
+}
+
+// Lagging replicas file: one "<object name> <serverId> <source serverId> <since>" line per replica.
+void NamespaceServer::loadLaggingReplicas()
+{
+	std::ifstream in(laggingReplicasFilename);
+	std::string name, serverId, source;
+	long since;
+	while (in >> name >> serverId >> source >> since)
+		laggingReplicas[{name, serverId}] = {source, since};
+}
+
+void NamespaceServer::saveLaggingReplicas()
+{
+	std::string data;
+	for (const auto &[replica, lag] : laggingReplicas)
+		data += replica.first + " " + replica.second + " " + lag.source + " " + std::to_string(lag.since) + "\n";
+	if (!replaceFile(laggingReplicasFilename, data))
+		std::cerr << "Failed to save lagging replicas to " << laggingReplicasFilename << "\n";
+}
+
+// A replica that is already lagging keeps its first report.
+void NamespaceServer::markLagging(const std::string &objectName, const std::string &serverId, const std::string &source)
+{
+	std::lock_guard<std::mutex> lock(laggingMutex);
+	if (laggingReplicas.insert({{objectName, serverId}, {source, (long)std::time(nullptr)}}).second)
+		saveLaggingReplicas();
+}
+
+// LAGGING answers "OK <object> <ip>:<port> ..." with the replicas a file server
+// could not pass writes on to since it was last asked.
+void NamespaceServer::collectLaggingReplicas()
+{
+	for (const auto &fs : fileServers)
+	{
+		std::istringstream iss(sendRequestToServer(fs.ip, fs.port, "LAGGING " + issueServerCapability()));
+		std::string status, object, address;
+		iss >> status;
+		if (status != "OK")
+			continue;
+		while (iss >> object >> address)
+		{
+			const FileServer *target = findServerAt(address);
+			if (target && target != &fs)
+				markLagging(object, target->serverId, fs.serverId);
+		}
+	}
+}
+
+// A lagging replica is copied again once every capability issued before it was
+// reported has expired. Until then a client may still send a write to it ahead of
+// its source, which could race with the copy. Newer chains put it after its
+// source, where writes wait while the source holds the object for the copy. A
+// replica whose source is down or lagging itself waits; one whose object is gone
+// is dropped.
+void NamespaceServer::repairReplicas()
+{
+	std::vector<std::tuple<std::string, std::string, std::string>> due; // (object name, serverId, source)
+	{
+		std::lock_guard<std::mutex> lock(laggingMutex);
+		long now = std::time(nullptr);
+		for (const auto &[replica, lag] : laggingReplicas)
+		{
+			if (now >= lag.since + CAPABILITY_TTL && !laggingReplicas.count({replica.first, lag.source}))
+				due.emplace_back(replica.first, replica.second, lag.source);
+		}
+	}
+	size_t repaired = 0;
+	for (const auto &[name, serverId, source] : due)
+	{
+		const FileServer *target = findServer(serverId);
+		const FileServer *from = findServer(source);
+		if (!target || !from)
+			continue;
+		{
+			std::lock_guard<std::mutex> lock(placementMutex);
+			if (!target->reachable || !from->reachable)
+				continue;
+		}
+		std::string response = sendRequestToServer(from->ip, from->port, "REPLICATE " + name + " " + target->ip + ":" +
+																			 std::to_string(target->port) + " " + issueCapability(name, "rw"));
+		if (response != "OK" && response != "ERR FileNotFound")
+			continue;
+		std::lock_guard<std::mutex> lock(laggingMutex);
+		laggingReplicas.erase({name, serverId});
+		saveLaggingReplicas();
+		repaired++;
+	}
+	if (!due.empty())
+		std::cout << "Repaired " << repaired << " of " << due.size() << " lagging replicas" << std::endl;
+}
+
+// Resolves a file for direct I/O: the client then sends READ/WRITE straight to the
+// returned file server, presenting the capability. A striped file's answer adds
+// its stripe unit and the address of every stripe server, in stripe order:
+// "OK <ip> <port> <object> <capability> <stripeUnit> <ip>:<port> ...".
+// A replicated file's answer names the replica to read from, followed by stripe
+// unit 0 and the write chain (see replicaChain).
+std::string NamespaceServer::lookupFile(const std::string &path)
+{
+	if (!isValidPath(path))
+		return "ERR InvalidPath";
+	std::string serverId;
+	ObjectId objectId;
+	FileLayout layout;
+	{
+		std::shared_lock<std::shared_mutex> lock(shards[entryShard(path)].mutex);
+		if (!entryIndex(path).fileServer(path, serverId, objectId, layout))
+			return "ERR FileNotFound";
+	}
+	const FileServer *fs = findServer(serverId);
+	if (!fs)
+		return "ERR FileServerNotFound";
+	std::string hashedFileName = objectName(objectId);
+	std::vector<const FileServer *> chain;
+	if (layout.replicated())
+	{
+		if (!replicaChain(hashedFileName, layout, chain, fs))
+			return "ERR FileServerNotFound";
+		std::string response = "OK " + fs->ip + " " + std::to_string(fs->port) + " " + hashedFileName + " " +
+							   issueCapability(hashedFileName, "rw") + " 0";
+		for (const FileServer *replica : chain)
+			response += " " + replica->ip + ":" + std::to_string(replica->port);
+		return response;
+	}
+	std::string response = "OK " + fs->ip + " " + std::to_string(fs->port) + " " + hashedFileName + " " + issueCapability(hashedFileName, "rw");
+	if (layout.striped())
+	{
+		response += " " + std::to_string(layout.unit);
+		for (const auto &stripeServer : layout.servers)
+		{
+			const FileServer *stripe = findServer(stripeServer);
+			if (!stripe)
+				return "ERR FileServerNotFound";
+			response += " " + stripe->ip + ":" + std::to_string(stripe->port);
+		}
 	}
-	sendMessage(sockfd, request);
-	std::string response;
-	readMessage(sockfd, response);
-	close(sockfd);
 	return response;
 }
 
+// Reports the namespace size and the memory the index holds for it.
+std::string NamespaceServer::statistics()
+{
+	IndexMemoryUsage usage;
+	size_t directories = 0, files = 0;
+	for (auto &shard : shards)
+	{
+		std::shared_lock<std::shared_mutex> lock(shard.mutex);
+		IndexMemoryUsage part = shard.index.memoryUsage();
+		usage.entries += part.entries;
+		usage.nodeBytes += part.nodeBytes;
+		usage.nameBytes += part.nameBytes;
+		usage.tableBytes += part.tableBytes;
+		usage.objectBytes += part.objectBytes;
+		usage.uniqueNames += part.uniqueNames;
+		directories += shard.index.directoryCount();
+		files += shard.index.fileCount();
+	}
+	std::ostringstream oss;
+	oss << "shards=" << NAMESPACE_SHARDS << " directories=" << directories << " files=" << files
+		<< " names=" << usage.uniqueNames << " nodeBytes=" << usage.nodeBytes
+		<< " nameBytes=" << usage.nameBytes << " tableBytes=" << usage.tableBytes
+		<< " totalBytes=" << usage.total() << " bytesPerEntry="
+		<< (usage.entries ? usage.total() / usage.entries : 0);
+	return oss.str();
+}
+
+// Handles a binary protocol request. The response payload carries the same text a
+// text-protocol client would get. Binary clients do their I/O on the file servers,
+// so READ and WRITE are not accepted here.
+std::string NamespaceServer::handleBinaryRequest(const std::string &frame)
+{
+	BinaryMessage msg;
+	if (!decodeMessage(frame, msg))
+		return encodeResponse(msg.header, STATUS_ERROR, "ERR MalformedMessage");
+	std::string path(msg.path);
+	if (msg.header.opcode != OP_LOGIN)
+		canonicalize(path);
+	std::string result;
+	switch (msg.header.opcode)
+	{
+	case OP_LOGIN:
+		result = authenticate(path, std::string(msg.payload)) ? "OK" : "ERR InvalidCredentials";
+		break;
+	case OP_LIST:
+		result = listDirectory(path);
+		break;
+	case OP_CREATE_FILE:
+		// length: stripe unit, offset: number of stripe servers.
+		result = createFile(path, msg.header.length, msg.header.offset);
+		break;
+	case OP_MKDIR:
+		result = makeDirectory(path);
+		break;
+	case OP_DELETE:
+		result = deletePath(path);
+		break;
+	case OP_LOOKUP:
+		result = lookupFile(path);
+		break;
+	default:
+		result = "ERR UnknownCommand";
+		break;
+	}
+	uint8_t status = (result.compare(0, 4, "ERR ") == 0) ? STATUS_ERROR : STATUS_OK;
+	return encodeResponse(msg.header, status, result);
+}
+
 // Parses and handles an incoming request, dispatching to the appropriate operation.
 std::string NamespaceServer::handleRequest(const std::string &request)
 {
@@ -512,18 +1439,21 @@ std::string NamespaceServer::handleRequest(const std::string &request)
 	{
 		std::string path;
 		iss >> path;
-		if (!isValidPath(path))
+		if (!canonicalize(path))
 			return "ERR InvalidPath";
 		// std::string listing = listDirectory(path);
 		return listDirectory(path);
 	}
 	else if (command == "CREATE_FILE")
 	{
+		// CREATE_FILE <path> [<stripeUnit> [<stripeCount>]]
 		std::string path;
-		iss >> path;
-		if (!isValidPath(path))
+		uint32_t stripeUnit = 0;
+		size_t stripeCount = 0;
+		iss >> path >> stripeUnit >> stripeCount;
+		if (!canonicalize(path))
 			return "ERR InvalidPath";
-		std::string result = createFile(path);
+		std::string result = createFile(path, stripeUnit, stripeCount);
 		return result;
 		// if (result.substr(0, 3) != "OK ")
 		// 	return result;
@@ -544,7 +1474,6 @@ std::string NamespaceServer::handleRequest(const std::string &request)
 		// 				break;
 		// 			}
 		// 		}
-		// 		saveMetadata();
 		// 	}
 		// 	return fsResponse;
 		// }
@@ -553,7 +1482,7 @@ std::string NamespaceServer::handleRequest(const std::string &request)
 	{
 		std::string path;
 		iss >> path;
-		if (!isValidPath(path))
+		if (!canonicalize(path))
 			return "ERR InvalidPath";
 		std::string result = makeDirectory(path);
 		if (result != "OK")
@@ -567,7 +1496,7 @@ std::string NamespaceServer::handleRequest(const std::string &request)
 	{
 		std::string path;
 		iss >> path;
-		if (!isValidPath(path))
+		if (!canonicalize(path))
 			return "ERR InvalidPath";
 		return deletePath(path);
 	}
@@ -576,51 +1505,330 @@ std::string NamespaceServer::handleRequest(const std::string &request)
 		std::string path;
 		size_t offset, length;
 		iss >> path >> offset >> length;
-		if (!isValidPath(path))
+		if (!canonicalize(path))
 			return "ERR InvalidPath";
-		auto it = fileMapping.find(path);
-		if (it == fileMapping.end())
-			return "ERR FileNotFound";
-		std::string serverId = it->second;
-		// Compute the unique hash for the file
-		std::string hashedFileName = computeSHA256(path);
-		return forwardToFileServer("READ " + hashedFileName + " " + std::to_string(offset) + " " + std::to_string(length), serverId);
+		std::string serverId;
+		ObjectId objectId;
+		FileLayout layout;
+		{
+			std::shared_lock<std::shared_mutex> lock(shards[entryShard(path)].mutex);
+			if (!entryIndex(path).fileServer(path, serverId, objectId, layout))
+				return "ERR FileNotFound";
+		}
+		// Striped data is spread over several servers; clients reach it through LOOKUP.
+		if (layout.striped())
+			return "ERR StripedFile";
+		std::string hashedFileName = objectName(objectId);
+		std::string capability = issueCapability(hashedFileName, "r");
+		std::string request = "READ " + hashedFileName + " " + std::to_string(offset) + " " + std::to_string(length) + " " + capability;
+		std::vector<const FileServer *> chain;
+		const FileServer *reader;
+		if (layout.replicated() && replicaChain(hashedFileName, layout, chain, reader))
+			return sendRequestToServer(reader->ip, reader->port, request);
+		return forwardToFileServer(request, serverId);
 	}
 	else if (command == "WRITE")
 	{
 		std::string path;
 		size_t offset;
 		iss >> path >> offset;
-		if (!isValidPath(path))
+		if (!canonicalize(path))
 			return "ERR InvalidPath";
 		std::string data;
 		std::getline(iss >> std::ws, data);
 		std::cout<<"Data received for write operation: "<<data<<std::endl;
-		auto it = fileMapping.find(path);
-		if (it == fileMapping.end())
-			return "ERR FileNotFound";
-		std::string serverId = it->second;
-		// Use the computed hash for the file identifier
-		std::string hashedFileName = computeSHA256(path);
-		return forwardToFileServer("WRITE " + hashedFileName + " " + std::to_string(offset) + " " + data, serverId);
+		std::string serverId;
+		ObjectId objectId;
+		FileLayout layout;
+		{
+			std::shared_lock<std::shared_mutex> lock(shards[entryShard(path)].mutex);
+			if (!entryIndex(path).fileServer(path, serverId, objectId, layout))
+				return "ERR FileNotFound";
+		}
+		// Striped data is spread over several servers; clients reach it through LOOKUP.
+		if (layout.striped())
+			return "ERR StripedFile";
+		std::string hashedFileName = objectName(objectId);
+		std::string capability = issueCapability(hashedFileName, "w");
+		std::vector<const FileServer *> chain;
+		const FileServer *reader;
+		if (layout.replicated() && replicaChain(hashedFileName, layout, chain, reader))
+		{
+			// The head of the chain passes the write on to the other replicas.
+			std::string target = hashedFileName;
+			for (size_t i = 1; i < chain.size(); i++)
+				target += CHAIN_SEPARATOR + chain[i]->ip + ":" + std::to_string(chain[i]->port);
+			return sendRequestToServer(chain[0]->ip, chain[0]->port,
+									   "WRITE " + target + " " + std::to_string(offset) + " " + capability + " " + data);
+		}
+		return forwardToFileServer("WRITE " + hashedFileName + " " + std::to_string(offset) + " " + capability + " " + data, serverId);
 	}
+	else if (command == "LOOKUP")
+	{
+		std::string path;
+		iss >> path;
+		canonicalize(path);
+		return lookupFile(path);
+	}
+	else if (command == "STATS")
+		return "OK " + statistics();
 	else
 		return "ERR UnknownCommand";
 }
 
+// Accepts every pending connection on the listening socket and registers it with epoll.
+void NamespaceServer::acceptConnections(int listenFd, int epfd)
+{
+	while (true)
+	{
+		struct sockaddr_in cli_addr;
+		socklen_t clilen = sizeof(cli_addr);
+		int fd = accept(listenFd, (struct sockaddr *)&cli_addr, &clilen);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				std::cerr << "Error on accept: " << strerror(errno) << "\n";
+			return;
+		}
+		setNonBlocking(fd);
+		// Pipelined responses must not wait on Nagle for an ACK of the previous one.
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			close(fd);
+			continue;
+		}
+		Connection &conn = connections[fd];
+		conn.fd = fd;
+		conn.id = nextConnId++;
+	}
+}
+
+// Past its backlog limits a connection is not read from, so one client pipelining
+// requests faster than it takes the answers cannot fill the task queue or the
+// server's memory.
+static bool backlogged(const Connection &conn)
+{
+	return conn.nextSeq - conn.nextToSend >= MAX_OUTSTANDING_REQUESTS ||
+		   conn.outBuf.size() - conn.outPos >= MAX_BUFFERED_OUTPUT;
+}
+
+// Reads the socket into the connection's input buffer and answers the complete
+// requests, until the connection is backlogged or the socket is empty.
+// Returns false if the connection should be closed.
+bool NamespaceServer::handleReadable(Connection &conn)
+{
+	char buf[65536];
+	while (!backlogged(conn))
+	{
+		ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+		if (n > 0)
+		{
+			conn.inBuf.append(buf, n);
+			if (!dispatchRequests(conn))
+				return false;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+	return true;
+}
+
+// Hands the buffered requests to the worker pool while the connection is under its
+// backlog limits, and writes the responses that are ready. Also run as responses
+// drain, to pick up requests left buffered when the connection was backlogged.
+// Returns false if the connection should be closed.
+bool NamespaceServer::dispatchRequests(Connection &conn)
+{
+	// Only the binary handshake is answered here, because it changes how the
+	// following frames on this connection are parsed.
+	std::string message;
+	int extracted = 0;
+	while (!backlogged(conn) && (extracted = extractMessage(conn.inBuf, conn.inPos, message, maxMessageSize)) > 0)
+	{
+		uint64_t seq = conn.nextSeq++;
+		if (!conn.binary && message == BINARY_HELLO)
+		{
+			conn.binary = true;
+			conn.ready[seq] = BINARY_ACCEPT;
+			continue;
+		}
+		if (!conn.binary)
+			std::cout << "Received: " << message << "\n";
+		taskQueue.push({conn.fd, conn.id, seq, conn.binary, std::move(message)});
+	}
+	// Drop consumed bytes so the buffer only holds unread frames.
+	conn.inBuf.erase(0, conn.inPos);
+	conn.inPos = 0;
+	queueResponses(conn);
+	// Nothing after an oversized frame can be parsed, so the connection is closed.
+	if (extracted < 0)
+	{
+		std::cerr << "Closing connection " << conn.id << ": message exceeds " << maxMessageSize << " bytes\n";
+		return false;
+	}
+	return flushWrites(conn);
+}
+
+// Moves finished responses into the output buffer, in the order the requests arrived.
+void NamespaceServer::queueResponses(Connection &conn)
+{
+	for (auto it = conn.ready.begin(); it != conn.ready.end() && it->first == conn.nextToSend; it = conn.ready.erase(it))
+	{
+		appendMessage(conn.outBuf, it->second);
+		conn.nextToSend++;
+	}
+}
+
+// Computes the response to one request. Runs on a worker thread.
+std::string NamespaceServer::processTask(const Task &task)
+{
+	if (task.binary)
+		return handleBinaryRequest(task.frame);
+	uint32_t id;
+	std::string body;
+	if (untagMessage(task.frame, id, body))
+		return tagMessage(id, handleRequest(body));
+	return handleRequest(task.frame);
+}
+
+void NamespaceServer::workerLoop()
+{
+	while (true)
+	{
+		Task task = taskQueue.pop();
+		lastCommitted = 0;
+		Completion done{task.fd, task.connId, task.seq, processTask(task), 0};
+		done.journalSequence = lastCommitted;
+		{
+			std::lock_guard<std::mutex> lock(completionMutex);
+			completions.push_back(std::move(done));
+		}
+		uint64_t one = 1;
+		ssize_t ignored = write(wakeFd, &one, sizeof(one));
+		(void)ignored;
+	}
+}
+
+// Hands responses posted by the workers to their connections. A response for a
+// connection that has closed, or whose fd now belongs to a new one, is dropped.
+// A mutation is only answered once its journal records are on disk; the journal
+// wakes the loop after every group commit. A later read may already see the
+// change, as it is applied in memory when it is committed.
+void NamespaceServer::drainCompletions(int epfd)
+{
+	uint64_t count;
+	ssize_t ignored = read(wakeFd, &count, sizeof(count));
+	(void)ignored;
+	std::vector<Completion> done;
+	{
+		std::lock_guard<std::mutex> lock(completionMutex);
+		done.swap(completions);
+	}
+	uint64_t synced = journal.syncedSequence();
+	std::vector<Completion> held;
+	for (auto &c : awaitingSync)
+		(c.journalSequence > synced ? held : done).push_back(std::move(c));
+	awaitingSync.clear();
+	std::vector<int> touched;
+	for (auto &c : done)
+	{
+		if (c.journalSequence > synced)
+		{
+			held.push_back(std::move(c));
+			continue;
+		}
+		auto it = connections.find(c.fd);
+		if (it == connections.end() || it->second.id != c.connId)
+			continue;
+		it->second.ready[c.seq] = std::move(c.response);
+		touched.push_back(c.fd);
+	}
+	for (int fd : touched)
+	{
+		auto it = connections.find(fd);
+		if (it == connections.end())
+			continue;
+		Connection &conn = it->second;
+		queueResponses(conn);
+		if (flushWrites(conn) && dispatchRequests(conn))
+			updateInterest(epfd, conn);
+		else
+			closeConnection(epfd, fd);
+	}
+	awaitingSync.swap(held);
+}
+
+// Writes as much buffered output as the socket accepts without blocking.
+// Returns false if the connection should be closed.
+bool NamespaceServer::flushWrites(Connection &conn)
+{
+	while (conn.outPos < conn.outBuf.size())
+	{
+		ssize_t n = send(conn.fd, conn.outBuf.data() + conn.outPos, conn.outBuf.size() - conn.outPos, MSG_NOSIGNAL);
+		if (n > 0)
+		{
+			conn.outPos += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		return false;
+	}
+	conn.outBuf.clear();
+	conn.outPos = 0;
+	return true;
+}
+
+// Subscribes to EPOLLIN only while the connection is not backlogged, and to
+// EPOLLOUT only while it has output pending.
+void NamespaceServer::updateInterest(int epfd, Connection &conn)
+{
+	bool reading = !backlogged(conn);
+	bool pending = conn.outPos < conn.outBuf.size();
+	if (reading == conn.wantRead && pending == conn.wantWrite)
+		return;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (reading ? EPOLLIN : 0) | (pending ? EPOLLOUT : 0);
+	ev.data.fd = conn.fd;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+	conn.wantRead = reading;
+	conn.wantWrite = pending;
+}
+
+void NamespaceServer::closeConnection(int epfd, int fd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	connections.erase(fd);
+}
+
 // Runs the Namespace Server on the given port using the length-prefixed protocol.
-void NamespaceServer::run(int port)
+// A single epoll loop multiplexes all client connections over non-blocking sockets
+// and hands each request to a pool of workers, which run concurrently under the
+// shard locks.
+void NamespaceServer::run(int port, int numThreads)
 {
-	int sockfd, newsockfd;
-	struct sockaddr_in serv_addr, cli_addr;
-	socklen_t clilen;
+	struct sockaddr_in serv_addr;
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 	if (sockfd < 0)
 	{
 		std::cerr << "Error opening socket\n";
 		return;
 	}
+	int reuse = 1;
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 	memset((char *)&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_addr.s_addr = INADDR_ANY;
@@ -632,26 +1840,84 @@ void NamespaceServer::run(int port)
 		close(sockfd);
 		return;
 	}
-	listen(sockfd, 5);
-	std::cout << "Namespace Server running on port " << port << "\n";
+	listen(sockfd, SOMAXCONN);
+	setNonBlocking(sockfd);
 
-	clilen = sizeof(cli_addr);
+	int epfd = epoll_create1(0);
+	if (epfd < 0)
+	{
+		std::cerr << "Error creating epoll instance\n";
+		close(sockfd);
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = sockfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	journal.setSyncListener([this]()
+							{
+		uint64_t one = 1;
+		ssize_t ignored = write(wakeFd, &one, sizeof(one));
+		(void)ignored; });
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = wakeFd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < numThreads; i++)
+		workers.emplace_back(&NamespaceServer::workerLoop, this);
+	std::cout << "Namespace Server running on port " << port << " with " << numThreads << " worker threads\n";
+
+	const int maxEvents = 1024;
+	struct epoll_event events[maxEvents];
 	while (true)
 	{
-		newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-		if (newsockfd < 0)
+		int n = epoll_wait(epfd, events, maxEvents, -1);
+		if (n < 0)
 		{
-			std::cerr << "Error on accept\n";
-			continue;
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Error on epoll_wait: " << strerror(errno) << "\n";
+			break;
 		}
-		std::string message;
-		while (readMessage(newsockfd, message) > 0)
+		for (int i = 0; i < n; i++)
 		{
-			std::cout << "Received: " << message << "\n";
-			std::string response = handleRequest(message);
-			sendMessage(newsockfd, response);
+			int fd = events[i].data.fd;
+			if (fd == sockfd)
+			{
+				acceptConnections(sockfd, epfd);
+				continue;
+			}
+			if (fd == wakeFd)
+			{
+				drainCompletions(epfd);
+				continue;
+			}
+			auto it = connections.find(fd);
+			if (it == connections.end())
+				continue;
+			Connection &conn = it->second;
+			// A hung-up connection is reported even while it is not read from, and
+			// nothing more can be delivered on it.
+			bool open = !(events[i].events & (EPOLLHUP | EPOLLERR));
+			if (open && (events[i].events & EPOLLIN))
+				open = handleReadable(conn);
+			if (open && (events[i].events & EPOLLOUT))
+				open = flushWrites(conn) && dispatchRequests(conn);
+			if (open)
+				updateInterest(epfd, conn);
+			else
+				closeConnection(epfd, fd);
 		}
-		close(newsockfd);
 	}
+	// Workers stay blocked on the queue; they end with the process.
+	for (auto &worker : workers)
+		worker.detach();
+	close(wakeFd);
+	close(epfd);
 	close(sockfd);
 }
@@ -4,26 +4,103 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <mutex>
+#include <shared_mutex>
+#include "../common/connection_pool.h"
+#include "../common/work_queue.h"
+#include "MetadataJournal.h"
+#include "MetadataSnapshot.h"
+#include "NamespaceIndex.h"
+#include "PlacementPolicy.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
 
-// Structure to represent a file server.
-struct FileServer
+// A connection with this many requests unanswered, or this much output the
+// socket has not accepted, is not read from until it drains. Requests already
+// buffered wait in inBuf.
+const uint64_t MAX_OUTSTANDING_REQUESTS = 64;
+const size_t MAX_BUFFERED_OUTPUT = 4 * 1024 * 1024;
+
+// Per-client state for the event loop: buffered input awaiting a full frame
+// and buffered output the socket has not accepted yet.
+struct Connection
+{
+	int fd;
+	uint64_t id = 0; // Distinguishes connections that reuse the same fd.
+	std::string inBuf;
+	size_t inPos = 0;
+	std::string outBuf;
+	size_t outPos = 0;
+	bool wantRead = true;
+	bool wantWrite = false;
+	bool binary = false; // Switched on by the BINARY_HELLO handshake.
+	// Requests are numbered as they are read. Workers may finish them out of order,
+	// so responses wait in 'ready' until every earlier one has been written.
+	uint64_t nextSeq = 0;
+	uint64_t nextToSend = 0;
+	std::map<uint64_t, std::string> ready;
+};
+
+// A request handed from the event loop to a worker thread.
+struct Task
+{
+	int fd;
+	uint64_t connId;
+	uint64_t seq;
+	bool binary;
+	std::string frame;
+};
+
+// A worker's response on its way back to the event loop.
+struct Completion
+{
+	int fd;
+	uint64_t connId;
+	uint64_t seq;
+	std::string response;
+	// Journal sequence number of the last record the request committed; the
+	// response is held until the journal has synced it. 0 if it committed none.
+	uint64_t journalSequence;
+};
+
+// One slice of the namespace with its own reader/writer lock. An entry lives in
+// the shard of its parent directory, and a directory's file server mapping in its
+// own shard, so a directory's children and mapping are always together.
+struct NamespaceShard
 {
-	std::string serverId;
-	std::string ip;
-	int port;
-	int fileCount;
+	std::shared_mutex mutex;
+	NamespaceIndex index;
+	// Files with a create or delete waiting on their file server. They are
+	// reserved here while the shard is unlocked for the file server round trip.
+	std::unordered_set<std::string> pending;
 };
 
+const size_t NAMESPACE_SHARDS = 64;
+
 class NamespaceServer
 {
 public:
-	// Constructor: accepts file paths for metadata.
+	// Constructor: accepts the binary metadata snapshot, the text metadata files it is
+	// converted from on first start, the journal of changes since the last snapshot,
+	// the list of file server deletes still to be done and the replicas still to be
+	// repaired. A file server that does not answer within fileServerTimeoutMs
+	// counts as unreachable. Messages in either direction are limited to
+	// maxMessageSize bytes.
 	NamespaceServer(const std::string &dirFile, const std::string &fileFile,
-					const std::string &userFile, const std::string &dirMapFile);
+					const std::string &userFile, const std::string &dirMapFile,
+					const std::string &snapshotFile, const std::string &journalFile,
+					const std::string &pendingDeletesFile, const std::string &laggingReplicasFile,
+					const std::string &placementPolicy, size_t replicas,
+					const JournalOptions &journalOptions = JournalOptions(), int fileServerTimeoutMs = 10000,
+					size_t maxMessageSize = MAX_MESSAGE_SIZE);
+	~NamespaceServer();
 
-	// Runs the server on the given port.
-	void run(int port);
+	// Runs the server on the given port with a pool of worker threads.
+	void run(int port, int numThreads = 4);
 
 private:
 	// Filenames for metadata.
@@ -31,40 +108,163 @@ private:
 	std::string fileFilename;
 	std::string userFilename;
 	std::string dirMapFilename;
+	std::string snapshotFilename;
 
-	// In-memory metadata.
-	std::vector<std::string> directories;
-	std::map<std::string, std::string> fileMapping;
+	// In-memory metadata. Users are only read after startup.
+	NamespaceShard shards[NAMESPACE_SHARDS];
 	std::map<std::string, std::string> users;
-	std::map<std::string, std::string> dirMapping;
+	size_t shardFor(const std::string &dir) const;
+	// Shard of a directory or file entry, and of a directory's mapping and children.
+	size_t entryShard(const std::string &path) const { return shardFor(getParentDirectory(path)); }
+	NamespaceIndex &entryIndex(const std::string &path) { return shards[entryShard(path)].index; }
+	NamespaceIndex &mappingIndex(const std::string &dir) { return shards[shardFor(dir)].index; }
 
-	// Hard-coded file servers.
+	// Hard-coded file servers. placementMutex guards their file counts and load, and
+	// the placement policy that reads them.
 	std::vector<FileServer> fileServers;
+	std::mutex placementMutex;
+	std::unique_ptr<PlacementPolicy> placement;
+	void releasePlacement(const std::string &serverId);
+	// Counts each server's files in the metadata.
+	void countPlacedFiles();
+	// Asks every file server for its STATS and records its load.
+	std::chrono::steady_clock::time_point loadRefreshedAt;
+	void refreshServerLoad();
+	const FileServer *findServer(const std::string &serverId) const;
+	const FileServer *findServerAt(const std::string &address) const;
+
+	// Copies kept of each new file that is not striped. The replicas go on the
+	// servers that follow the placed one.
+	size_t replicas;
+	// Takes turns between replicas with about the same load.
+	std::atomic<size_t> readRotation{0};
+	// Orders a replicated file's servers for writes: healthy replicas in layout
+	// order, then those that are lagging or do not answer STATS. reader is the
+	// healthy replica with the least load, which its reads go to.
+	bool replicaChain(const std::string &objectName, const FileLayout &layout,
+					  std::vector<const FileServer *> &chain, const FileServer *&reader);
 
-	// Mutex to protect metadata.
-	std::mutex nsMutex;
+	// Longest message read from a client or a file server; a longer client frame
+	// closes the connection.
+	size_t maxMessageSize;
+	// Keep-alive connections to the file servers, reused across forwarded requests.
+	// Sends and receives time out, so a hung file server cannot hold a worker.
+	ConnectionPool fsPool;
 
-	// Metadata load/save functions.
+	// Metadata load functions.
+	bool loadSnapshot();
 	void loadMetadata();
-	void saveMetadata();
 	void loadDirMapping();
-	void saveDirMapping();
+	void loadUsers();
+
+	// Mutations are appended to the journal instead of rewriting the metadata files.
+	// Caller holds the affected shard exclusively for commit() and applyRecord().
+	// commit() returns false, and changes nothing, if the journal write failed; the
+	// request is then answered with JOURNAL_FAILED.
+	MetadataJournal journal;
+	bool commit(const std::string &record);
+	void applyRecord(const std::string &record);
+
+	// Periodic checkpoints fold the journal into freshly written metadata files.
+	std::thread checkpointThread;
+	std::atomic<bool> stopping{false};
+	void checkpointLoop();
+	void checkpoint(bool force = false);
+	bool writeSnapshot(std::vector<SnapshotRecord> records);
 
 	// Authentication.
 	bool authenticate(const std::string &username, const std::string &password);
 
 	// Filesystem operations.
 	std::string listDirectory(const std::string &path);
-	std::string createFile(const std::string &path);
+	std::string createFile(const std::string &path, uint32_t stripeUnit = 0, size_t stripeCount = 0);
 	std::string makeDirectory(const std::string &path);
 	std::string deletePath(const std::string &path);
+	std::string lookupFile(const std::string &path);
+
+	// Subtree enumeration for recursive operations; see visitSubtree().
+	typedef std::function<void(const std::string &path, bool isDirectory, const std::string &serverId,
+							   const ObjectId *objectId, const FileLayout &layout)>
+		SubtreeVisitor;
+	void visitSubtree(const std::string &dir, const SubtreeVisitor &fn);
+	void collectSubtreeShards(const std::string &dir, std::set<size_t> &result, const std::set<size_t> *held);
+	std::string statistics();
 
 	// File server forwarding.
 	std::string forwardToFileServer(const std::string &cmd, const std::string &serverId);
 	std::string sendRequestToServer(const std::string &ip, int port, const std::string &request);
 
+	// Objects removed from the namespace whose file server has not confirmed the
+	// delete yet, by object name, with the server that stores them. The list is
+	// saved to pendingDeletesFilename and retried by the checkpoint thread, and the
+	// names cannot be created again until they are gone.
+	// Keyed by (object name, serverId), since a striped file has an object of the
+	// same name on each of its servers. The value is set while a request is
+	// sending the delete, and the retry then skips it.
+	std::string pendingDeletesFilename;
+	std::mutex pendingDeletesMutex;
+	std::map<std::pair<std::string, std::string>, bool> pendingDeletes;
+	void loadPendingDeletes();
+	// Caller holds pendingDeletesMutex.
+	void savePendingDeletes();
+	bool isDeletePending(const std::string &objectName);
+	// Deletes (serverId, objectName) pairs with batched DELETE_MANY requests, one
+	// sender per file server, all in parallel. Returns the pairs that failed.
+	std::vector<std::pair<std::string, std::string>> deleteObjects(const std::vector<std::pair<std::string, std::string>> &objects);
+	// Retries pendingDeletes and drops the ones that succeed.
+	void retryPendingDeletes();
+	void finishPendingDeletes(const std::vector<std::pair<std::string, std::string>> &sent,
+							  const std::vector<std::pair<std::string, std::string>> &failed);
+
+	// Replicas that missed a write or a create, keyed by (object name, serverId).
+	// The file servers that could not reach them report them (LAGGING); source is
+	// the reporting server, which has the data, and since is when the report came
+	// in (Unix time). A lagging replica serves no reads and goes last in the write
+	// chain until the source has copied the object to it again (REPLICATE). The
+	// list is saved to laggingReplicasFilename.
+	struct LaggingReplica
+	{
+		std::string source;
+		long since;
+	};
+	std::string laggingReplicasFilename;
+	std::mutex laggingMutex;
+	std::map<std::pair<std::string, std::string>, LaggingReplica> laggingReplicas;
+	void loadLaggingReplicas();
+	// Caller holds laggingMutex.
+	void saveLaggingReplicas();
+	void markLagging(const std::string &objectName, const std::string &serverId, const std::string &source);
+	// Asks every file server for the replicas it could not reach.
+	void collectLaggingReplicas();
+	// Copies lagging replicas again from their sources.
+	void repairReplicas();
+
 	// Request handling.
 	std::string handleRequest(const std::string &request);
+	std::string handleBinaryRequest(const std::string &frame);
+
+	// Event loop state and helpers.
+	std::unordered_map<int, Connection> connections;
+	uint64_t nextConnId = 1;
+	void acceptConnections(int listenFd, int epfd);
+	bool handleReadable(Connection &conn);
+	bool dispatchRequests(Connection &conn);
+	bool flushWrites(Connection &conn);
+	void updateInterest(int epfd, Connection &conn);
+	void closeConnection(int epfd, int fd);
+
+	// Worker pool: the event loop queues requests; workers post responses back and
+	// wake the loop through an eventfd.
+	BoundedQueue<Task> taskQueue{1024};
+	std::mutex completionMutex;
+	std::vector<Completion> completions;
+	// Completions whose records are not synced yet. Event loop only.
+	std::vector<Completion> awaitingSync;
+	int wakeFd = -1;
+	void workerLoop();
+	std::string processTask(const Task &task);
+	void drainCompletions(int epfd);
+	void queueResponses(Connection &conn);
 };
 
 #endif // NAMESPACESERVER_H
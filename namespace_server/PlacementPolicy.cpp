@@ -0,0 +1,145 @@
+#include "PlacementPolicy.h"
+#include <algorithm>
+#include <climits>
+
+// Servers with no STATS answer are skipped while any other server is reachable.
+static bool usable(const std::vector<FileServer> &servers, size_t i)
+{
+	if (servers[i].reachable)
+		return true;
+	for (const auto &fs : servers)
+	{
+		if (fs.reachable)
+			return false;
+	}
+	return true;
+}
+
+// Keeps each directory on one server: the one with the fewest files.
+class DirectoryPolicy : public PlacementPolicy
+{
+public:
+	const char *name() const override { return "directory"; }
+	bool perDirectory() const override { return true; }
+
+	size_t place(const ObjectId &, const std::vector<FileServer> &servers) override
+	{
+		size_t best = 0;
+		int minCount = INT_MAX;
+		for (size_t i = 0; i < servers.size(); i++)
+		{
+			if (usable(servers, i) && servers[i].fileCount < minCount)
+			{
+				minCount = servers[i].fileCount;
+				best = i;
+			}
+		}
+		return best;
+	}
+};
+
+// 64-bit FNV-1a followed by a finalizer, so that similar server names spread out.
+static uint64_t ringHash(const std::string &key)
+{
+	uint64_t h = 1469598103934665603ULL;
+	for (unsigned char c : key)
+	{
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Places each file on the first server clockwise from its object id on a ring
+// holding VIRTUAL_NODES points per server. Files of one directory spread over every
+// server, and adding a server moves only the files that now hash to it.
+class ConsistentHashPolicy : public PlacementPolicy
+{
+public:
+	static const int VIRTUAL_NODES = 128;
+
+	explicit ConsistentHashPolicy(const std::vector<FileServer> &servers)
+	{
+		for (size_t i = 0; i < servers.size(); i++)
+		{
+			for (int v = 0; v < VIRTUAL_NODES; v++)
+				ring.push_back({ringHash(servers[i].serverId + "#" + std::to_string(v)), i});
+		}
+		std::sort(ring.begin(), ring.end());
+	}
+
+	const char *name() const override { return "hash"; }
+
+	size_t place(const ObjectId &objectId, const std::vector<FileServer> &servers) override
+	{
+		// The object id is a SHA-256, so its first bytes are already uniform.
+		uint64_t key = 0;
+		for (int i = 0; i < 8; i++)
+			key = (key << 8) | objectId[i];
+		auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(key, (size_t)0));
+		for (size_t step = 0; step < ring.size(); step++, ++it)
+		{
+			if (it == ring.end())
+				it = ring.begin();
+			if (usable(servers, it->second))
+				return it->second;
+		}
+		return 0;
+	}
+
+private:
+	std::vector<std::pair<uint64_t, size_t>> ring; // (point, server index), sorted
+};
+
+// Places each file on the server with the least load, where load is the sum of the
+// server's share of files, of bytes stored and of recent requests. File counts move
+// with every placement; bytes and request rates come from the periodic STATS.
+class LoadAwarePolicy : public PlacementPolicy
+{
+public:
+	const char *name() const override { return "load"; }
+
+	size_t place(const ObjectId &, const std::vector<FileServer> &servers) override
+	{
+		double totalFiles = 0, totalBytes = 0, totalRate = 0;
+		for (const auto &fs : servers)
+		{
+			totalFiles += fs.fileCount;
+			totalBytes += fs.bytesStored;
+			totalRate += fs.requestRate;
+		}
+		auto share = [](double value, double total)
+		{ return total > 0 ? value / total : 0; };
+		size_t best = 0;
+		double bestLoad = 0;
+		bool found = false;
+		for (size_t i = 0; i < servers.size(); i++)
+		{
+			if (!usable(servers, i))
+				continue;
+			double load = share(servers[i].fileCount, totalFiles) + share(servers[i].bytesStored, totalBytes) +
+						  share(servers[i].requestRate, totalRate);
+			if (!found || load < bestLoad)
+			{
+				best = i;
+				bestLoad = load;
+				found = true;
+			}
+		}
+		return best;
+	}
+};
+
+std::unique_ptr<PlacementPolicy> makePlacementPolicy(const std::string &name, const std::vector<FileServer> &servers)
+{
+	if (name == "directory")
+		return std::unique_ptr<PlacementPolicy>(new DirectoryPolicy());
+	if (name == "hash")
+		return std::unique_ptr<PlacementPolicy>(new ConsistentHashPolicy(servers));
+	if (name == "load")
+		return std::unique_ptr<PlacementPolicy>(new LoadAwarePolicy());
+	return nullptr;
+}
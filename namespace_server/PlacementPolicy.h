@@ -0,0 +1,46 @@
+#ifndef PLACEMENT_POLICY_H
+#define PLACEMENT_POLICY_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "NamespaceIndex.h"
+
+// Structure to represent a file server.
+struct FileServer
+{
+	std::string serverId;
+	std::string ip;
+	int port;
+	int fileCount; // Files placed on it, counted from the metadata at startup.
+	// Load reported by the server's STATS, refreshed in the background.
+	uint64_t bytesStored = 0;
+	double requestRate = 0; // Requests per second between the last two reports.
+	bool reachable = true;	// False while STATS gets no answer.
+	uint64_t requestsReported = 0; // Request counter in the last report.
+};
+
+// Chooses the file server a new file is stored on. Called with the file server
+// table locked, so implementations need no locking of their own.
+class PlacementPolicy
+{
+public:
+	virtual ~PlacementPolicy() {}
+	virtual const char *name() const = 0;
+	// Index into servers of the server for a new file.
+	virtual size_t place(const ObjectId &objectId, const std::vector<FileServer> &servers) = 0;
+	// Whether all files of a directory go to the server its directory mapping names.
+	// The policy then only chooses that server, when the directory's first file is
+	// created.
+	virtual bool perDirectory() const { return false; }
+};
+
+// "directory": a directory's files stay on one server, chosen by fewest files.
+// "hash": each file goes to its owner on a consistent-hash ring.
+// "load": each file goes to the server with the lowest combined share of files,
+// bytes stored and request rate.
+// Returns null for an unknown name.
+std::unique_ptr<PlacementPolicy> makePlacementPolicy(const std::string &name, const std::vector<FileServer> &servers);
+
+#endif // PLACEMENT_POLICY_H
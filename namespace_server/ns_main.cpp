@@ -2,6 +2,8 @@
 #include <iostream>
 #include <cstdlib>
 #include <fstream>
+#include <csignal>
+#include <vector>
 
 void ensureFileExists(const std::string &filename, const std::string &defaultContent = "")
 {
@@ -14,23 +16,77 @@ void ensureFileExists(const std::string &filename, const std::string &defaultCon
 	}
 }
 
+static void usage(const char *prog)
+{
+	std::cerr << "Usage: " << prog << " [--sync-interval=MS] [--checkpoint-records=N] [--checkpoint-interval=SEC] [--threads=N] [--placement=directory|hash|load] [--replicas=N] [--fs-timeout=MS] [--max-message=KIB] [port]\n";
+}
+
 int main(int argc, char *argv[])
 {
 	int port = 4000;
-	if (argc > 1)
-		port = std::atoi(argv[1]);
+	int numThreads = 4;
+	std::string placementPolicy = "hash";
+	size_t replicas = 1;
+	int fileServerTimeoutMs = 10000;
+	size_t maxMessageSize = MAX_MESSAGE_SIZE;
+	JournalOptions journalOptions;
+	// Options start with "--"; everything else is positional.
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg.compare(0, 16, "--sync-interval=") == 0)
+			journalOptions.syncIntervalMs = std::atoi(arg.c_str() + 16);
+		else if (arg.compare(0, 21, "--checkpoint-records=") == 0)
+			journalOptions.checkpointRecords = std::strtoul(arg.c_str() + 21, nullptr, 10);
+		else if (arg.compare(0, 22, "--checkpoint-interval=") == 0)
+			journalOptions.checkpointIntervalSec = std::atoi(arg.c_str() + 22);
+		else if (arg.compare(0, 10, "--threads=") == 0)
+			numThreads = std::atoi(arg.c_str() + 10);
+		else if (arg.compare(0, 12, "--placement=") == 0)
+			placementPolicy = arg.substr(12);
+		else if (arg.compare(0, 11, "--replicas=") == 0)
+			replicas = std::strtoul(arg.c_str() + 11, nullptr, 10);
+		else if (arg.compare(0, 13, "--fs-timeout=") == 0)
+			fileServerTimeoutMs = std::atoi(arg.c_str() + 13);
+		else if (arg.compare(0, 14, "--max-message=") == 0)
+			maxMessageSize = std::strtoul(arg.c_str() + 14, nullptr, 10) * 1024;
+		else if (arg.compare(0, 2, "--") == 0)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		else
+			args.push_back(arg);
+	}
+	if (args.size() > 0)
+		port = std::atoi(args[0].c_str());
+	if (numThreads <= 0)
+		numThreads = 4;
+	if (maxMessageSize == 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
 
 	std::string dirFile = "namespace_server/data/directories.txt";
 	std::string fileFile = "namespace_server/data/files.txt";
 	std::string userFile = "namespace_server/data/users.txt";
 	std::string dirMapFile = "namespace_server/data/dirmapping.txt";
+	std::string snapshotFile = "namespace_server/data/metadata.snap";
+	std::string journalFile = "namespace_server/data/journal.log";
+	std::string pendingDeletesFile = "namespace_server/data/pending_deletes.txt";
+	std::string laggingReplicasFile = "namespace_server/data/lagging_replicas.txt";
 
 	ensureFileExists(dirFile, "/\n");
 	ensureFileExists(fileFile);
 	ensureFileExists(userFile);
 	ensureFileExists(dirMapFile, "/ = Server1\n");
 
-	NamespaceServer ns(dirFile, fileFile, userFile, dirMapFile);
-	ns.run(port);
+	// Writes to a client that hung up must not kill the server.
+	signal(SIGPIPE, SIG_IGN);
+
+	NamespaceServer ns(dirFile, fileFile, userFile, dirMapFile, snapshotFile, journalFile, pendingDeletesFile, laggingReplicasFile, placementPolicy, replicas, journalOptions, fileServerTimeoutMs, maxMessageSize);
+	ns.run(port, numThreads);
 	return 0;
 }